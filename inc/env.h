@@ -49,6 +49,17 @@ enum EnvType {
     ENV_TYPE_GUEST,     // A VMM guest OS
 };
 
+// Scheduling classes (see kern/sched.c).  Latency envs with credit left
+// run before batch envs.
+enum {
+    SCHED_CLASS_BATCH = 0,	// Guests and ordinary user envs
+    SCHED_CLASS_LATENCY,	// Services other envs wait on: FS, NS and
+				// the envs they fork
+};
+
+#define SCHED_WEIGHT_DEFAULT	256
+#define SCHED_WEIGHT_MAX	65535
+
 struct Env {
     struct Trapframe env_tf;	// Saved registers
     struct Env *env_link;   // Free list link pointers
@@ -58,6 +69,13 @@ struct Env {
     unsigned env_status;		// Status of the environment
     uint32_t env_runs;		// Number of times environment has run
     int env_cpunum;			// The CPU that the env is running on
+    struct Env *env_rq_next;		// Run queue link (kern/sched.c)
+    int env_rq_cpu;			// Run queue the env is on, or -1
+    int env_sched_class;		// SCHED_CLASS_*
+    uint32_t env_weight;		// CPU share relative to other envs
+    int64_t env_credit;			// TSC cycles left of its share
+    uint64_t env_cputime;		// TSC cycles run in total
+    uint64_t env_vclock;		// Scheduler credit clock it is settled to
 
     // Address space
     pml4e_t *env_pml4e;		// Kernel virtual address of top-level page dir,
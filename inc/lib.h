@@ -66,6 +66,13 @@ int sys_net_try_receive(char *data, int *len);
 
 int sys_ept_map(envid_t srcenvid, void *srcva, envid_t guest, void* guest_pa, int perm);
 envid_t sys_env_mkguest(uint64_t gphysz, uint64_t gRIP);
+int sys_vmx_set_quantum(envid_t guest, uint64_t cycles);
+envid_t sys_env_mkvcpu(envid_t guest);
+int sys_env_set_weight(envid_t envid, uint32_t weight);
+int sys_vmx_get_exit_stats(envid_t guest, struct vmx_exit_stats *buf);
+int sys_vmx_blk_next(envid_t guest, struct vmx_pvblk_req *req, void *buf);
+int sys_vmx_blk_done(envid_t guest, int status, const void *buf);
+int sys_vmx_balloon(envid_t guest, uint64_t pages);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t __attribute__((always_inline))
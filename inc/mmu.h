@@ -116,6 +116,12 @@
 #define CR4_PAE     0x00000020
 #define EFER_MSR    0xC0000080
 #define EFER_LME    8
+#define STAR_MSR    0xC0000081
+#define LSTAR_MSR   0xC0000082
+#define FS_BASE_MSR 0xC0000100
+#define GS_BASE_MSR 0xC0000101
+#define KERNEL_GS_BASE_MSR 0xC0000102
+#define TSC_AUX_MSR 0xC0000103
 
 // Eflags register
 #define FL_CF		0x00000001	// Carry Flag
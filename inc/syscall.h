@@ -23,6 +23,13 @@ enum {
 	SYS_net_try_send,
 	SYS_net_try_receive,
 	SYS_get_block_info,
+	SYS_vmx_set_quantum,
+	SYS_env_mkvcpu,
+	SYS_env_set_weight,
+	SYS_vmx_get_exit_stats,
+	SYS_vmx_blk_next,
+	SYS_vmx_blk_done,
+	SYS_vmx_balloon,
 	NSYSCALLS
 };
 
@@ -3,12 +3,103 @@
 
 #define GUEST_MEM_SZ 16 * 1024 * 1024
 #define MAX_MSR_COUNT ( PGSIZE / 2 ) / ( 128 / 8 )
+// vCPUs per guest.
+#define VMX_MAX_VCPUS 8
 
 #ifndef __ASSEMBLER__
 
+struct vmx_cpuid_entry;
+
+// Run state of a vCPU.  APs start in WAIT_INIT and are brought up by the
+// guest's INIT/STARTUP IPIs.
+enum {
+    VMX_VCPU_RUNNING = 0,
+    VMX_VCPU_WAIT_INIT,
+    VMX_VCPU_WAIT_SIPI,
+};
+
+// Emulated local APIC registers of a vCPU (the ones JOS programs).
+struct vmx_vlapic {
+    uint32_t tpr;
+    uint32_t svr;
+    uint32_t esr;
+    uint32_t icr_lo;
+    uint32_t icr_hi;
+    uint32_t lvt_timer;
+    uint32_t lvt_pcint;
+    uint32_t lvt_lint0;
+    uint32_t lvt_lint1;
+    uint32_t lvt_error;
+    uint32_t ticr;
+    uint32_t tdcr;
+    uint32_t tccr;      // Current count, 0 once a one-shot has fired.
+};
+
+// VM exit statistics, per vCPU (see vmx_exit_account()).  Cycles are TSC
+// cycles spent in the host handling one exit; hist[i] counts the exits
+// that took [2^i, 2^(i+1)) cycles.  vmcall[] splits up EXIT_REASON_VMCALL
+// by hypercall number.
+#define VMX_EXIT_REASONS        64
+#define VMX_VMCALLS             16
+#define VMX_EXIT_HIST_BUCKETS   32
+
+struct vmx_exit_stat {
+    uint64_t count;
+    uint64_t cycles;
+    uint64_t min;
+    uint64_t max;
+    uint32_t hist[VMX_EXIT_HIST_BUCKETS];
+};
+
+struct vmx_exit_stats {
+    struct vmx_exit_stat reason[VMX_EXIT_REASONS];
+    struct vmx_exit_stat vmcall[VMX_VMCALLS];
+};
+
+#define VMX_EXIT_STATS_PAGES \
+    ((sizeof(struct vmx_exit_stats) + PGSIZE - 1) / PGSIZE)
+
 struct VmxGuestInfo {
     uint64_t phys_sz;
     uintptr_t *vmcs;
+    // CPU on which the VMCS was last made current, -1 if never loaded.
+    int vmcs_cpu;
+    // Has the VMCS been launched on vmcs_cpu (VMRESUME vs VMLAUNCH)?
+    bool vmcs_launched;
+    // Virtual processor identifier, 0 if VPIDs are not used.
+    uint16_t vpid;
+    // EPT fault-around window in pages, and demand-paging statistics.
+    int fault_around;
+    uint64_t ept_violations;
+    uint64_t ept_pages_mapped;
+    // Exit counts and costs, VMX_EXIT_STATS_PAGES contiguous pages.
+    struct vmx_exit_stats *exit_stats;
+    // Exit-less request ring registered by the guest, and how many of its
+    // vCPUs are on a CPU to drain it (see vmx_ring_idle()); BSP only.
+    struct vmx_ring *ring;
+    int ring_running;
+    // Paravirtual NIC rings and frame counts, BSP only.
+    struct vmx_pvnet_ring *pvnet[2];
+    // TX descriptors [cons, pvnet_tx_next) are on the card, sent once
+    // e1000_tx_poll() reaches pvnet_tx_stamp.
+    uint32_t pvnet_tx_next;
+    uint64_t pvnet_tx_stamp;
+    uint64_t pvnet_tx_frames;
+    uint64_t pvnet_rx_frames;
+    uint64_t pvnet_rx_drops;
+    // Virtual switch port (vmm/vswitch.h), 0 if none yet, BSP only.
+    int vsw_port;
+    // Paravirtual disk ring, the env serving it (sleeping in
+    // sys_vmx_blk_next() if pvblk_waiting) and request counts, BSP only.
+    struct vmx_pvblk_ring *pvblk;
+    int32_t pvblk_server;
+    bool pvblk_waiting;
+    uint64_t pvblk_reqs;
+    uint64_t pvblk_sectors;
+    // Memory balloon (vmm/balloon.c): pages the guest has handed back and
+    // the number the host wants it to hand back, BSP only.
+    uint64_t balloon_pages;
+    uint64_t balloon_target;
 
     // Exception bitmap.
     uint32_t exception_bmap;
@@ -19,6 +110,50 @@ struct VmxGuestInfo {
     int msr_count;
     uintptr_t *msr_host_area;
     uintptr_t *msr_guest_area;
+    // MSR bitmap, set bits cause exits.
+    uintptr_t *msr_bitmap;
+    // CPUID values seen by the guest, one page.
+    struct vmx_cpuid_entry *cpuid_table;
+    int cpuid_count;
+    // TSC value when the guest was last dispatched by the scheduler, and
+    // the length of its time slice in TSC cycles.
+    uint64_t slice_start;
+    uint64_t quantum;
+    // Is the slice enforced by the VMX-preemption timer, and does the CPU
+    // save the timer value on exit (so fast-path re-entries keep counting)?
+    bool preempt_timer;
+    bool preempt_save;
+    uint64_t preempt_exits;
+    // vmx_ept_gen this vCPU's EPT was last flushed for, on CPUs without
+    // all-context INVEPT; see vmx_ept_sync().
+    uint64_t ept_gen;
+    // Set while the guest sits in HLT (env_status is ENV_NOT_RUNNABLE);
+    // it is woken at halt_deadline (time_msec()) at the latest.
+    bool halted;
+    unsigned int halt_deadline;
+    // VMX_WAKE_* reason of the last wakeup, and HLT exit count.
+    int wake_reason;
+    uint64_t halt_count;
+    // Pending external interrupt vectors, one bit per vector.
+    uint64_t irq_pending[4];
+    // Vector injected on the last VM entry, 0 if none.
+    uint8_t irq_injecting;
+    uint64_t irqs_injected;
+    // Current primary processor-based controls, to toggle interrupt-window
+    // exiting without a VMREAD.
+    uint32_t procbased_ctls;
+
+    // SMP guests.  Each vCPU is an env with its own VMCS; all of them
+    // share the EPT root of vCPU 0, the BSP, which stands for the whole
+    // guest and keeps the list of its vCPUs.  (inc/env.h includes this
+    // file before defining envid_t, hence int32_t.)
+    int vcpu_id;
+    int32_t vcpu_bsp;                   // envid of the BSP
+    int nvcpus;                         // BSP only
+    int32_t vcpus[VMX_MAX_VCPUS];       // BSP only, indexed by APIC ID
+    int vcpu_state;
+    uint8_t sipi_vector;
+    struct vmx_vlapic vlapic;
 };
 
 #endif
@@ -32,6 +167,168 @@ struct VmxGuestInfo {
 // Network related VMCALLS
 #define VMX_VMCALL_NETSEND 0x4
 #define VMX_VMCALL_NETRECV 0x5
+// Does nothing; measures the bare cost of a vmcall round trip.
+#define VMX_VMCALL_NOP 0x6
+// Runs a batch of the vmcalls above in one exit; see struct vmx_multicall.
+#define VMX_VMCALL_MULTICALL 0x7
+// Registers the exit-less request ring at the guest physical address in
+// rdx, or unregisters it if rdx is 0; see struct vmx_ring.
+#define VMX_VMCALL_RING_REGISTER 0x8
+// Does nothing but exit, so the host drains the ring; see struct vmx_ring.
+#define VMX_VMCALL_RING_KICK 0x9
+// Paravirtual NIC: registers the ring page at the guest physical address
+// in rdx (0 to unregister) as the VMX_PVNET_TX or VMX_PVNET_RX ring (rcx),
+// and makes the host consume posted transmit descriptors now.
+#define VMX_VMCALL_NET_SETUP 0xA
+#define VMX_VMCALL_NET_NOTIFY 0xB
+// Paravirtual disk: register the struct vmx_pvblk_ring page at the guest
+// physical address in rdx (0 to unregister), and wake the host backend.
+#define VMX_VMCALL_BLK_SETUP 0xC
+#define VMX_VMCALL_BLK_NOTIFY 0xD
+// Returns the MAC address of the guest's port on the host's virtual
+// switch, byte i in bits [8i, 8i + 8), or < 0 if there is no free port.
+#define VMX_VMCALL_NET_MAC 0xE
+// Memory balloon, see VMX_BALLOON_* below.
+#define VMX_VMCALL_BALLOON 0xF
+
+#ifndef __ASSEMBLER__
+// One call of a VMX_VMCALL_MULTICALL batch.  'nr' and 'args' are what
+// would go in rax and rdx, rcx, rbx, rdi, rsi for the call on its own;
+// the host stores what it would have returned in rax in 'result'.
+// The batch is an array of these in guest memory, passed as its guest
+// physical address in rdx and its length in rcx; it may not cross a page.
+struct vmx_multicall {
+    uint64_t nr;
+    uint64_t args[5];
+    int64_t result;
+};
+#endif
+
+#define VMX_MULTICALL_MAX (PGSIZE / sizeof(struct vmx_multicall))
+// Flags, in rbx: stop at the first call that returns < 0.
+#define VMX_MULTICALL_STOP_ON_ERROR 0x1
+
+// Memory balloon.  VMX_VMCALL_BALLOON takes the operation in rbx and, for
+// INFLATE and DEFLATE, the guest physical address of a page holding rcx
+// page-aligned guest physical addresses in rdx.  INFLATE hands the listed
+// free guest pages to the host, which unmaps and reuses them; DEFLATE
+// takes them back, and each is mapped again on its first touch.  Both
+// return how many leading entries of the list were done, QUERY returns
+// the number of pages the host wants in the balloon; all return < 0 on
+// error.
+#define VMX_BALLOON_QUERY	0
+#define VMX_BALLOON_INFLATE	1
+#define VMX_BALLOON_DEFLATE	2
+#define VMX_BALLOON_MAX		(PGSIZE / sizeof(uint64_t))
+
+// Exit-less request ring, one guest page registered with
+// VMX_VMCALL_RING_REGISTER.  A single guest producer fills
+// req[prod % VMX_RING_SIZE] and then advances prod; whenever a vCPU of the
+// guest exits to the host, the host runs the queued requests like
+// multicall entries, stores each result and advances cons.  A request
+// that finds the receiver busy (-E_IPC_NOT_RECV, -E_TX_FULL) stays at the
+// head and is retried on a later exit.
+//
+// The host sets host_idle while the guest's vCPU is off the CPU (halted,
+// blocked in IPC receive or descheduled) and clears it when the vCPU is
+// dispatched again.  While it runs, the guest's own exits, the host timer's
+// included, drain the ring, so requests are run without a kick.  The guest
+// fences after advancing prod and kicks (VMX_VMCALL_RING_KICK) only if
+// host_idle is set, or when the ring is full; a producer that needs a
+// result sooner than the next exit may kick as well.
+#define VMX_RING_SIZE 32
+
+#ifndef __ASSEMBLER__
+struct vmx_ring {
+    volatile uint32_t prod;
+    volatile uint32_t cons;
+    volatile uint32_t host_idle;
+    uint32_t pad;
+    struct vmx_multicall req[VMX_RING_SIZE];
+};
+#endif
+
+// Paravirtual NIC descriptor rings, one guest page per direction,
+// registered with VMX_VMCALL_NET_SETUP.  The guest posts descriptors at
+// prod; the host completes them in order and advances cons.
+//
+// TX: a descriptor holds a frame to send.  The host sends posted frames on
+// every exit of the guest and on VMX_VMCALL_NET_NOTIFY, which the guest
+// only needs when it makes the ring non-empty while host_idle is set (the
+// host sets it once every posted frame is out) or when the ring is full.  The card reads the frames
+// straight out of guest memory, so a descriptor is completed, and its
+// buffer may be reused, only once the frame is out.
+//
+// RX: a descriptor holds an empty buffer.  The host copies each received
+// frame into the next one, sets its length, and raises guest IRQ
+// VMX_PVNET_IRQ if the guest has set 'irq', clearing it again.
+//
+// Every buffer must lie within one guest page.
+#define VMX_PVNET_TX 0
+#define VMX_PVNET_RX 1
+#define VMX_PVNET_RING 32
+#define VMX_PVNET_IRQ 11
+
+// Descriptor flags, set by the host on completion.
+#define VMX_PVNET_ERROR 0x1     // bad descriptor (TX) or frame too long (RX)
+
+#ifndef __ASSEMBLER__
+struct vmx_pvnet_desc {
+    uint64_t addr;              // guest physical address of the buffer
+    uint16_t len;               // frame length; RX: buffer size when posted
+    uint16_t flags;
+    uint32_t pad;
+};
+
+struct vmx_pvnet_ring {
+    volatile uint32_t prod;
+    volatile uint32_t cons;
+    volatile uint32_t host_idle;
+    volatile uint32_t irq;
+    struct vmx_pvnet_desc desc[VMX_PVNET_RING];
+};
+#endif
+
+// Paravirtual disk request ring, one guest page registered with
+// VMX_VMCALL_BLK_SETUP.  The guest fills req[prod % VMX_PVBLK_RING] and
+// advances prod; a backend env on the host (user/vmm.c) serves requests
+// in order against the guest's disk image, the host kernel copying the
+// data to or from the guest pages in gpa[], and then sets 'status' and
+// advances cons.  Each completion raises guest IRQ VMX_PVBLK_IRQ if the
+// guest has set 'irq', clearing it again.
+//
+// The host sets host_idle while the backend sleeps for want of requests;
+// the guest must then VMX_VMCALL_BLK_NOTIFY after advancing prod.
+//
+// A request moves 'nsecs' sectors starting at 'sector'; gpa[i] holds bytes
+// [i * PGSIZE, (i + 1) * PGSIZE) of the transfer and must not cross a page.
+#define VMX_PVBLK_RING 8
+#define VMX_PVBLK_IRQ 14        // the IDE line
+#define VMX_PVBLK_MAXPAGES 8
+#define VMX_PVBLK_SECTSIZE 512
+#define VMX_PVBLK_MAXSECTS (VMX_PVBLK_MAXPAGES * PGSIZE / VMX_PVBLK_SECTSIZE)
+
+#define VMX_PVBLK_READ 0
+#define VMX_PVBLK_WRITE 1
+
+#ifndef __ASSEMBLER__
+struct vmx_pvblk_req {
+    uint32_t op;                // VMX_PVBLK_READ or VMX_PVBLK_WRITE
+    uint32_t nsecs;
+    uint64_t sector;
+    uint64_t gpa[VMX_PVBLK_MAXPAGES];
+    int32_t status;             // set by the host: 0, or < 0 on error
+    uint32_t pad;
+};
+
+struct vmx_pvblk_ring {
+    volatile uint32_t prod;
+    volatile uint32_t cons;
+    volatile uint32_t host_idle;
+    volatile uint32_t irq;
+    struct vmx_pvblk_req req[VMX_PVBLK_RING];
+};
+#endif
 
 #define VMX_HOST_FS_ENV 0x1
 
@@ -36,6 +36,7 @@ static __inline void write_eflags(uint64_t eflags) __attribute__((always_inline)
 static __inline uint64_t read_rbp(void) __attribute__((always_inline));
 static __inline uint64_t read_rsp(void) __attribute__((always_inline));
 static __inline void cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp);
+static __inline void cpuid_subleaf(uint32_t info, uint32_t subleaf, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp);
 static __inline uint64_t read_tsc(void) __attribute__((always_inline));
 static __inline uint64_t read_msr(uint32_t ecx) __attribute__((always_inline));
 static __inline void write_msr( uint32_t ecx, uint64_t val ) __attribute__((always_inline));
@@ -280,6 +281,24 @@ cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *e
         *edxp = edx;
 }
 
+// cpuid for leaves that take a subleaf index in ecx.
+    static __inline void
+cpuid_subleaf(uint32_t info, uint32_t subleaf, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp)
+{
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid" 
+            : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+            : "a" (info), "c" (subleaf));
+    if (eaxp)
+        *eaxp = eax;
+    if (ebxp)
+        *ebxp = ebx;
+    if (ecxp)
+        *ecxp = ecx;
+    if (edxp)
+        *edxp = edx;
+}
+
 static inline uint32_t
 xchg(volatile uint32_t *addr,uint32_t newval){
     uint32_t result;
@@ -292,9 +311,10 @@ xchg(volatile uint32_t *addr,uint32_t newval){
     static __inline uint64_t
 read_tsc(void)
 {
-    uint64_t tsc;
-    __asm __volatile("rdtsc" : "=A" (tsc));
-    return tsc;
+    uint32_t lo, hi;
+    // "=A" only names rax on x86_64, so collect edx:eax by hand.
+    __asm __volatile("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t) hi << 32) | lo;
 }
 
 static __inline uint64_t
@@ -7,8 +7,8 @@
 #include <inc/mmu.h>
 #include <inc/env.h>
 
-// Disable SMP for bochs (JOS's SMP detection code breaks on bochs).
-#define NCPU  1
+// Maximum number of CPUs
+#define NCPU  8
 
 
 
@@ -26,6 +26,10 @@ struct Cpu {
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
     bool is_vmx_root;               // Is the CPU in VMX root mode?
     uintptr_t vmxon_region;         // KVA of vmxon region.
+    uintptr_t loaded_vmcs;          // KVA of the current VMCS, 0 if none.
+    uint64_t vmptrld_skipped;       // VMPTRLDs avoided via loaded_vmcs.
+    uint64_t cpu_run_start;         // TSC when cpu_env was dispatched.
+    uint64_t ept_gen;               // vmx_ept_gen last flushed here.
 };
 
 // Initialized in mpconfig.c
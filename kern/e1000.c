@@ -1,16 +1,22 @@
 #include <kern/e1000.h>
+#include <kern/spinlock.h>
 
 struct tx_desc tx_desc_array[E1000_TXDESCSZ] __attribute__((aligned(16)));
 struct tx_pkt tx_pkt_bufs[E1000_TXDESCSZ];
+// Page pinned by the zero-copy frame in each transmit descriptor, until
+// the card sets DD on it.  tx_clean is the oldest descriptor not yet
+// reclaimed; tx_queued and tx_done count frames handed to the card and
+// reclaimed.
+static struct Page *tx_pinned[E1000_TXDESCSZ];
+static uint32_t tx_clean;
+static uint64_t tx_queued;
+static uint64_t tx_done;
 
 struct rcv_desc rcv_desc_array[E1000_RCVDESCSZ] __attribute__ ((aligned (16)));
 struct rcv_pkt rcv_pkt_bufs[E1000_RCVDESCSZ];
 
-// Guest pkt buffer
-struct rcv_desc guest_rcv_desc_array[E1000_RCVDESCSZ] __attribute__ ((aligned (16)));	// Guest desc for receiving -- cant do only with the buffer
-struct rcv_pkt guest_rcv_pkt_bufs[E1000_RCVDESCSZ]; // 64 -each of size 2048
-int guest_hd = 0;	// head counter for guest buf
-int guest_tl = 0;	// tail counter for guest buf
+// MAC address of the card, in receive address slot 0.
+static const uint8_t e1000_macaddr[6] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 };
 
 // LAB 6: Your driver code here
 int e1000_attach (struct pci_func *f) {
@@ -58,17 +64,10 @@ int e1000_attach (struct pci_func *f) {
 	memset(rcv_pkt_bufs, 0x0, sizeof(struct rcv_pkt) * E1000_RCVDESCSZ);
 	for (i = 0; i < E1000_RCVDESCSZ; i++) {
 		rcv_desc_array[i].addr = PADDR(rcv_pkt_bufs[i].buf);
-		guest_rcv_desc_array[i].addr = PADDR(guest_rcv_pkt_bufs[i].buf);	// Initializing Guest desc also
-		guest_rcv_desc_array[i].length = 0;
-		guest_rcv_desc_array[i].status = 0;
-		guest_rcv_desc_array[i].pktcsum = 0;
-		guest_rcv_desc_array[i].errors = 0;
-		guest_rcv_desc_array[i].special = 0;
 	}	
 	
 	//Program the Receive Address Register(s) (RAL/RAH) with the desired Ethernet addresses
-	e1000[E1000_RAL] = 0x12005452;
-	e1000[E1000_RAH] = 0x80005634;
+	e1000_set_mac(0, e1000_macaddr);
 	
 	
 	//Program the Receive Descriptor Base Address Registers
@@ -95,131 +94,191 @@ int e1000_attach (struct pci_func *f) {
 	return 0;
 }
 
+// Copy the card's own MAC address to mac.
+void
+e1000_get_mac(uint8_t *mac)
+{
+	memmove(mac, e1000_macaddr, 6);
+}
 
-int
-e1000_transmit(char *data, int len)
+// Make the card accept unicast frames for mac in receive address slot
+// 'slot' (0 is the card's own address), or stop if mac is NULL.
+void
+e1000_set_mac(int slot, const uint8_t *mac)
 {
-	if (len > E1000_TXPCKTSZ) {
-		return -E_PKT_TOO_LONG;
+	if (!e1000 || slot < 0 || slot >= E1000_RA_SLOTS)
+		return;
+	spin_lock(&e1000_lock);
+	e1000[E1000_RAH + 2 * slot] = 0;
+	if (mac) {
+		e1000[E1000_RAL + 2 * slot] = mac[0] | (mac[1] << 8) |
+			(mac[2] << 16) | ((uint32_t) mac[3] << 24);
+		e1000[E1000_RAH + 2 * slot] = mac[4] | (mac[5] << 8) |
+			E1000_RAH_AV;
+	}
+	spin_unlock(&e1000_lock);
+}
+
+
+// Reclaims the descriptors before tdt that the card is done with, storing
+// the pages they pinned in freed[] so the caller can release them once it
+// has dropped e1000_lock.  Returns the number of pages stored.
+static int
+e1000_tx_reclaim(uint32_t tdt, struct Page **freed)
+{
+	int n = 0;
+
+	while (tx_clean != tdt &&
+	       (tx_desc_array[tx_clean].status & E1000_TXD_STAT_DD)) {
+		if (tx_pinned[tx_clean]) {
+			freed[n++] = tx_pinned[tx_clean];
+			tx_pinned[tx_clean] = NULL;
+		}
+		tx_clean = (tx_clean + 1) % E1000_TXDESCSZ;
+		tx_done++;
 	}
-//	cprintf("\n IN E1000 transmit \n");
-//	cprintf("\n DATA :0x%x:%d\n", data, len);
-	uint32_t tdt = e1000[E1000_TDT];
-	// Check if next tx_desc is free
-	if (tx_desc_array[tdt].status & E1000_TXD_STAT_DD) {
-		memmove(tx_pkt_bufs[tdt].buf, data, len);
-		tx_desc_array[tdt].length = len;
+	return n;
+}
+
+// Queue frames data[0..n) (of lengths len[], at most E1000_TXPCKTSZ each),
+// telling the card about them with a single tail register write.  With
+// zerocopy, the card reads each frame where it is, and the page holding
+// it stays pinned until the card is done; otherwise, or if the frame
+// crosses a page or its page is not refcounted, the frame is copied into
+// the descriptor's own buffer.  Returns how many frames were queued and
+// stores in *stamp (if not NULL) the e1000_tx_poll() count at which the
+// last of them is done.
+static int
+e1000_tx_queue(char **data, int *len, int n, bool zerocopy, uint64_t *stamp)
+{
+	struct Page *freed[E1000_TXDESCSZ], *pp;
+	uint32_t tdt;
+	int i, nfreed;
+
+	if (!e1000)
+		return 0;
+	spin_lock(&e1000_lock);
+	tdt = e1000[E1000_TDT];
+	nfreed = e1000_tx_reclaim(tdt, freed);
+	for (i = 0; i < n; i++) {
+		// Keep one descriptor free: to the card, TDT == TDH means an
+		// empty ring.
+		if ((tdt + 1) % E1000_TXDESCSZ == tx_clean)
+			break;
+		pp = NULL;
+		if (zerocopy && PGOFF(data[i]) + len[i] <= PGSIZE &&
+		    (pp = pa2page(PADDR(data[i])))->pp_ref == 0)
+			pp = NULL;
+		if (pp) {
+			__sync_fetch_and_add(&pp->pp_ref, 1);
+			tx_pinned[tdt] = pp;
+			tx_desc_array[tdt].addr = PADDR(data[i]);
+		} else {
+			memmove(tx_pkt_bufs[tdt].buf, data[i], len[i]);
+			tx_desc_array[tdt].addr = PADDR(tx_pkt_bufs[tdt].buf);
+		}
+		tx_desc_array[tdt].length = len[i];
 
 		tx_desc_array[tdt].status &= ~E1000_TXD_STAT_DD;		// Clear DD so that we can use it to check whether the packet got sent
 		tx_desc_array[tdt].cmd |= E1000_TXD_CMD_RS;			// to get the card to set dd when done sending
 		tx_desc_array[tdt].cmd |= E1000_TXD_CMD_EOP;			// to indicate last packet
-//cprintf("DABRAL:%d:%s\n", __LINE__, __FILE__);
-		e1000[E1000_TDT] = (tdt + 1) % E1000_TXDESCSZ;
+		tdt = (tdt + 1) % E1000_TXDESCSZ;
 	}
-	else { // tx queue is full!
+	if (i)
+		e1000[E1000_TDT] = tdt;
+	tx_queued += i;
+	if (stamp)
+		*stamp = tx_queued;
+	spin_unlock(&e1000_lock);
+	// e1000_lock is a leaf, so free the pages (page_lock) only now.
+	while (nfreed > 0)
+		page_decref(freed[--nfreed]);
+	return i;
+}
+
+// Send the frame [data, data + len) from a kernel buffer, copying it.
+int
+e1000_transmit(char *data, int len)
+{
+	if (len > E1000_TXPCKTSZ) {
+		return -E_PKT_TOO_LONG;
+	}
+	if (e1000_tx_queue(&data, &len, 1, false, NULL) == 0) {
+		// tx queue is full!
 		return -E_TX_FULL;
 	}
 	return 0;
 }
 
+// Send frames data[0..n), at most E1000_TXPCKTSZ long each, without
+// copying them.  They must lie in guest or user memory, at kernel
+// addresses; each page stays alive until the card is done with it.  The
+// caller must not reuse the buffers until e1000_tx_poll() reaches the
+// count stored in *stamp: they are sent from wherever they are then.
+// Returns how many were queued, fewer than n if the transmit ring filled
+// up.
 int
-e1000_receive(char *data)
+e1000_transmit_pages(char **data, int *len, int n, uint64_t *stamp)
 {
-	uint32_t rdt, len, i = 0;
+	assert(stamp);
+	return e1000_tx_queue(data, len, n, true, stamp);
+}
+
+// Reclaim the descriptors the card has finished sending and unpin their
+// pages.  Returns the number of frames sent since boot.
+uint64_t
+e1000_tx_poll(void)
+{
+	struct Page *freed[E1000_TXDESCSZ];
+	uint64_t done;
+	int nfreed;
+
+	if (!e1000)
+		return tx_done;
+	spin_lock(&e1000_lock);
+	nfreed = e1000_tx_reclaim(e1000[E1000_TDT], freed);
+	done = tx_done;
+	spin_unlock(&e1000_lock);
+	while (nfreed > 0)
+		page_decref(freed[--nfreed]);
+	return done;
+}
+
+// Return the length of the next frame the card has received and point
+// *frame at it in the receive buffer, or return -E_RCV_EMPTY.  The buffer
+// is not reused until e1000_rx_release().
+int
+e1000_rx_peek(char **frame)
+{
+	uint32_t rdt;
+	int len = -E_RCV_EMPTY;
+
+	if (!e1000)
+		return len;
+	spin_lock(&e1000_lock);
 	rdt = e1000[E1000_RDT];
-//	cprintf("\n THE GEUST HEAD IN E1000_RCV is:%d\n", guest_hd);
-//	cprintf("\n IN E1000 RECEIVE \n");
 	//if next rcvdesc is filled
-//	guest_rcv_desc_array[guest_hd].status = rcv_desc_array[rdt].status;
 	if (rcv_desc_array[rdt].status & E1000_RXD_STAT_DD) {
-		
-//	guest_rcv_desc_array[guest_hd].status = rcv_desc_array[rdt].status;
 		if (!(rcv_desc_array[rdt].status & E1000_RXD_STAT_EOP)) {
 			panic("We don't allow jumbo frames!\n");
 		}
-		
-		guest_rcv_desc_array[guest_hd].status = rcv_desc_array[rdt].status;
+		*frame = (char *) rcv_pkt_bufs[rdt].buf;
 		len = rcv_desc_array[rdt].length;
-		guest_rcv_desc_array[guest_hd].length = rcv_desc_array[rdt].length;			//copying the length to the guest desc
-		memmove(data, rcv_pkt_bufs[rdt].buf, len);
-		// Copying the pkt into guest pkt buf
-		memmove(guest_rcv_pkt_bufs[guest_hd].buf, rcv_pkt_bufs[rdt].buf, len);
-//                cprintf("\n DATA od LEN=[%d]=[",guest_rcv_desc_array[guest_hd].length);
-//		for(i = 0;i < guest_rcv_desc_array[guest_hd].length; i++)
-//		     cprintf("%u ",guest_rcv_pkt_bufs[guest_hd].buf[i]);
-//		cprintf("]\n");
-//		cprintf("\n HOST BUF OKT DATA \n");
-//		for(i = 0;i < rcv_desc_array[rdt].length; i++)
-//		     cprintf("%u ",data[i]);
-//		cprintf("]\n");
-		
-		rcv_desc_array[rdt].status &= ~E1000_RXD_STAT_DD;
-		rcv_desc_array[rdt].status &= ~E1000_RXD_STAT_EOP;
-		e1000[E1000_RDT] = (rdt + 1) % E1000_RCVDESCSZ;
-
-		if (guest_hd == 63)
-		    guest_hd = 0;
-		else
-		    ++guest_hd;
-
-		return len;
 	}
-	//no packets found.
-	return -E_RCV_EMPTY;
+	spin_unlock(&e1000_lock);
+	return len;
 }
 
-
-int 
-guest_rcv(char *data, int *rlen, int *rret)
+// Give the buffer of the frame e1000_rx_peek() returned back to the card.
+void
+e1000_rx_release(void)
 {
-    int len = 0,i=0;
-    char *g_src = NULL;
-
- //   cprintf("\n GUEST HEAD AND TAILS IN GUEST RCV:%d:%d\n", guest_hd, guest_tl);
+	uint32_t rdt;
 
-    if (guest_rcv_desc_array[guest_tl].status & E1000_RXD_STAT_DD) 
-    {
-	if (!(guest_rcv_desc_array[guest_tl].status & E1000_RXD_STAT_EOP)) 
-	{
-	    panic("We don't allow jumbo frames in guest_RCV!\n");
-	}
-
-    	len = guest_rcv_desc_array[guest_tl].length;
-	memmove(data, guest_rcv_pkt_bufs[guest_tl].buf, len);
-        g_src = (char *) guest_rcv_pkt_bufs[guest_tl].buf;	
-//	for(i = 0; i < guest_rcv_desc_array[guest_tl].length; i++)
-//	{
-//	    data[i] = guest_rcv_pkt_bufs[guest_tl].buf[i];
-//	    data[i] = g_src[i];
-//	}
-
-//        cprintf("\n DATA-GUEST od LEN=[%d]=[",guest_rcv_desc_array[guest_tl].length);
-//	for(i=0;i<guest_rcv_desc_array[guest_tl].length;i++)
-//	     cprintf("%u ",guest_rcv_pkt_bufs[guest_tl].buf[i]);
-//	cprintf("]\n");
-//    	cprintf("\n CHEK PRINT IN GUEST BUF \n");
-//	for(i=0;i<guest_rcv_desc_array[guest_tl].length;i++)
-//	     cprintf("%u ",data[i]);
-//	cprintf("]\n");
-
-//   	guest_rcv_desc_array[guest_tl].status &= ~E1000_RXD_STAT_DD;
-//    	guest_rcv_desc_array[guest_tl].status &= ~E1000_RXD_STAT_EOP;
-	guest_rcv_desc_array[i].length = 0;
-	guest_rcv_desc_array[i].status = 0;
-	guest_rcv_desc_array[i].pktcsum = 0;
-	guest_rcv_desc_array[i].errors = 0;
-	guest_rcv_desc_array[i].special = 0;
-
-	if (guest_tl == 63)
-		guest_tl = 0;
-    	else
-		++guest_tl;
-	*rlen = len;
-	*rret = 0;
-     	return 0;
-    }
-    *rlen = (int) 0;
-    *rret =(int) -E_RCV_EMPTY;
-
-    return -E_RCV_EMPTY;
+	spin_lock(&e1000_lock);
+	rdt = e1000[E1000_RDT];
+	rcv_desc_array[rdt].status &= ~E1000_RXD_STAT_DD;
+	rcv_desc_array[rdt].status &= ~E1000_RXD_STAT_EOP;
+	e1000[E1000_RDT] = (rdt + 1) % E1000_RCVDESCSZ;
+	spin_unlock(&e1000_lock);
 }
@@ -45,6 +45,8 @@
 #define E1000_RDT		0x02818/4
 #define E1000_RAL		0x05400/4
 #define E1000_RAH		0x05404/4
+#define E1000_RAH_AV		0x80000000	// address valid
+#define E1000_RA_SLOTS		16
 
 
 #define E1000_RCTL			0x00100/4
@@ -63,8 +65,12 @@
 
 int e1000_attach(struct pci_func *f);
 int e1000_transmit(char *data, int len);
-int e1000_receive(char *data);
-int guest_rcv(char *data, int *rlen, int *rret);
+int e1000_transmit_pages(char **data, int *len, int n, uint64_t *stamp);
+uint64_t e1000_tx_poll(void);
+int e1000_rx_peek(char **frame);
+void e1000_rx_release(void);
+void e1000_get_mac(uint8_t *mac);
+void e1000_set_mac(int slot, const uint8_t *mac);
 
 volatile uint32_t *e1000;
 
@@ -18,9 +18,15 @@
 #include <kern/spinlock.h>
 #include <vmm/vmx.h>
 #include <vmm/ept.h>
+#include <vmm/cpuid.h>
+#include <vmm/vlapic.h>
+#include <vmm/pvnet.h>
+#include <vmm/pvblk.h>
+#include <vmm/vswitch.h>
 
 struct Env *envs = NULL;		// All environments
-static struct Env *env_free_list;	// Free environment list
+static struct Env *env_free_list;	// Free environment list, env_lock
+struct spinlock env_as_locks[NENV];	// Address space locks, env_as_lock()
 // (linked by Env->env_link)
 
 #define ENVGENSHIFT	12		// >= LOGNENV
@@ -129,6 +135,7 @@ env_init(void)
     for (i=0; i<NENV; i++) 
     {
 	envs[i].env_id = 0;
+	envs[i].env_rq_cpu = -1;
 	if (i == 0)
 	{
 	    env_free_list = &envs[i];
@@ -141,6 +148,7 @@ env_init(void)
 	{
 	    envs[i].env_link = &envs[i+1];
 	}
+	__spin_initlock(&env_as_locks[i], "env_as");
      }
 
     // Per-CPU part of the initialization
@@ -330,8 +338,8 @@ env_setup_vm(struct Env *e)
 
 	return 0;
 }
-int
-env_guest_alloc(struct Env **newenv_store, envid_t parent_id)
+static int
+env_guest_alloc_locked(struct Env **newenv_store, envid_t parent_id)
 {
     int32_t generation;
     struct Env *e;
@@ -341,6 +349,10 @@ env_guest_alloc(struct Env **newenv_store, envid_t parent_id)
         return -E_NO_FREE_ENV;
 
     memset(&e->env_vmxinfo, 0, sizeof(struct VmxGuestInfo));
+    e->env_vmxinfo.vmcs_cpu = -1;
+    e->env_vmxinfo.vpid = vmx_alloc_vpid(e);
+    e->env_vmxinfo.fault_around = EPT_FAULT_AROUND_DEFAULT;
+    e->env_vmxinfo.quantum = VMX_GUEST_QUANTUM_DEFAULT;
 
     // allocate a page for the EPT PML4..
     struct Page *p = NULL;
@@ -395,17 +407,68 @@ env_guest_alloc(struct Env **newenv_store, envid_t parent_id)
     t->pp_ref += 1;
     e->env_vmxinfo.io_bmap_b = page2kva(t);
 
+    // Allocate a page for the MSR bitmap.
+    struct Page *u = NULL;
+    if (!(u = page_alloc(ALLOC_ZERO))) {
+        page_decref(p);
+        page_decref(q);
+        page_decref(r);
+        page_decref(s);
+        page_decref(t);
+        return -E_NO_MEM;
+    }
+    u->pp_ref += 1;
+    e->env_vmxinfo.msr_bitmap = page2kva(u);
+
+    // Allocate and fill the CPUID table.
+    struct Page *c = NULL;
+    if (!(c = page_alloc(ALLOC_ZERO))) {
+        page_decref(p);
+        page_decref(q);
+        page_decref(r);
+        page_decref(s);
+        page_decref(t);
+        page_decref(u);
+        return -E_NO_MEM;
+    }
+    c->pp_ref += 1;
+    e->env_vmxinfo.cpuid_table = page2kva(c);
+    vmx_cpuid_init(&e->env_vmxinfo);
+
+    // Allocate the exit statistics.
+    struct Page *st = NULL;
+    int i;
+    if (!(st = page_alloc_contig(VMX_EXIT_STATS_PAGES, 1, ALLOC_ZERO))) {
+        page_decref(p);
+        page_decref(q);
+        page_decref(r);
+        page_decref(s);
+        page_decref(t);
+        page_decref(u);
+        page_decref(c);
+        return -E_NO_MEM;
+    }
+    for (i = 0; i < VMX_EXIT_STATS_PAGES; i++)
+        st[i].pp_ref += 1;
+    e->env_vmxinfo.exit_stats = page2kva(st);
+
     // Generate an env_id for this environment.
     generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
     if (generation <= 0)	// Don't create a negative env_id.
         generation = 1 << ENVGENSHIFT;
     e->env_id = generation | (e - envs);
 
+    // A new guest has a single vCPU, its BSP; see env_vcpu_alloc().
+    e->env_vmxinfo.vcpu_bsp = e->env_id;
+    e->env_vmxinfo.nvcpus = 1;
+    e->env_vmxinfo.vcpus[0] = e->env_id;
+    vlapic_init(&e->env_vmxinfo);
+
     // Set the basic status variables.
     e->env_parent_id = parent_id;
     e->env_type = ENV_TYPE_GUEST;
-    e->env_status = ENV_RUNNABLE;
     e->env_runs = 0;
+    sched_env_init(e, SCHED_CLASS_BATCH);
 
     memset(&e->env_tf, 0, sizeof(e->env_tf));
 
@@ -414,12 +477,148 @@ env_guest_alloc(struct Env **newenv_store, envid_t parent_id)
 
     // commit the allocation
     env_free_list = e->env_link;
+    e->env_cpunum = cpunum();
+    e->env_status = ENV_RUNNABLE;
     *newenv_store = e;
 
     return 0;
 }
 
+int
+env_guest_alloc(struct Env **newenv_store, envid_t parent_id)
+{
+    int r;
+
+    spin_lock(&env_lock);
+    r = env_guest_alloc_locked(newenv_store, parent_id);
+    spin_unlock(&env_lock);
+    return r;
+}
+
+//
+// Returns the lock protecting e's page tables (or EPT).  All the vCPUs of a
+// guest share the BSP's EPT and so its lock.
+//
+struct spinlock *
+env_as_lock(struct Env *e)
+{
+    struct Env *bsp = e;
+
+    if (e->env_type == ENV_TYPE_GUEST && e->env_vmxinfo.vcpu_id)
+        bsp = &envs[ENVX(e->env_vmxinfo.vcpu_bsp)];
+    return &env_as_locks[ENVX(bsp->env_id)];
+}
+
+// Locks the address spaces of a and b (which may be the same) in a fixed
+// order, so two CPUs mapping between the same pair cannot deadlock.
+void
+env_as_lock_pair(struct Env *a, struct Env *b)
+{
+    struct spinlock *la = env_as_lock(a), *lb = env_as_lock(b);
+
+    if (la == lb) {
+        spin_lock(la);
+        return;
+    }
+    if (la > lb) {
+        struct spinlock *t = la;
+        la = lb;
+        lb = t;
+    }
+    spin_lock(la);
+    spin_lock(lb);
+}
+
+void
+env_as_unlock_pair(struct Env *a, struct Env *b)
+{
+    struct spinlock *la = env_as_lock(a), *lb = env_as_lock(b);
+
+    spin_unlock(la);
+    if (la != lb)
+        spin_unlock(lb);
+}
+
+//
+// Adds an application processor to guest bsp.  The vCPU is an env of its
+// own, with its own VMCS, sharing the BSP's EPT.  It stays not runnable
+// until the guest starts it with INIT and STARTUP IPIs (see vmm/vlapic.c).
+//
+int
+env_vcpu_alloc(struct Env **newenv_store, struct Env *bsp)
+{
+    struct VmxGuestInfo *g = &bsp->env_vmxinfo;
+    struct Env *e;
+    int r;
+
+    if (g->nvcpus >= VMX_MAX_VCPUS)
+        return -E_NO_FREE_ENV;
+    if ((r = env_guest_alloc(&e, bsp->env_parent_id)) < 0)
+        return r;
+
+    // Swap the fresh EPT root for the BSP's.
+    page_decref(pa2page(e->env_cr3));
+    e->env_pml4e = bsp->env_pml4e;
+    e->env_cr3 = bsp->env_cr3;
+    // Other CPUs drop references with page_decref() without the kernel
+    // lock, so take this one atomically too.
+    __sync_fetch_and_add(&pa2page(e->env_cr3)->pp_ref, 1);
+
+    e->env_vmxinfo.phys_sz = g->phys_sz;
+    e->env_vmxinfo.vcpu_id = g->nvcpus;
+    e->env_vmxinfo.vcpu_bsp = bsp->env_id;
+    e->env_vmxinfo.nvcpus = 0;
+    e->env_vmxinfo.vcpus[0] = 0;
+    e->env_vmxinfo.vcpu_state = VMX_VCPU_WAIT_INIT;
+    // Redo the CPUID table for the new APIC ID.
+    vmx_cpuid_init(&e->env_vmxinfo);
+    e->env_status = ENV_NOT_RUNNABLE;
+
+    g->vcpus[g->nvcpus++] = e->env_id;
+    *newenv_store = e;
+    return 0;
+}
+
+// A guest lives and dies as a whole: freeing the BSP frees its APs, and
+// losing an AP takes the rest of the guest down with it.
+static void
+env_guest_free_vcpus(struct Env *e)
+{
+    struct VmxGuestInfo *g = &e->env_vmxinfo;
+    struct Env *v;
+    int i, n;
+
+    if (g->vcpu_id == 0) {
+        n = g->nvcpus;
+        g->nvcpus = 0;
+        for (i = 1; i < n; i++) {
+            envid_t id = g->vcpus[i];
+
+            g->vcpus[i] = 0;
+            if (id && envid2env(id, &v, 0) == 0 && v != curenv)
+                env_destroy(v);
+        }
+    } else if (envid2env(g->vcpu_bsp, &v, 0) == 0 &&
+            v->env_vmxinfo.nvcpus && v != curenv) {
+        v->env_vmxinfo.vcpus[g->vcpu_id] = 0;
+        env_destroy(v);
+    }
+}
+
 void env_guest_free(struct Env *e) {
+    int i;
+
+    env_guest_free_vcpus(e);
+    // Stop handing frames to its paravirtual NIC.
+    vmx_pvnet_free(e);
+    // Give up its virtual switch port.
+    vsw_guest_free(e);
+    // Drop its disk ring and release the backend serving it.
+    vmx_pvblk_free(e);
+    // Make sure no CPU still thinks the VMCS is current.
+    vmx_vmcs_release(e);
+    // Flush TLB entries tagged with the VPID, the next owner reuses it.
+    vmx_invvpid(e);
     // Free the VMCS.
     page_decref(pa2page(PADDR(e->env_vmxinfo.vmcs)));
     // Free msr load/store area.
@@ -427,10 +626,22 @@ void env_guest_free(struct Env *e) {
     // Free IO bitmaps page.
     page_decref(pa2page(PADDR(e->env_vmxinfo.io_bmap_a)));
     page_decref(pa2page(PADDR(e->env_vmxinfo.io_bmap_b)));
+    // Free MSR bitmap page.
+    page_decref(pa2page(PADDR(e->env_vmxinfo.msr_bitmap)));
+    // Free the CPUID table.
+    page_decref(pa2page(PADDR(e->env_vmxinfo.cpuid_table)));
+    // Free the exit statistics.
+    for (i = 0; i < VMX_EXIT_STATS_PAGES; i++)
+        page_decref(pa2page(PADDR(e->env_vmxinfo.exit_stats)) + i);
+    if (e->env_vmxinfo.halted) {
+        e->env_vmxinfo.halted = false;
+        vmx_halted_guests--;
+    }
     
     // Free the host pages that were allocated for the guest and 
-    // the EPT tables itself.
-    free_guest_mem(e->env_pml4e);
+    // the EPT tables itself, once the last vCPU using them is gone.
+    if (pa2page(e->env_cr3)->pp_ref == 1)
+        free_guest_mem(e->env_pml4e);
 
     // Free the EPT PML4 page.
     page_decref(pa2page(e->env_cr3));
@@ -438,9 +649,11 @@ void env_guest_free(struct Env *e) {
     e->env_cr3 = 0;
 
     // return the environment to the free list
+    spin_lock(&env_lock);
     e->env_status = ENV_FREE;
     e->env_link = env_free_list;
     env_free_list = e;
+    spin_unlock(&env_lock);
 
     cprintf("[%08x] free vmx guest env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 }
@@ -453,8 +666,8 @@ void env_guest_free(struct Env *e) {
 //	-E_NO_FREE_ENV if all NENVS environments are allocated
 //	-E_NO_MEM on memory exhaustion
 //
-    int
-env_alloc(struct Env **newenv_store, envid_t parent_id)
+    static int
+env_alloc_locked(struct Env **newenv_store, envid_t parent_id)
 {
     int32_t generation;
     int r;
@@ -476,8 +689,8 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
     // Set the basic status variables.
     e->env_parent_id = parent_id;
     e->env_type = ENV_TYPE_USER;
-    e->env_status = ENV_RUNNABLE;
     e->env_runs = 0;
+    sched_env_init(e, SCHED_CLASS_BATCH);
 
     // Clear out all the saved register state,
     // to prevent the register values
@@ -512,12 +725,25 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
     // commit the allocation
     env_free_list = e->env_link;
+    e->env_cpunum = cpunum();
+    e->env_status = ENV_RUNNABLE;
     *newenv_store = e;
 
     cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
     return 0;
 }
 
+    int
+env_alloc(struct Env **newenv_store, envid_t parent_id)
+{
+    int r;
+
+    spin_lock(&env_lock);
+    r = env_alloc_locked(newenv_store, parent_id);
+    spin_unlock(&env_lock);
+    return r;
+}
+
 //
 // Allocate len bytes of physical memory for environment env,
 // and map it at virtual address va in the environment's address space.
@@ -709,6 +935,12 @@ env_create(uint8_t *binary, enum EnvType type)
        {
 	   env->env_tf.tf_eflags |= FL_IOPL_MASK;
        }
+       // Everything else waits on the file and network servers.
+       if (env->env_type == ENV_TYPE_FS || env->env_type == ENV_TYPE_NS)
+	   env->env_sched_class = SCHED_CLASS_LATENCY;
+       // Queued only now that it can run.  Idle envs are never queued.
+       if (env->env_type != ENV_TYPE_IDLE)
+	   sched_wakeup(env);
    }
 }
 
@@ -778,9 +1010,11 @@ env_free(struct Env *e)
     page_decref(pa2page(pa));
 
     // return the environment to the free list
+    spin_lock(&env_lock);
     e->env_status = ENV_FREE;
     e->env_link = env_free_list;
     env_free_list = e;
+    spin_unlock(&env_lock);
 }
 
 //
@@ -798,6 +1032,16 @@ env_destroy(struct Env *e)
         e->env_status = ENV_DYING;
         return;
     }
+    // A guest's VMCS stays active on the CPU it last ran on and only that
+    // CPU can VMCLEAR it, so leave freeing the guest to that CPU's
+    // sched_yield().
+    if (e->env_type == ENV_TYPE_GUEST && e->env_vmxinfo.vmcs_cpu >= 0 &&
+            e->env_vmxinfo.vmcs_cpu != cpunum()) {
+        e->env_status = ENV_DYING;
+        // Queue it there so that CPU's sched_yield() frees it.
+        sched_enqueue(e);
+        return;
+    }
 
     if(e->env_type == ENV_TYPE_GUEST) 
         env_guest_free(e);
@@ -871,7 +1115,7 @@ env_run(struct Env *e)
     curenv = e;
     curenv->env_status = ENV_RUNNING;
     curenv->env_runs++;
-//    unlock_kernel();  //llubu: comment
+    unlock_kernel();
     lcr3(curenv->env_cr3);
     env_pop_tf(&(curenv->env_tf));
     panic("env_run not yet implemented");
@@ -23,6 +23,11 @@ void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
 
 int env_guest_alloc(struct Env **newenv_store, envid_t parent_id);
+int env_vcpu_alloc(struct Env **newenv_store, struct Env *bsp);
+
+struct spinlock *env_as_lock(struct Env *e);
+void env_as_lock_pair(struct Env *a, struct Env *b);
+void env_as_unlock_pair(struct Env *a, struct Env *b);
 
 // Without this extra macro, we couldn't pass macros like TEST to
 // ENV_CREATE because of the C pre-processor's argument prescan rule.
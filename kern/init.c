@@ -20,6 +20,7 @@
 #include <kern/time.h>
 #include <kern/pci.h>
 #include <kern/e1000.h>
+#include <vmm/vmx.h>
 
 //#include <vmm/ept.h>
 #if defined(TEST_EPT_MAP)
@@ -91,10 +92,11 @@ i386_init(void)
 
 	// Acquire the big kernel lock before waking up APs
 	// Your code here:
+	lock_kernel();
 
 #ifndef VMM_GUEST
 	// Starting non-boot CPUs
-//	boot_aps();
+	boot_aps();
 #endif
 
 	// Should always have idle processes at first.
@@ -169,6 +171,8 @@ boot_aps(void)
 void
 mp_main(void)
 {
+	int r;
+
 	// We are in high EIP now, safe to switch to kern_pgdir 
 	lcr3(boot_cr3);
 	cprintf("SMP: CPU %d starting\n", cpunum());
@@ -183,9 +187,13 @@ mp_main(void)
 	// only one CPU can enter the scheduler at a time!
 	//
 	// Your code here:
+	lock_kernel();
+
+	// Enter VMX root operation here too, so guests can run on this CPU.
+	if ((r = vmx_init_vmxon()) < 0)
+		cprintf("SMP: CPU %d: VMXON failed: %e\n", cpunum(), r);
 
-	// Remove this after you finish Exercise 4
-	for (;;);
+	sched_yield();
 }
 
 /*
@@ -12,6 +12,12 @@
 #include <kern/kdebug.h>
 #include <kern/trap.h>
 #include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/spinlock.h>
+#include <vmm/vmx.h>
+#include <vmm/vswitch.h>
+#include <vmm/balloon.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -32,7 +38,14 @@ static struct Command commands[] = {
 	{ "showmappings", "Show the virtual to physical mappings", mon_showmappings},
 	{ "dump", "Show the contents at virtual address", mon_dumpmemcontents},
 	{ "changeperm", "Change the permissions of page at particular virtual address", mon_changepermissions},
-	{ "statpages", "Stat the mapped pages to display number of read/write/present pages", mon_statpages}
+	{ "statpages", "Stat the mapped pages to display number of read/write/present pages", mon_statpages},
+	{ "exitstat", "Show per-guest VM exit counts and host cycles: exitstat [envid]", mon_exitstat},
+	{ "vmxcpu", "Display per-CPU VMX state and skipped VMPTRLD count", mon_vmxcpu},
+	{ "vpid", "Enable/disable VPID tagging for new guests: vpid [on|off]", mon_vpid},
+	{ "faultaround", "Show guest EPT fault stats, or set a guest's window: faultaround [envid pages]", mon_faultaround},
+	{ "lockstat", "Show (or reset) lock contention and hold times: lockstat [reset]", mon_lockstat},
+	{ "vswitch", "Show the virtual switch ports and their counters", mon_vswitch},
+	{ "balloon", "Show guest balloons, or set a guest's target: balloon [envid pages]", mon_balloon}
 };
 
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
@@ -324,6 +337,257 @@ mon_statpages(int argc, char **argv, struct Trapframe *tf)
         return 0;	
 }
 
+static void
+exitstat_print(const char *name, struct vmx_exit_stat *st)
+{
+	int i;
+
+	cprintf("  %-14s %8lu  avg %8lu  min %8lu  max %10lu\n", name,
+		st->count, st->cycles / st->count, st->min, st->max);
+	cprintf("   ");
+	for (i = 0; i < VMX_EXIT_HIST_BUCKETS; i++)
+		if (st->hist[i])
+			cprintf(" 2^%d:%u", i, st->hist[i]);
+	cprintf("\n");
+}
+
+// Exit statistics of one guest, summed over its vCPUs.  Cycles are TSC
+// cycles spent in the host per exit.
+static void
+exitstat_guest(struct Env *e)
+{
+	// Too big for the kernel stack.
+	static struct vmx_exit_stats st;
+	char buf[16];
+	const char *name;
+	int i;
+
+	vmx_exit_stats_sum(e, &st);
+	cprintf("guest %08x (%d vCPUs):\n", e->env_id, e->env_vmxinfo.nvcpus);
+	for (i = 0; i < VMX_EXIT_REASONS; i++) {
+		if (!st.reason[i].count)
+			continue;
+		if (!(name = vmx_exit_reason_name(i))) {
+			snprintf(buf, sizeof(buf), "reason %d", i);
+			name = buf;
+		}
+		exitstat_print(name, &st.reason[i]);
+	}
+	for (i = 0; i < VMX_VMCALLS; i++) {
+		if (!st.vmcall[i].count)
+			continue;
+		snprintf(buf, sizeof(buf), "vmcall %d", i);
+		exitstat_print(buf, &st.vmcall[i]);
+	}
+	// Traffic through the paravirtual devices, to put the exits in
+	// proportion.
+	e = &envs[ENVX(e->env_vmxinfo.vcpu_bsp)];
+	if (e->env_vmxinfo.pvnet[VMX_PVNET_TX] || e->env_vmxinfo.pvnet[VMX_PVNET_RX])
+		cprintf("  pvnet tx %lu rx %lu rx-dropped %lu\n",
+			e->env_vmxinfo.pvnet_tx_frames, e->env_vmxinfo.pvnet_rx_frames,
+			e->env_vmxinfo.pvnet_rx_drops);
+	if (e->env_vmxinfo.pvblk)
+		cprintf("  pvblk requests %lu sectors %lu\n",
+			e->env_vmxinfo.pvblk_reqs, e->env_vmxinfo.pvblk_sectors);
+}
+
+int
+mon_exitstat(int argc, char **argv, struct Trapframe *tf)
+{
+	struct Env *e;
+	int i;
+
+	if (argc == 2) {
+		if (envid2env(strtol(argv[1], NULL, 16), &e, 0) < 0 ||
+		    e->env_type != ENV_TYPE_GUEST) {
+			cprintf("No such guest %s\n", argv[1]);
+			return 0;
+		}
+		exitstat_guest(e);
+		return 0;
+	} else if (argc != 1) {
+		cprintf("Usage: exitstat [envid]\n");
+		return 0;
+	}
+
+	for (i = 0; i < NENV; i++) {
+		e = &envs[i];
+		if (e->env_type != ENV_TYPE_GUEST || e->env_status == ENV_FREE ||
+		    e->env_vmxinfo.vcpu_id)
+			continue;
+		exitstat_guest(e);
+	}
+	return 0;
+}
+
+int
+mon_vmxcpu(int argc, char **argv, struct Trapframe *tf)
+{
+	int i;
+
+	for (i = 0; i < ncpu; i++)
+		cprintf("CPU %d: vmx_root %d loaded_vmcs %016lx vmptrld_skipped %lu\n",
+			i, cpus[i].is_vmx_root, cpus[i].loaded_vmcs,
+			cpus[i].vmptrld_skipped);
+	return 0;
+}
+
+int
+mon_vpid(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc == 2 && strcmp(argv[1], "on") == 0)
+		vmx_vpid_enable = true;
+	else if (argc == 2 && strcmp(argv[1], "off") == 0)
+		vmx_vpid_enable = false;
+	else if (argc != 1) {
+		cprintf("Usage: vpid [on|off]\n");
+		return 0;
+	}
+	cprintf("VPID tagging for new guests: %s\n", vmx_vpid_enable ? "on" : "off");
+	return 0;
+}
+
+int
+mon_faultaround(int argc, char **argv, struct Trapframe *tf)
+{
+	struct Env *e;
+	int i;
+
+	if (argc == 3) {
+		if (envid2env(strtol(argv[1], NULL, 16), &e, 0) < 0 ||
+		    e->env_type != ENV_TYPE_GUEST) {
+			cprintf("No such guest %s\n", argv[1]);
+			return 0;
+		}
+		e->env_vmxinfo.fault_around = strtol(argv[2], NULL, 0);
+	} else if (argc != 1) {
+		cprintf("Usage: faultaround [envid pages]\n");
+		return 0;
+	}
+
+	for (i = 0; i < NENV; i++) {
+		e = &envs[i];
+		if (e->env_type != ENV_TYPE_GUEST || e->env_status == ENV_FREE)
+			continue;
+		cprintf("guest %08x: fault-around %d, %lu EPT violations, %lu pages mapped\n",
+			e->env_id, e->env_vmxinfo.fault_around,
+			e->env_vmxinfo.ept_violations, e->env_vmxinfo.ept_pages_mapped);
+	}
+	return 0;
+}
+
+#ifdef SPINLOCK_STATS
+static void
+lockstat_print(const char *name, struct spinlock *lk)
+{
+	cprintf("%-12s %10lu acq %8lu cont %12lu spin %12lu held %10lu max\n",
+		name, lk->acquires, lk->contended, lk->spin_cycles,
+		lk->hold_cycles, lk->hold_max);
+}
+#endif
+
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+#ifdef SPINLOCK_STATS
+	extern struct spinlock env_as_locks[];
+	struct spinlock as, *lk;
+	int i;
+
+	if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+		for (i = 0; spinlock_table[i]; i++)
+			spin_stats_reset(spinlock_table[i]);
+		for (i = 0; i < NENV; i++)
+			spin_stats_reset(&env_as_locks[i]);
+		return 0;
+	} else if (argc != 1) {
+		cprintf("Usage: lockstat [reset]\n");
+		return 0;
+	}
+
+	cprintf("cycles are TSC cycles\n");
+	for (i = 0; spinlock_table[i]; i++) {
+		lk = spinlock_table[i];
+#ifdef DEBUG_SPINLOCK
+		lockstat_print(lk->name, lk);
+#else
+		lockstat_print("lock", lk);
+#endif
+	}
+	// The address space locks are shown as one.
+	memset(&as, 0, sizeof(as));
+	for (i = 0; i < NENV; i++) {
+		lk = &env_as_locks[i];
+		as.acquires += lk->acquires;
+		as.contended += lk->contended;
+		as.spin_cycles += lk->spin_cycles;
+		as.hold_cycles += lk->hold_cycles;
+		if (lk->hold_max > as.hold_max)
+			as.hold_max = lk->hold_max;
+	}
+	lockstat_print("env_as", &as);
+#else
+	cprintf("lockstat: kernel built without SPINLOCK_STATS\n");
+#endif
+	return 0;
+}
+
+int
+mon_vswitch(int argc, char **argv, struct Trapframe *tf)
+{
+	struct vsw_port *p;
+	int i;
+
+	cprintf("port env      mac               rx frames/bytes      tx frames/bytes      drops\n");
+	for (i = 0; i < VSW_PORTS; i++) {
+		p = &vsw_ports[i];
+		// The wire and host ports always exist.
+		if (i > VSW_PORT_HOST && !p->env)
+			continue;
+		if (i == VSW_PORT_WIRE)
+			cprintf("wire ");
+		else if (i == VSW_PORT_HOST)
+			cprintf("host ");
+		else
+			cprintf("%4d ", i);
+		cprintf("%08x %02x:%02x:%02x:%02x:%02x:%02x %lu/%lu %lu/%lu %lu\n",
+			p->env, p->mac[0], p->mac[1], p->mac[2], p->mac[3],
+			p->mac[4], p->mac[5], p->rx_frames, p->rx_bytes,
+			p->tx_frames, p->tx_bytes, p->drops);
+	}
+	return 0;
+}
+
+int
+mon_balloon(int argc, char **argv, struct Trapframe *tf)
+{
+	struct Env *e;
+	int i;
+
+	if (argc == 3) {
+		if (envid2env(strtol(argv[1], NULL, 16), &e, 0) < 0 ||
+		    e->env_type != ENV_TYPE_GUEST ||
+		    vmx_balloon_set_target(e, strtol(argv[2], NULL, 0)) < 0) {
+			cprintf("No such guest %s, or too many pages\n", argv[1]);
+			return 0;
+		}
+	} else if (argc != 1) {
+		cprintf("Usage: balloon [envid pages]\n");
+		return 0;
+	}
+
+	for (i = 0; i < NENV; i++) {
+		e = &envs[i];
+		if (e->env_type != ENV_TYPE_GUEST || e->env_status == ENV_FREE ||
+		    e->env_vmxinfo.vcpu_id)
+			continue;
+		cprintf("guest %08x: balloon %lu pages, target %lu, %lu pages mapped\n",
+			e->env_id, e->env_vmxinfo.balloon_pages,
+			e->env_vmxinfo.balloon_target, e->env_vmxinfo.ept_pages_mapped);
+	}
+	return 0;
+}
+
 
 /***** Kernel monitor command interpreter *****/
 
@@ -21,5 +21,12 @@ int mon_showmappings(int argc, char**argv, struct Trapframe *tf);
 int mon_dumpmemcontents(int argc, char**argv, struct Trapframe *tf);
 int mon_changepermissions(int argc, char**argv, struct Trapframe *tf);
 int mon_statpages(int argc, char**argv, struct Trapframe *tf);
+int mon_vmxcpu(int argc, char**argv, struct Trapframe *tf);
+int mon_vpid(int argc, char**argv, struct Trapframe *tf);
+int mon_faultaround(int argc, char**argv, struct Trapframe *tf);
+int mon_exitstat(int argc, char**argv, struct Trapframe *tf);
+int mon_lockstat(int argc, char**argv, struct Trapframe *tf);
+int mon_vswitch(int argc, char**argv, struct Trapframe *tf);
+int mon_balloon(int argc, char**argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
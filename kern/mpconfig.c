@@ -212,6 +212,8 @@ mp_init(void)
     for (i=0; i< NCPU; ++i) {
         cpus[i].is_vmx_root = false;
         cpus[i].vmxon_region = 0;
+        cpus[i].loaded_vmcs = 0;
+        cpus[i].vmptrld_skipped = 0;
     }
 
 	bootcpu->cpu_status = CPU_STARTED;
@@ -11,6 +11,7 @@
 #include <kern/multiboot.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 #define BOOT_PAGE_TABLE_START 0xf0008000
 #define BOOT_PAGE_TABLE_END   0xf000e000
@@ -330,7 +331,7 @@ x64_vm_init(void)
     // Your code goes here: 
     // Check that the initial page directory has been set up correctly.
     // Initialize the SMP-related parts of the memory map
-    //mem_init_mp();
+    mem_init_mp();
     check_boot_pml4e(boot_pml4e);
 
     //////////////////////////////////////////////////////////////////////
@@ -368,7 +369,11 @@ mem_init_mp(void)
     //     Permissions: kernel RW, user NONE
     //
     // LAB 4: Your code here:
+    int i;
 
+    for (i = 0; i < NCPU; i++)
+        boot_map_segment(boot_pml4e, KSTACKTOP - i * (KSTKSIZE + KSTKGAP) - KSTKSIZE,
+                KSTKSIZE, PADDR(percpu_kstacks[i]), PTE_W | PTE_P);
 }
 
 // --------------------------------------------------------------
@@ -454,23 +459,87 @@ page_init(void)
 page_alloc(int alloc_flags)
 {
     struct Page *pp;
+
+    spin_lock(&page_lock);
     pp = page_free_list;
     if (pp == NULL)
     {
+	spin_unlock(&page_lock);
 	return 0; // Out of memory
     }
     else 
     {
+	page_free_list = pp->pp_link;
+	pp->pp_link = NULL;
+	spin_unlock(&page_lock);
+	// The page is ours now, clear it outside the lock.
 	if (alloc_flags & ALLOC_ZERO) 
 	{
 	    memset(page2kva(pp), '\0', 4096);
 	}
-	page_free_list = pp->pp_link;
-	pp->pp_link = NULL;
 	return pp;
     }
 }
 
+//
+// Allocates 'npg' physically contiguous pages, the first of which is aligned
+// to 'align' pages (a power of two), and returns the first Page.  Like
+// page_alloc(), the pages are removed from the free list with pp_ref 0 and
+// are zeroed if (alloc_flags & ALLOC_ZERO).  Returns NULL if no suitable run
+// of free pages exists.
+//
+// Used to back large EPT mappings; this walks all of pages[], so it is not
+// meant for hot paths.
+//
+    struct Page *
+page_alloc_contig(size_t npg, size_t align, int alloc_flags)
+{
+    struct Page *tail, *pp, **link;
+    size_t base, i;
+
+    spin_lock(&page_lock);
+    // Free pages have pp_ref == 0 and are linked, except for the tail of
+    // the list whose pp_link is NULL; find it so it is not missed.
+    for (tail = page_free_list; tail && tail->pp_link; tail = tail->pp_link)
+	;
+    if (!tail) {
+	spin_unlock(&page_lock);
+	return NULL;
+    }
+
+    // Physical page 0 is never free, so start at the first aligned run.
+    for (base = align; base + npg <= npages; base += align) {
+	for (i = 0; i < npg; i++) {
+	    pp = &pages[base + i];
+	    if (pp->pp_ref != 0 || (pp->pp_link == NULL && pp != tail))
+		break;
+	}
+	if (i == npg)
+	    break;
+    }
+    if (base + npg > npages) {
+	spin_unlock(&page_lock);
+	return NULL;
+    }
+
+    // Unlink the run from the free list.
+    for (link = &page_free_list; *link; ) {
+	pp = *link;
+	if (pp >= &pages[base] && pp < &pages[base + npg])
+	    *link = pp->pp_link;
+	else
+	    link = &pp->pp_link;
+    }
+    spin_unlock(&page_lock);
+    for (i = 0; i < npg; i++) {
+	pp = &pages[base + i];
+	pp->pp_link = NULL;
+	if (alloc_flags & ALLOC_ZERO)
+	    memset(page2kva(pp), '\0', PGSIZE);
+    }
+    return &pages[base];
+}
+
 //
 // Initialize a Page structure.
 // The result has null links and 0 refcount.
@@ -491,19 +560,22 @@ page_initpp(struct Page *pp)
 page_free(struct Page *pp)
 {
     assert(pp->pp_ref == 0);
+    spin_lock(&page_lock);
     pp->pp_link = page_free_list; // Adding free page to the end of the list
     page_free_list = pp;	  // free list pt updated
     pp->pp_ref = 0;
+    spin_unlock(&page_lock);
 }
 
 //
 // Decrement the reference count on a page,
-// freeing it if there are no more refs.
+// freeing it if there are no more refs.  Pages can be mapped into several
+// address spaces that are locked separately, so the count is atomic.
 //
     void
 page_decref(struct Page* pp)
 {
-    if (--pp->pp_ref == 0)
+    if (__sync_sub_and_fetch(&pp->pp_ref, 1) == 0)
         page_free(pp);
 }
 // Given a pml4 pointer, pml4e_walk returns a pointer
@@ -731,7 +803,7 @@ page_insert(pml4e_t *pml4e, struct Page *pp, void *va, int perm)
     {
 	return -E_NO_MEM;
     }
-    pp->pp_ref++;
+    __sync_fetch_and_add(&pp->pp_ref, 1);
     if(*pte & PTE_P)		// Checks if the PTE entry is already present
     {
 	page_remove(pml4e, va);	// Remove it and add the page pp
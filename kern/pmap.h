@@ -52,6 +52,7 @@ void    x64_vm_init();
 
 void	page_init(void);
 struct Page * page_alloc(int alloc_flags);
+struct Page * page_alloc_contig(size_t npg, size_t align, int alloc_flags);
 void	page_free(struct Page *pp);
 int	page_insert(pml4e_t *pml4e, struct Page *pp, void *va, int perm);
 void	page_remove(pml4e_t *pml4e, void *va);
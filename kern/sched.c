@@ -1,8 +1,11 @@
 #include <inc/assert.h>
+#include <inc/x86.h>
 
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
 
 #include <vmm/vmx.h>
 
@@ -20,23 +23,332 @@ vmxon() {
     return 0;
 }
 
+// A guest's VMCS stays active on the CPU that last ran it (see
+// vmx_load_vmcs()), so a guest only runs there once it has started.
+static bool
+sched_runs_here(struct Env *e) {
+    return e->env_type != ENV_TYPE_GUEST || e->env_vmxinfo.vmcs_cpu < 0 ||
+        e->env_vmxinfo.vmcs_cpu == cpunum();
+}
+
+// Weighted fair share, after Xen's credit scheduler.  Every
+// SCHED_ACCT_TICKS timer ticks sched_tick() hands out the CPU time of the
+// last period to the runnable envs in proportion to their weights, as
+// credit in TSC cycles; running charges an env for the cycles it used.
+// Envs with credit left (UNDER) run before those that used up their share
+// (OVER), and latency-class envs with credit left run before both, so a
+// service like the file server gets the CPU as soon as it is woken.
+//
+// The hand-out is lazy: sched_tick() only advances sched_vclock, the credit
+// each unit of weight earned so far, and an env collects its part when it
+// is next charged or woken (sched_settle()).  The weights that take part
+// are summed on the run queues as envs are queued and dispatched, so no
+// tick walks envs[].
+enum {
+    RQ_LATENCY = 0,
+    RQ_UNDER,
+    RQ_OVER,
+    RQ_NPRI
+};
+
+#define SCHED_ACCT_TICKS 3
+
+// Per-CPU run queues, a FIFO per priority.  An env is on at most one queue
+// (env_rq_cpu says which, -1 for none).  Entries are not removed when an
+// env stops being runnable; the pick drops them instead, which keeps
+// every operation O(1).  weight sums the weights of the queued envs, stale
+// ones included until they are dropped, and run_weight is the weight of
+// the env this CPU dispatched, until it is charged.
+struct RunQueue {
+    struct spinlock lock;
+    struct Env *head[RQ_NPRI], *tail[RQ_NPRI];
+    int len;
+    uint64_t weight;
+    uint64_t run_weight;
+};
+
+static struct RunQueue runqueues[NCPU];
+
+// Credit per unit of weight handed out since boot, and in the last period.
+static volatile uint64_t sched_vclock, sched_vperiod;
+
+// How far into another CPU's queue an idle CPU looks for an env it may run.
+#define SCHED_STEAL_SCAN 4
+
+// The CPU whose queue e belongs on: a started guest's VMCS CPU, else the
+// CPU e last ran on, to keep its cache warm.
+static int
+sched_home(struct Env *e) {
+    if (e->env_type == ENV_TYPE_GUEST && e->env_vmxinfo.vmcs_cpu >= 0)
+        return e->env_vmxinfo.vmcs_cpu;
+    if (e->env_cpunum >= 0 && e->env_cpunum < ncpu &&
+            cpus[e->env_cpunum].cpu_status == CPU_STARTED)
+        return e->env_cpunum;
+    return cpunum();
+}
+
+static int
+sched_pri(struct Env *e) {
+    if (e->env_credit < 0)
+        return RQ_OVER;
+    return e->env_sched_class == SCHED_CLASS_LATENCY ? RQ_LATENCY : RQ_UNDER;
+}
+
+static void
+rq_push(int cpu, struct Env *e) {
+    struct RunQueue *rq = &runqueues[cpu];
+    int pri = sched_pri(e);
+
+    spin_lock(&rq->lock);
+    if (e->env_rq_cpu < 0) {
+        e->env_rq_cpu = cpu;
+        e->env_rq_next = NULL;
+        if (rq->tail[pri])
+            rq->tail[pri]->env_rq_next = e;
+        else
+            rq->head[pri] = e;
+        rq->tail[pri] = e;
+        rq->len++;
+        rq->weight += e->env_weight;
+    }
+    spin_unlock(&rq->lock);
+}
+
+// Unlinks e, which follows prev (NULL for the head) on list pri of rq.
+// Called with rq->lock held.
+static void
+rq_unlink(struct RunQueue *rq, int pri, struct Env *prev, struct Env *e) {
+    if (prev)
+        prev->env_rq_next = e->env_rq_next;
+    else
+        rq->head[pri] = e->env_rq_next;
+    if (rq->tail[pri] == e)
+        rq->tail[pri] = prev;
+    e->env_rq_next = NULL;
+    e->env_rq_cpu = -1;
+    rq->len--;
+    rq->weight -= e->env_weight;
+}
+
+static struct Env *
+rq_pop(int cpu) {
+    struct RunQueue *rq = &runqueues[cpu];
+    struct Env *e = NULL;
+    int pri;
+
+    spin_lock(&rq->lock);
+    for (pri = 0; pri < RQ_NPRI; pri++) {
+        if ((e = rq->head[pri])) {
+            rq_unlink(rq, pri, NULL, e);
+            break;
+        }
+    }
+    spin_unlock(&rq->lock);
+    return e;
+}
+
+// Takes an env this CPU may run from the front of the longest other queue.
+// Started guests stay where their VMCS is.
+static struct Env *
+rq_steal(void) {
+    struct RunQueue *rq;
+    struct Env *e, *prev;
+    int i, n, pri, victim = -1;
+
+    for (i = 0; i < ncpu; i++) {
+        if (i != cpunum() && runqueues[i].len > 0 &&
+                (victim < 0 || runqueues[i].len > runqueues[victim].len))
+            victim = i;
+    }
+    if (victim < 0)
+        return NULL;
+
+    rq = &runqueues[victim];
+    spin_lock(&rq->lock);
+    for (pri = 0; pri < RQ_NPRI; pri++) {
+        for (prev = NULL, e = rq->head[pri], n = 0; e && n < SCHED_STEAL_SCAN;
+                prev = e, e = e->env_rq_next, n++) {
+            if (e->env_status == ENV_RUNNABLE && sched_runs_here(e)) {
+                rq_unlink(rq, pri, prev, e);
+                spin_unlock(&rq->lock);
+                return e;
+            }
+        }
+    }
+    spin_unlock(&rq->lock);
+    return NULL;
+}
+
+// Sets up the scheduling state of a newly allocated env.
+void
+sched_env_init(struct Env *e, int class) {
+    e->env_sched_class = class;
+    e->env_weight = SCHED_WEIGHT_DEFAULT;
+    e->env_credit = 0;
+    e->env_cputime = 0;
+    e->env_vclock = sched_vclock;
+}
+
+// Brings e's credit up to sched_vclock.  An env that wanted the CPU since
+// it was last settled (earned) collects its share of the periods in
+// between; one that was blocked forfeits them.  Credit is capped at one
+// period's share either way, so an env can neither bank time while blocked
+// nor stay OVER forever.
+static void
+sched_settle(struct Env *e, bool earned) {
+    uint64_t now = sched_vclock;
+    int64_t cap = sched_vperiod * e->env_weight;
+
+    if (earned)
+        e->env_credit += (now - e->env_vclock) * e->env_weight;
+    e->env_vclock = now;
+    if (e->env_credit > cap)
+        e->env_credit = cap;
+    else if (e->env_credit < -cap)
+        e->env_credit = -cap;
+}
+
+// Marks e as dispatched on this CPU, for sched_charge().
+static void
+sched_dispatch(struct Env *e) {
+    thiscpu->cpu_run_start = read_tsc();
+    runqueues[cpunum()].run_weight = e->env_weight;
+}
+
+// Charges curenv for the time since it was dispatched on this CPU.
+static void
+sched_charge(void) {
+    uint64_t now = read_tsc(), used;
+
+    if (curenv && thiscpu->cpu_run_start) {
+        used = now - thiscpu->cpu_run_start;
+        curenv->env_cputime += used;
+        sched_settle(curenv, true);
+        curenv->env_credit -= used;
+    }
+    thiscpu->cpu_run_start = 0;
+    runqueues[cpunum()].run_weight = 0;
+}
+
+// Advances sched_vclock by the CPU time of the last accounting period,
+// split over the weights queued or running on all CPUs.  Runs on the boot
+// CPU's timer tick.
+void
+sched_tick(void) {
+    static uint64_t last;
+    static int ticks;
+    uint64_t now, total, weights = 0;
+    int i;
+
+    if (++ticks < SCHED_ACCT_TICKS)
+        return;
+    ticks = 0;
+    now = read_tsc();
+    if (!last) {
+        last = now;
+        return;
+    }
+    total = (now - last) * ncpu;
+    last = now;
+
+    for (i = 0; i < ncpu; i++)
+        weights += runqueues[i].weight + runqueues[i].run_weight;
+    if (!weights)
+        return;
+    sched_vperiod = total / weights;
+    sched_vclock += sched_vperiod;
+}
+
+// Changes e's weight, keeping the sum of the queue it is on right.
+void
+sched_set_weight(struct Env *e, uint32_t weight) {
+    struct RunQueue *rq;
+    int cpu;
+
+    for (;;) {
+        if ((cpu = e->env_rq_cpu) < 0) {
+            e->env_weight = weight;
+            return;
+        }
+        rq = &runqueues[cpu];
+        spin_lock(&rq->lock);
+        if (e->env_rq_cpu == cpu) {
+            rq->weight += (uint64_t)weight - e->env_weight;
+            e->env_weight = weight;
+            spin_unlock(&rq->lock);
+            return;
+        }
+        spin_unlock(&rq->lock);
+    }
+}
+
+// Puts e on its home CPU's run queue, if it is not queued already.
+void
+sched_enqueue(struct Env *e) {
+    rq_push(sched_home(e), e);
+}
+
+// Makes e runnable and queues it.
+void
+sched_wakeup(struct Env *e) {
+    sched_settle(e, e->env_status == ENV_RUNNABLE ||
+            e->env_status == ENV_RUNNING);
+    e->env_status = ENV_RUNNABLE;
+    sched_enqueue(e);
+}
+
+// Whether any CPU has envs queued or is running one.  Stale entries count
+// until some CPU's pick drops them.
+static bool
+sched_busy(void) {
+    int i;
+
+    for (i = 0; i < ncpu; i++)
+        if (runqueues[i].len > 0 || runqueues[i].run_weight)
+            return true;
+    return false;
+}
+
+// Pops the next env this CPU should run, or NULL.  Stale entries are
+// dropped, guests queued away from their VMCS are moved home, and guests
+// destroyed from other CPUs (see env_destroy()) are freed here.
+static struct Env *
+sched_pick(void) {
+    struct Env *e;
+
+    while ((e = rq_pop(cpunum())) || (e = rq_steal())) {
+        if (e->env_type == ENV_TYPE_GUEST && e->env_status == ENV_DYING) {
+            if (e->env_vmxinfo.vmcs_cpu == cpunum())
+                env_destroy(e);
+            else
+                sched_enqueue(e);
+            continue;
+        }
+        if (e->env_status != ENV_RUNNABLE || e->env_type == ENV_TYPE_IDLE
+#ifdef RUN_POSTPROCESS_DEDUP_ON_IDLE
+                || e->env_type == ENV_TYPE_PP_DEDUP
+#endif
+                )
+            continue;
+        if (!sched_runs_here(e)) {
+            sched_enqueue(e);
+            continue;
+        }
+        return e;
+    }
+    return NULL;
+}
+
 // Choose a user environment to run and run it.
     void
 sched_yield(void)
 {
-    struct Env *idle;
-    struct Trapframe *abhi = NULL;
-    int i;
+    struct Env *idle, *e;
 
-    // Implement simple round-robin scheduling.
-    //
-    // Search through 'envs' for an ENV_RUNNABLE environment in
-    // circular fashion starting just after the env this CPU was
-    // last running.  Switch to the first such environment found.
-    //
-    // If no envs are runnable, but the environment previously
-    // running on this CPU is still ENV_RUNNING, it's okay to
-    // choose that environment.
+    // Round-robin within each priority of this CPU's run queue.  The env
+    // that was running here is charged for its time and goes to the back;
+    // if nothing else is queued it is picked again.  A CPU with an empty
+    // queue steals from the busiest one.
     //
     // Never choose an environment that's currently running on
     // another CPU (env_status == ENV_RUNNING) and never choose an
@@ -44,61 +356,39 @@ sched_yield(void)
     // no runnable environments, simply drop through to the code
     // below to switch to this CPU's idle environment.
 
-    // LAB 4: Your code here.
-    if (curenv) 
-    {
-	for (i = ENVX(curenv->env_id)+1; i != ENVX(curenv->env_id); i = (i+1)%NENV)
-	{
-	    if (envs[i].env_type != ENV_TYPE_IDLE && 
-			     #ifdef RUN_POSTPROCESS_DEDUP_ON_IDLE
-			     envs[i].env_type != ENV_TYPE_PP_DEDUP &&
-			     #endif
-        	             envs[i].env_status == ENV_RUNNABLE)
-                	        break;
-	}
-	if (i != ENVX(curenv->env_id) || // Termination condition of circular queue
-		    (i == ENVX(curenv->env_id) && envs[i].env_type != ENV_TYPE_IDLE &&
-		    #ifdef RUN_POSTPROCESS_DEDUP_ON_IDLE
-                    envs[i].env_type != ENV_TYPE_PP_DEDUP &&
-		    #endif
-		    envs[i].env_status == ENV_RUNNING)) // Choose only if current is in running state
-	{
-	    if (envs[i].env_type == ENV_TYPE_GUEST && envs[i].env_status == ENV_RUNNABLE)
-	    {
-		if (curenv != NULL)
-		{
-		    if (curenv->env_status == ENV_RUNNING)
-		    {
-			curenv->env_status = ENV_RUNNABLE;
-		    }
-                }
-		curenv = &envs[i];
-		curenv->env_status = ENV_RUNNING;
-//		while (1)
-//		{
-		curenv->env_runs++;
-
-		if (!vmxon())
-		    vmx_vmrun(&envs[i]);
-//		}
-	    }
-	    else
-		env_run(&envs[i]);
+    sched_charge();
+    if (curenv && curenv->env_status == ENV_RUNNING &&
+            curenv->env_type != ENV_TYPE_IDLE)
+        sched_wakeup(curenv);
+
+    if ((e = sched_pick())) {
+        if (e->env_type == ENV_TYPE_GUEST) {
+            // A guest runs through vmx_run_guest() instead of env_run().
+            if (curenv && curenv->env_status == ENV_RUNNING)
+                curenv->env_status = ENV_RUNNABLE;
+            curenv = e;
+            curenv->env_status = ENV_RUNNING;
+            curenv->env_cpunum = cpunum();
+            curenv->env_runs++;
+            sched_dispatch(e);
+
+            if (!vmxon())
+                vmx_run_guest(e);
+            // No VMX on this CPU: leave the guest to the others.
+            sched_charge();
+            sched_wakeup(e);
+            curenv = NULL;
+        } else {
+            sched_dispatch(e);
+            env_run(e);
         }
     }
-//    cprintf("\n IN SYS YIELD \n");
-    cprintf("CURENV:%x\n", curenv);
+
     // For debugging and testing purposes, if there are no
     // runnable environments other than the idle environments,
-    // drop into the kernel monitor.
-    for (i = 0; i < NENV; i++) {
-        if (envs[i].env_type != ENV_TYPE_IDLE &&
-                (envs[i].env_status == ENV_RUNNABLE ||
-                 envs[i].env_status == ENV_RUNNING)) {
-            break;
-        }
-    }
-    if (i == NENV) {
+    // drop into the kernel monitor.  Halted guests will become runnable
+    // again, so idle until they do.  Only the boot CPU checks.
+    if (thiscpu == bootcpu && !sched_busy() && !vmx_halted_guests) {
         cprintf("No more runnable environments!\n");
         while (1)
             monitor(NULL);
@@ -108,6 +398,5 @@ sched_yield(void)
     idle = &envs[cpunum()];
     if (!(idle->env_status == ENV_RUNNABLE || idle->env_status == ENV_RUNNING))
    	panic("CPU %d: No idle environment!", cpunum());
-    abhi = &(idle->env_tf);
     env_run(idle);
 }
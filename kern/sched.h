@@ -6,7 +6,15 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+struct Env;
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
+void sched_enqueue(struct Env *e);
+void sched_wakeup(struct Env *e);
+void sched_env_init(struct Env *e, int class);
+void sched_tick(void);
+void sched_set_weight(struct Env *e, uint32_t weight);
+
 #endif	// !JOS_KERN_SCHED_H
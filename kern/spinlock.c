@@ -16,6 +16,34 @@ struct spinlock kernel_lock = {
 #endif
 };
 
+struct spinlock page_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "page_lock"
+#endif
+};
+
+struct spinlock env_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "env_lock"
+#endif
+};
+
+struct spinlock ipc_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "ipc_lock"
+#endif
+};
+
+struct spinlock e1000_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "e1000_lock"
+#endif
+};
+
+struct spinlock *spinlock_table[] = {
+	&kernel_lock, &env_lock, &ipc_lock, &page_lock, &e1000_lock, NULL
+};
+
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
 static void
@@ -60,6 +88,10 @@ __spin_initlock(struct spinlock *lk, char *name)
 void
 spin_lock(struct spinlock *lk)
 {
+#ifdef SPINLOCK_STATS
+	uint64_t spin_start = 0;
+#endif
+
 #ifdef DEBUG_SPINLOCK
 	if (holding(lk))
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
@@ -68,8 +100,22 @@ spin_lock(struct spinlock *lk)
 	// The xchg is atomic.
 	// It also serializes, so that reads after acquire are not
 	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
-		asm volatile ("pause");
+	if (xchg(&lk->locked, 1) != 0) {
+#ifdef SPINLOCK_STATS
+		spin_start = read_tsc();
+#endif
+		while (xchg(&lk->locked, 1) != 0)
+			asm volatile ("pause");
+	}
+
+#ifdef SPINLOCK_STATS
+	lk->hold_start = read_tsc();
+	lk->acquires++;
+	if (spin_start) {
+		lk->contended++;
+		lk->spin_cycles += lk->hold_start - spin_start;
+	}
+#endif
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
@@ -107,6 +153,14 @@ spin_unlock(struct spinlock *lk)
 	lk->cpu = 0;
 #endif
 
+#ifdef SPINLOCK_STATS
+	uint64_t held = read_tsc() - lk->hold_start;
+
+	lk->hold_cycles += held;
+	if (held > lk->hold_max)
+		lk->hold_max = held;
+#endif
+
 	// The xchg serializes, so that reads before release are 
 	// not reordered after it.  The 1996 PentiumPro manual (Volume 3,
 	// 7.2) says reads can be carried out speculatively and in
@@ -118,3 +172,17 @@ spin_unlock(struct spinlock *lk)
 	// the above assignments (and after the critical section).
 	xchg(&lk->locked, 0);
 }
+
+#ifdef SPINLOCK_STATS
+// Clear the counters of lk.  Harmless to race with the holder; at worst one
+// acquisition is miscounted.
+void
+spin_stats_reset(struct spinlock *lk)
+{
+	lk->acquires = 0;
+	lk->contended = 0;
+	lk->spin_cycles = 0;
+	lk->hold_cycles = 0;
+	lk->hold_max = 0;
+}
+#endif
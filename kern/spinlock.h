@@ -5,6 +5,10 @@
 
 // Comment this to disable spinlock debugging
 #define DEBUG_SPINLOCK
+// Uncomment this to enable lock hold-time and contention counters.  They
+// add two rdtsc to every acquire/release pair, the kernel lock's included,
+// so leave them off when timing exits.
+//#define SPINLOCK_STATS
 
 // Mutual exclusion lock.
 struct spinlock {
@@ -17,6 +21,17 @@ struct spinlock {
 	uintptr_t pcs[10]; // The call stack (an array of program counters)
 	                   // that locked the lock.
 #endif
+
+#ifdef SPINLOCK_STATS
+	// Updated by the holder, so they need no atomics.  Times are in TSC
+	// cycles.
+	uint64_t acquires;     // Number of acquisitions
+	uint64_t contended;    // Acquisitions that had to spin
+	uint64_t spin_cycles;  // Total time spent spinning
+	uint64_t hold_cycles;  // Total time held
+	uint64_t hold_max;     // Longest single hold
+	uint64_t hold_start;   // When the current holder acquired it
+#endif
 };
 
 void __spin_initlock(struct spinlock *lk, char *name);
@@ -27,6 +42,20 @@ void spin_unlock(struct spinlock *lk);
 
 extern struct spinlock kernel_lock;
 
+// Finer-grained locks.  Lock order: kernel_lock, env_lock, ipc_lock, the
+// address space locks (env_as_lock()), page_lock; e1000_lock is a leaf.
+extern struct spinlock page_lock;      // page_free_list
+extern struct spinlock env_lock;       // env_free_list
+extern struct spinlock ipc_lock;       // env_ipc_* rendezvous state
+extern struct spinlock e1000_lock;     // e1000 TX/RX rings
+
+// The global locks above, NULL terminated, for the 'lockstat' command.
+extern struct spinlock *spinlock_table[];
+
+#ifdef SPINLOCK_STATS
+void spin_stats_reset(struct spinlock *lk);
+#endif
+
 static inline void
 lock_kernel(void)
 {
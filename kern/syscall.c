@@ -14,7 +14,12 @@
 #include <kern/sched.h>
 #include <kern/time.h>
 #include <kern/e1000.h>
+#include <kern/spinlock.h>
 #include <vmm/ept.h>
+#include <vmm/vmx.h>
+#include <vmm/pvblk.h>
+#include <vmm/vswitch.h>
+#include <vmm/balloon.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -100,6 +105,8 @@ sys_exofork(void)
     {
 	env->env_status = ENV_NOT_RUNNABLE;
 	memcpy(&(env->env_tf), &(curenv->env_tf), sizeof(struct Trapframe));
+	// Helpers forked by a service (ns_input, ns_output) are services too.
+	env->env_sched_class = curenv->env_sched_class;
 
 	// Parent is going to set child's status to RUNNING at some point of
 	// time. On this occurance, child will expect to have the error code
@@ -143,7 +150,10 @@ sys_env_set_status(envid_t envid, int status)
     }
     else if (err == 0)
     {
-	env->env_status = status;
+	if (status == ENV_RUNNABLE)
+	    sched_wakeup(env);
+	else
+	    env->env_status = status;
 	cprintf(":%d\n",__LINE__);
 	return 0;
    }
@@ -253,12 +263,15 @@ sys_page_alloc(envid_t envid, void *va, int perm)
     }
     else if (err == 0)
     {
+	spin_lock(env_as_lock(env));
 	page_remove(env->env_pml4e, va);		
 	if (page_insert(env->env_pml4e, p, va, perm) < 0)
 	{
+	    spin_unlock(env_as_lock(env));
 	    page_free(p);
 	    return -E_NO_MEM;
 	}
+	spin_unlock(env_as_lock(env));
                 return 0;
      }
 
@@ -311,17 +324,17 @@ sys_page_map(envid_t srcenvid, void *srcva,
 
         else if (srcerr == 0 && dsterr==0) {
        		pte_t *pte;
-        	struct Page *pp = page_lookup(srcenv->env_pml4e, srcva, &pte);
+		int r = 0;
 
-        	if (pp == NULL)
-                	return -E_INVAL;
-	        if (!(*pte & PTE_U))
-                	return -E_INVAL;
+		env_as_lock_pair(srcenv, dstenv);
+        	struct Page *pp = page_lookup(srcenv->env_pml4e, srcva, &pte);
 
-                if (page_insert(dstenv->env_pml4e, pp, dstva, perm) < 0)
-                        return -E_NO_MEM;
-		else
-			return 0;
+        	if (pp == NULL || !(*pte & PTE_U))
+                	r = -E_INVAL;
+                else if (page_insert(dstenv->env_pml4e, pp, dstva, perm) < 0)
+                        r = -E_NO_MEM;
+		env_as_unlock_pair(srcenv, dstenv);
+		return r;
 	}
     panic("sys_page_map not implemented");
 }
@@ -348,7 +361,9 @@ sys_page_unmap(envid_t envid, void *va)
     if (err < 0)
 	return err;
     else if (err == 0) {
+	spin_lock(env_as_lock(env));
 	page_remove(env->env_pml4e, va);
+	spin_unlock(env_as_lock(env));
 	return 0;
     }
     panic("sys_page_unmap not implemented");
@@ -392,23 +407,45 @@ sys_page_unmap(envid_t envid, void *va)
 //		current environment's address space.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
 //		address space.
+static int ipc_send_locked(struct Env *env, uint32_t value, void *srcva,
+			   unsigned perm);
+
     static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
     // LAB 4: Your code here.
 	struct Env *env;
-	pte_t *pte = NULL;
-	struct Page *gu_pa = NULL;
-	uint64_t ept_ret = 0;
-	int i = 0;
+	int r;
 
 	if (envid2env(envid, &env, 0) < 0) {
 		cprintf("sys_ipc_try_send failed: Bad env\n");
 		return -E_BAD_ENV;
 	}
+	// ipc_lock makes checking and claiming the receiver atomic; both
+	// address spaces stay locked while the page moves between them.
+	spin_lock(&ipc_lock);
+	env_as_lock_pair(curenv, env);
+	r = ipc_send_locked(env, value, srcva, perm);
+	env_as_unlock_pair(curenv, env);
+	spin_unlock(&ipc_lock);
+	return r;
+}
+
+// The body of sys_ipc_try_send, called with ipc_lock and the address space
+// locks of curenv and env held.
+    static int
+ipc_send_locked(struct Env *env, uint32_t value, void *srcva, unsigned perm)
+{
+	pte_t *pte = NULL;
+	struct Page *gu_pa = NULL;
+
 //cprintf("ABHIROOP:%d:\n", __LINE__);
-	if ((env->env_status != ENV_NOT_RUNNABLE) || (env->env_ipc_recving != 1))
+	if ((env->env_status != ENV_NOT_RUNNABLE) || (env->env_ipc_recving != 1)) {
+	    // A halted guest can't receive yet; wake it so it can post its
+	    // receive, and let the sender retry.
+	    vmx_guest_wake(env, VMX_WAKE_IPC);
 	    return -E_IPC_NOT_RECV;
+	}
 	
 	if ((uint64_t)srcva < UTOP){
 		//Check if the page in alligned.
@@ -422,14 +459,14 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 		}
 		else
 		{
-		    ept_ret = e_pml4e_walk(curenv->env_pml4e, srcva, 0);
-//cprintf("ABHIROOP:%d:0x%x:srcva:0x%x\n", __LINE__, ept_ret), srcva;
-//llubu: ?		    if (ept_ret == E_NO_ENT || ept_ret == E_NO_MEM)
-//		    {
-//			return -ept_ret;
-//		    }
-		    pte = (pte_t *) ept_ret;
-		    gu_pa = pa2page((physaddr_t)(PTE_ADDR(*pte)));
+		    // The leaf may be a large page; use the 4K page inside it.
+		    physaddr_t src_pa;
+		    if (ept_lookup_leaf(curenv->env_pml4e, srcva, &pte, &src_pa) < 0)
+		    {
+			cprintf("\nsys_ipc_try_send failed: Page is not mapped to srcva\n");
+			return -E_INVAL;
+		    }
+		    gu_pa = pa2page(src_pa);
 		}
 //cprintf("ABHIROOP:%d:\n", __LINE__);
 		if (gu_pa == NULL)
@@ -496,10 +533,8 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 	}
 	
 //cprintf("ABHIROOP:%d:\n", __LINE__);
-	env->env_status = ENV_RUNNABLE;
+	sched_wakeup(env);
 	return 0;
-
-    panic("sys_ipc_try_send not implemented");
 }
 
 // Block until a value is ready.  Record that you want to receive
@@ -540,11 +575,13 @@ sys_ipc_recv(void *dstva)
 	{
 	    curenv->env_ipc_dstva = dstva;
 	} */
+        spin_lock(&ipc_lock);
         curenv->env_ipc_dstva = dstva;
         curenv->env_ipc_perm = 0;
         curenv->env_ipc_from = 0;
         curenv->env_ipc_recving = 1; //Receiver is ready to listen
         curenv->env_status = ENV_NOT_RUNNABLE; //Block the execution of current env.
+        spin_unlock(&ipc_lock);
 	
 
 	sched_yield(); //Give up the cpu. Don't return, instead env_run some other env.
@@ -563,17 +600,20 @@ sys_time_msec(void)
 }
 
 // Network related sycalls 
+
+// Send the frame [data, data + len) through the host's port of the virtual
+// switch.  The frame is copied, since the caller may reuse its buffer as
+// soon as this returns.
 int
 sys_net_try_send(char * data, int len)
 {
-
-	if ((uintptr_t)data >= UTOP)
+	if ((uintptr_t)data >= UTOP || len <= 0)
 	{
 	    cprintf("\n NET SEND ERROR UTOP \n");
 		return -E_INVAL;
 	}
-
-	return e1000_transmit(data, len);
+	user_mem_assert(curenv, data, len, PTE_U | PTE_P);
+	return vsw_transmit(VSW_PORT_HOST, data, len);
 }
 
 int
@@ -585,7 +625,10 @@ sys_net_try_receive(char *data, int *len)
 	return -E_INVAL;
     }
   //  cprintf("\n sys_net_try_receive \n");
-    *len = e1000_receive(data);
+    // The input env polls here all the time, so this is also where frames
+    // sent with sys_net_try_send() get their pages unpinned.
+    e1000_tx_poll();
+    *len = vsw_receive(VSW_PORT_HOST, data);
     if (*len > 0)
     {
 	return 0;
@@ -646,10 +689,12 @@ sys_ept_map(envid_t srcenvid, void *srcva,
 		cprintf("GUEST:%x:%d\n", dstenv->env_vmxinfo.phys_sz, __LINE__);
 		return -E_INVAL;
 	    }
+	    env_as_lock_pair(srcenv, dstenv);
 	    tmp_map = page_lookup(srcenv->env_pml4e, (void *)srcva, (pte_t **)&host_pte);		//this gives me page for the srcva
 
 	    if ((perm & __EPTE_WRITE) && (!(*host_pte & PTE_W))) 
 	    {
+		env_as_unlock_pair(srcenv, dstenv);
 		cprintf("\n Failing in write check permissions \n");
 		return -E_INVAL;
 	    }
@@ -660,15 +705,17 @@ sys_ept_map(envid_t srcenvid, void *srcva,
 	}
 	if (val < 0)
 	{
+	    env_as_unlock_pair(srcenv, dstenv);
 	    return val;
 	}
 	else
 	{
 	    tmp_map = page_lookup(srcenv->env_pml4e, (void *) srcva, (pte_t**)NULL);
 	    if (tmp_map)
-		tmp_map->pp_ref++;
+		__sync_fetch_and_add(&tmp_map->pp_ref, 1);
 	    else
 		cprintf("\n CANT GET PAGE HANDLE IN EPT_MAP \n");
+	    env_as_unlock_pair(srcenv, dstenv);
 	    return 0;
 	}
 
@@ -689,6 +736,145 @@ sys_env_mkguest(uint64_t gphysz, uint64_t gRIP) {
     return e->env_id;
 }
 
+// Set the time slice of a guest, in TSC cycles (0 for the default).
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the guest doesn't exist, isn't a guest, or the caller
+//		doesn't have permission to change it.
+static int
+sys_vmx_set_quantum(envid_t guest, uint64_t cycles) {
+    struct Env *e;
+
+    if (envid2env(guest, &e, 1) < 0)
+        return -E_BAD_ENV;
+    return vmx_set_quantum(e, cycles);
+}
+
+// Add a vCPU to a guest made with sys_env_mkguest, before it first runs.
+// The vCPU waits for the guest's INIT/STARTUP IPIs.
+//
+// Returns the envid of the vCPU on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the guest doesn't exist, isn't a guest's BSP, or the
+//		caller doesn't have permission to change it.
+//	-E_NO_FREE_ENV if the guest has VMX_MAX_VCPUS vCPUs or no env is free.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_env_mkvcpu(envid_t guest) {
+    struct Env *bsp, *e;
+    int r;
+
+    if (envid2env(guest, &bsp, 1) < 0 || bsp->env_type != ENV_TYPE_GUEST ||
+            bsp->env_vmxinfo.vcpu_id != 0)
+        return -E_BAD_ENV;
+    if ((r = env_vcpu_alloc(&e, bsp)) < 0)
+        return r;
+    return e->env_id;
+}
+
+// Set the scheduler weight of envid: its share of the CPU relative to the
+// other runnable envs (SCHED_WEIGHT_DEFAULT is the normal share).
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if weight is 0 or above SCHED_WEIGHT_MAX.
+static int
+sys_env_set_weight(envid_t envid, uint32_t weight) {
+    struct Env *e;
+
+    if (weight == 0 || weight > SCHED_WEIGHT_MAX)
+        return -E_INVAL;
+    if (envid2env(envid, &e, 1) < 0)
+        return -E_BAD_ENV;
+    sched_set_weight(e, weight);
+    return 0;
+}
+
+// Copy the VM exit statistics of a guest, summed over its vCPUs, to buf.
+// Any env may read them.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the guest doesn't exist or isn't a guest.
+static int
+sys_vmx_get_exit_stats(envid_t guest, struct vmx_exit_stats *buf) {
+    struct Env *e;
+
+    if (envid2env(guest, &e, 0) < 0 || e->env_type != ENV_TYPE_GUEST)
+        return -E_BAD_ENV;
+    user_mem_assert(curenv, buf, sizeof(*buf), PTE_U | PTE_W | PTE_P);
+    vmx_exit_stats_sum(e, buf);
+    return 0;
+}
+
+// Look up the BSP of a guest whose disk the caller serves.
+static int
+pvblk_guest(envid_t guest, struct Env **g) {
+    if (envid2env(guest, g, 1) < 0 || (*g)->env_type != ENV_TYPE_GUEST ||
+            (*g)->env_vmxinfo.vcpu_id != 0)
+        return -E_BAD_ENV;
+    return 0;
+}
+
+// Serve the paravirtual disk of guest: copy its next request to req and,
+// for a write, the data to buf, which must hold VMX_PVBLK_MAXPAGES pages.
+// If the guest has no request queued, sleeps until it posts one and then
+// returns -E_NO_ENT, so the caller asks again.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the guest doesn't exist (any more), isn't a guest's BSP,
+//		or the caller doesn't have permission to change it.
+//	-E_NO_ENT as above.
+static int
+sys_vmx_blk_next(envid_t guest, struct vmx_pvblk_req *req, void *buf) {
+    struct Env *g;
+    int r;
+
+    if (pvblk_guest(guest, &g) < 0)
+        return -E_BAD_ENV;
+    user_mem_assert(curenv, req, sizeof(*req), PTE_U | PTE_W | PTE_P);
+    user_mem_assert(curenv, buf, VMX_PVBLK_MAXPAGES * PGSIZE,
+            PTE_U | PTE_W | PTE_P);
+    if ((r = vmx_pvblk_next(g, req, buf)) != -E_NO_ENT)
+        return r;
+    // Like sys_ipc_recv(), never returns: the env comes back with rax set
+    // once VMX_VMCALL_BLK_NOTIFY or the guest's death wakes it.
+    curenv->env_tf.tf_regs.reg_rax = -E_NO_ENT;
+    curenv->env_status = ENV_NOT_RUNNABLE;
+    sched_yield();
+}
+
+// Complete the request sys_vmx_blk_next() returned with status (0, or < 0
+// to fail it).  For a successful read, buf holds the data.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV as for sys_vmx_blk_next().
+//	-E_INVAL if the guest has no request outstanding.
+static int
+sys_vmx_blk_done(envid_t guest, int status, const void *buf) {
+    struct Env *g;
+
+    if (pvblk_guest(guest, &g) < 0)
+        return -E_BAD_ENV;
+    user_mem_assert(curenv, buf, VMX_PVBLK_MAXPAGES * PGSIZE, PTE_U | PTE_P);
+    return vmx_pvblk_done(g, status, buf);
+}
+
+// Ask guest to hand 'pages' pages of its memory back to the host through
+// its balloon driver, or to take them back if the balloon is larger.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the guest doesn't exist (any more), isn't a guest,
+//		or the caller doesn't have permission to change it.
+//	-E_INVAL if pages is more than the guest's memory.
+static int
+sys_vmx_balloon(envid_t guest, uint64_t pages) {
+    struct Env *g;
+
+    if (envid2env(guest, &g, 1) < 0 || g->env_type != ENV_TYPE_GUEST)
+        return -E_BAD_ENV;
+    return vmx_balloon_set_target(g, pages);
+}
+
 
 // Dispatches to the correct kernel function, passing the arguments.
     int64_t
@@ -757,6 +943,22 @@ syscall(uint64_t syscallno, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4,
         case SYS_env_mkguest:
             return sys_env_mkguest(a1, a2);
 
+        case SYS_vmx_set_quantum:
+            return sys_vmx_set_quantum(a1, a2);
+
+        case SYS_env_mkvcpu:
+            return sys_env_mkvcpu(a1);
+        case SYS_env_set_weight:
+            return sys_env_set_weight(a1, a2);
+        case SYS_vmx_get_exit_stats:
+            return sys_vmx_get_exit_stats(a1, (struct vmx_exit_stats *) a2);
+        case SYS_vmx_blk_next:
+            return sys_vmx_blk_next(a1, (struct vmx_pvblk_req *) a2, (void *) a3);
+        case SYS_vmx_blk_done:
+            return sys_vmx_blk_done(a1, a2, (const void *) a3);
+        case SYS_vmx_balloon:
+            return sys_vmx_balloon(a1, a2);
+
         default:
 	    panic("SYS CALL NOT IMPLEMENTED");
             return -E_NO_SYS;
@@ -14,6 +14,7 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/time.h>
+#include <vmm/vmx.h>
 
 extern uintptr_t gdtdesc_64;
 static struct Taskstate ts;
@@ -317,7 +318,13 @@ trap_dispatch(struct Trapframe *tf)
 		// Be careful! In multiprocessors, clock interrupts are
 		// triggered on every CPU. 								WHY HAS HE LEFT THIS CRYPTIC COMMENT? WHEN IT TRAPS WE ALREADY HAVE LOCK.
 		// LAB 6: Your code here.
-		time_tick();
+		if (thiscpu == bootcpu) {
+			time_tick();
+			// Tick guest APIC timers, wake halted guests whose
+			// deadline passed.
+			vmx_guest_tick();
+			sched_tick();
+		}
 		
 		sched_yield();
 		return;
@@ -344,6 +351,35 @@ trap_dispatch(struct Trapframe *tf)
 	}
 }
 
+// Handle a host interrupt that caused a guest to exit.  The CPU already
+// acknowledged it on exit, so it never went through the IDT.
+// Returns true if the guest should give up the CPU.
+bool
+trap_guest_irq(int trapno)
+{
+	switch (trapno) {
+	case T_IRQ0:
+		lapic_eoi();
+		if (thiscpu == bootcpu) {
+			time_tick();
+			vmx_guest_tick();
+			sched_tick();
+		}
+		return true;
+	case T_IRQ1:
+		kbd_intr();
+		return false;
+	case T_IRQ4:
+		serial_intr();
+		return false;
+	case IRQ_OFFSET + IRQ_SPURIOUS:
+		return false;
+	}
+	cprintf("Unexpected host interrupt %d in guest\n", trapno);
+	lapic_eoi();
+	return false;
+}
+
 void
 trap(struct Trapframe *tf)
 {
@@ -371,7 +407,7 @@ trap(struct Trapframe *tf)
 		// Acquire the big kernel lock before doing any
 		// serious kernel work.
 		// LAB 4: Your code here.
-//		lock_kernel();
+		lock_kernel();
 		assert(curenv);
 		
 		// Garbage collect if current enviroment is a zombie
@@ -147,3 +147,37 @@ sys_env_mkguest(uint64_t gphysz, uint64_t gRIP) {
     return (envid_t) syscall(SYS_env_mkguest, 0, gphysz, gRIP, 0, 0, 0);
 }
 
+int
+sys_vmx_set_quantum(envid_t guest, uint64_t cycles) {
+    return syscall(SYS_vmx_set_quantum, 0, guest, cycles, 0, 0, 0);
+}
+
+envid_t
+sys_env_mkvcpu(envid_t guest) {
+    return (envid_t) syscall(SYS_env_mkvcpu, 0, guest, 0, 0, 0, 0);
+}
+
+int
+sys_env_set_weight(envid_t envid, uint32_t weight) {
+    return syscall(SYS_env_set_weight, 1, envid, weight, 0, 0, 0);
+}
+
+int
+sys_vmx_get_exit_stats(envid_t guest, struct vmx_exit_stats *buf) {
+    return syscall(SYS_vmx_get_exit_stats, 0, guest, (uint64_t) buf, 0, 0, 0);
+}
+
+int
+sys_vmx_blk_next(envid_t guest, struct vmx_pvblk_req *req, void *buf) {
+    return syscall(SYS_vmx_blk_next, 0, guest, (uint64_t) req, (uint64_t) buf, 0, 0);
+}
+
+int
+sys_vmx_blk_done(envid_t guest, int status, const void *buf) {
+    return syscall(SYS_vmx_blk_done, 0, guest, status, (uint64_t) buf, 0, 0);
+}
+
+int
+sys_vmx_balloon(envid_t guest, uint64_t pages) {
+    return syscall(SYS_vmx_balloon, 0, guest, pages, 0, 0, 0);
+}
@@ -1,25 +1,115 @@
-// Demonstrate lack of fairness in IPC.
-// Start three instances of this program as envs 1, 2, and 3.
-// (user/idle is env 0).
+// Measure how the CPU is shared between envs of different scheduler
+// weights.  Start several instances of this program as envs 1, 2, 3, ...
+// (user/idle is env 0).  Env 1 only reports; the others spin without ever
+// blocking or yielding, asking for 1x, 2x and 3x the default weight, so
+// each uses all the CPU time the scheduler gives it.
+//
+// Every SAMPLE_MSEC the reporter notes which envs compete for the CPU and
+// the share their weights entitle them to at that moment.  Every
+// REPORT_MSEC it prints the share of the CPU each env got since the last
+// report, next to its entitlement averaged over the samples taken since.
 
 #include <inc/lib.h>
 
+#define SAMPLE_MSEC 10
+#define REPORT_MSEC 1000
+
+static uint64_t last_cputime[NENV];
+// Entitled share, in 1/10000, summed over nsamples samples.
+static uint64_t entitled[NENV];
+static uint32_t nsamples;
+
+static bool
+counted(const volatile struct Env *e)
+{
+    return e->env_type != ENV_TYPE_IDLE && e->env_status != ENV_FREE &&
+        e != thisenv;
+}
+
+static bool
+competing(const volatile struct Env *e)
+{
+    return counted(e) && (e->env_status == ENV_RUNNABLE ||
+            e->env_status == ENV_RUNNING);
+}
+
+static void
+sample(void)
+{
+    uint32_t weights = 0;
+    int i;
+
+    for (i = 0; i < NENV; i++)
+        if (competing(&envs[i]))
+            weights += envs[i].env_weight;
+    if (!weights)
+        return;
+    for (i = 0; i < NENV; i++)
+        if (competing(&envs[i]))
+            entitled[i] += envs[i].env_weight * 10000ULL / weights;
+    nsamples++;
+}
+
+static void
+report(void)
+{
+    uint64_t used, total = 0;
+    int i;
+
+    for (i = 0; i < NENV; i++)
+        if (counted(&envs[i]))
+            total += envs[i].env_cputime - last_cputime[i];
+    if (!total || !nsamples)
+        return;
+
+    cprintf("env       class   weight  share  entitled\n");
+    for (i = 0; i < NENV; i++) {
+        if (!counted(&envs[i]))
+            continue;
+        used = envs[i].env_cputime - last_cputime[i];
+        last_cputime[i] = envs[i].env_cputime;
+        if (used || entitled[i])
+            cprintf("%08x  %s  %6d  %4d%%  %7d%%\n", envs[i].env_id,
+                    envs[i].env_sched_class == SCHED_CLASS_LATENCY ?
+                    "latency" : "batch  ",
+                    envs[i].env_weight, (int) (used * 100 / total),
+                    (int) (entitled[i] / nsamples / 100));
+        entitled[i] = 0;
+    }
+    nsamples = 0;
+}
+
     void
 umain(int argc, char **argv)
 {
-    envid_t who, id;
+    unsigned int next_sample, next_report;
+    envid_t id;
+    int i;
 
     id = sys_getenvid();
 
     if (thisenv == &envs[1]) {
+        for (i = 0; i < NENV; i++)
+            last_cputime[i] = envs[i].env_cputime;
+        next_sample = sys_time_msec() + SAMPLE_MSEC;
+        next_report = sys_time_msec() + REPORT_MSEC;
         while (1) {
-            ipc_recv(&who, 0, 0);
-            cprintf("%x recv from %x\n", id, who);
+            if ((int) (sys_time_msec() - next_sample) < 0) {
+                sys_yield();
+                continue;
+            }
+            sample();
+            next_sample += SAMPLE_MSEC;
+            if ((int) (sys_time_msec() - next_report) >= 0) {
+                report();
+                next_report = sys_time_msec() + REPORT_MSEC;
+            }
         }
     } else {
-        cprintf("%x loop sending to %x\n", id, envs[1].env_id);
+        // 1x, 2x, 3x the default weight.
+        sys_env_set_weight(0, SCHED_WEIGHT_DEFAULT * (ENVX(id) % 3 + 1));
+        cprintf("%x spinning\n", id);
         while (1)
-            ipc_send(envs[1].env_id, 0, 0, 0);
+            ;
     }
 }
-
@@ -4,8 +4,12 @@
 #include <inc/ept.h>
 #define GUEST_KERN "/vmm/kernel"
 #define GUEST_BOOT "/vmm/boot"
+// Image behind the guest's paravirtual disk.
+#define GUEST_DISK "/vmm/fs.img"
 
 #define JOS_ENTRY 0x7000
+// vCPUs per guest; the guest boots the APs itself with INIT/STARTUP IPIs.
+#define GUEST_NCPU 2
 
 // Map a region of file fd into the guest at guest physical address gpa.
 // The file region to map should start at fileoffset and be length filesz.
@@ -126,6 +130,51 @@ error:
     return -E_NO_SYS;
 }
 
+// Carry out one paravirtual disk request against the image open on fd,
+// moving its whole extent with one seek and one read or write loop.
+// Return 0 on success, <0 on failure.
+static int
+disk_rw(int fd, struct vmx_pvblk_req *req, char *buf) {
+    int n = req->nsecs * VMX_PVBLK_SECTSIZE;
+    int r, done;
+
+    if ((r = seek(fd, req->sector * VMX_PVBLK_SECTSIZE)) < 0)
+        return r;
+    if (req->op == VMX_PVBLK_READ) {
+        if ((r = readn(fd, buf, n)) < 0)
+            return r;
+        // Whatever lies past the end of the image reads as zeros.
+        memset(buf + r, 0, n - r);
+        return 0;
+    }
+    for (done = 0; done < n; done += r)
+        if ((r = write(fd, buf + done, n - done)) <= 0)
+            return r < 0 ? r : -E_NO_DISK;
+    return 0;
+}
+
+// Serve the guest's paravirtual disk out of GUEST_DISK until the guest
+// goes away.
+static void
+serve_disk(envid_t guest) {
+    static char buf[VMX_PVBLK_MAXPAGES * PGSIZE] __attribute__((aligned(PGSIZE)));
+    struct vmx_pvblk_req req;
+    int fd, r;
+
+    if ((fd = open(GUEST_DISK, O_RDWR)) < 0) {
+        cprintf("open %s: %e\n", GUEST_DISK, fd);
+        wait(guest);
+        return;
+    }
+    while ((r = sys_vmx_blk_next(guest, &req, buf)) != -E_BAD_ENV) {
+        // -E_NO_ENT: we slept until the guest posted more, so ask again.
+        if (r < 0)
+            continue;
+        sys_vmx_blk_done(guest, disk_rw(fd, &req, buf), buf);
+    }
+    close(fd);
+}
+
 void
 umain(int argc, char **argv) {
     int ret;
@@ -158,9 +207,17 @@ cprintf("BOOT%d\n",__LINE__);
 	exit();
     }
 //    cprintf("\n BOOTLOADER DONE \n");
+    // Add the APs.  They must exist before the guest asks for its MP table.
+    int i;
+    for (i = 1; i < GUEST_NCPU; i++) {
+        if ((ret = sys_env_mkvcpu(guest)) < 0) {
+            cprintf("Error creating vCPU %d: %e\n", i, ret);
+            exit();
+        }
+    }
     // Mark the guest as runnable.
     sys_env_set_status(guest, ENV_RUNNABLE);
-    wait(guest);
+    serve_disk(guest);
 }
 
 
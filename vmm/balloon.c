@@ -0,0 +1,193 @@
+#include <vmm/vmx.h>
+#include <vmm/balloon.h>
+#include <vmm/ept.h>
+
+#include <inc/mmu.h>
+#include <inc/error.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/spinlock.h>
+
+/*
+ * Memory balloon for guests.
+ *
+ * Guest RAM is backed on demand by handle_eptviolation() and otherwise
+ * only given back when the guest dies.  The balloon lets the host take
+ * memory from a running guest: the host sets how many pages it wants
+ * (vmx_balloon_set_target(), from sys_vmx_balloon() or the monitor), the
+ * guest kernel polls that with VMX_BALLOON_QUERY and hands over free pages
+ * of its own with VMX_BALLOON_INFLATE.  Their EPT entries become
+ * EPTE_BALLOON markers, and the host pages are freed once no CPU can still
+ * hold a translation to them.  VMX_BALLOON_DEFLATE returns pages to the
+ * guest, which get fresh backing on their next EPT violation.  All of it
+ * runs under the kernel lock; the balloon state lives in the guest's BSP.
+ */
+
+// Host pages taken from guests, linked through pp_link, to be freed when
+// every CPU has flushed EPT generation balloon_gen.
+static struct Page *balloon_pending;
+static uint64_t balloon_gen;
+
+static struct Env *
+balloon_owner(struct Env *e)
+{
+    return &envs[ENVX(e->env_vmxinfo.vcpu_bsp)];
+}
+
+// Can the guest page at gpa go into the balloon?  Only guest RAM, and
+// not the pages the host reads and writes behind the guest's back: its
+// registered rings, and pages also mapped elsewhere, which freeing would
+// not give back.
+static bool
+balloon_page_ok(struct VmxGuestInfo *ginfo, epte_t *eptrt, uint64_t gpa)
+{
+    void *rings[] = { ginfo->ring, ginfo->pvnet[0], ginfo->pvnet[1],
+                      ginfo->pvblk };
+    void *hva;
+    int i;
+
+    if (PGOFF(gpa) || gpa == 0 || (gpa >= IOPHYSMEM && gpa < EXTPHYSMEM) ||
+            gpa >= ginfo->phys_sz)
+        return false;
+    ept_gpa2hva(eptrt, (void *) gpa, &hva);
+    if (hva && pa2page(PADDR(hva))->pp_ref > 1)
+        return false;
+    for (i = 0; hva && i < sizeof(rings) / sizeof(rings[0]); i++)
+        if (rings[i] && ROUNDDOWN(rings[i], PGSIZE) == hva)
+            return false;
+    return true;
+}
+
+// Takes the guest pages list[0, count) out of the EPT of e's guest.
+// Returns how many were, stopping at the first that cannot be.
+static int64_t
+balloon_inflate(struct Env *e, uint64_t *list, uint64_t count)
+{
+    struct VmxGuestInfo *ginfo = &balloon_owner(e)->env_vmxinfo;
+    struct Page *pp;
+    uint64_t i, freed = 0;
+
+    spin_lock(env_as_lock(e));
+    for (i = 0; i < count; i++) {
+        if (!balloon_page_ok(ginfo, e->env_pml4e, list[i]) ||
+                ept_balloon_page(e->env_pml4e, (void *) list[i], &pp) < 0)
+            break;
+        if (!pp)
+            continue;
+        pp->pp_link = balloon_pending;
+        balloon_pending = pp;
+        freed++;
+    }
+    ginfo->balloon_pages += i;
+    ginfo->ept_pages_mapped -= MIN(ginfo->ept_pages_mapped, freed);
+    spin_unlock(env_as_lock(e));
+
+    if (freed) {
+        // vCPUs on other CPUs may still use the old translations until
+        // they flush, so the pages wait in balloon_pending until then.
+        balloon_gen = vmx_ept_bump();
+        vmx_balloon_reap();
+    }
+    return i;
+}
+
+// Gives the ballooned guest pages list[0, count) back to e's guest.
+// Pages the guest already took back by touching them (see
+// vmx_balloon_reclaimed()) are skipped.  Returns how many were, stopping
+// at the first that is neither.
+static int64_t
+balloon_deflate(struct Env *e, uint64_t *list, uint64_t count)
+{
+    struct VmxGuestInfo *ginfo = &balloon_owner(e)->env_vmxinfo;
+    uint64_t i, freed = 0;
+    void *hva;
+
+    spin_lock(env_as_lock(e));
+    for (i = 0; i < count; i++) {
+        if (PGOFF(list[i]))
+            break;
+        if (ept_unballoon_page(e->env_pml4e, (void *) list[i]) == 0) {
+            freed++;
+            continue;
+        }
+        ept_gpa2hva(e->env_pml4e, (void *) list[i], &hva);
+        if (!hva)
+            break;
+    }
+    ginfo->balloon_pages -= MIN(ginfo->balloon_pages, freed);
+    spin_unlock(env_as_lock(e));
+    return i;
+}
+
+/*
+ * Called by the EPT fault path, under the guest's address space lock, when
+ * a vCPU of the guest ginfo belongs to touched a page in its balloon.  The
+ * page was mapped again, so it no longer counts.
+ */
+void
+vmx_balloon_reclaimed(struct VmxGuestInfo *ginfo)
+{
+    struct VmxGuestInfo *owner = &envs[ENVX(ginfo->vcpu_bsp)].env_vmxinfo;
+
+    if (owner->balloon_pages)
+        owner->balloon_pages--;
+}
+
+/*
+ * Handles VMX_VMCALL_BALLOON from vCPU e: operation op on the list of
+ * count guest physical addresses at gpa.  See inc/vmx.h.
+ */
+int64_t
+vmx_balloon(struct Env *e, int op, uint64_t gpa, uint64_t count)
+{
+    uint64_t *list;
+
+    if (op == VMX_BALLOON_QUERY)
+        return balloon_owner(e)->env_vmxinfo.balloon_target;
+    if (op != VMX_BALLOON_INFLATE && op != VMX_BALLOON_DEFLATE)
+        return -E_INVAL;
+    if (count > VMX_BALLOON_MAX || PGOFF(gpa) + count * sizeof(*list) > PGSIZE)
+        return -E_INVAL;
+    if (count == 0)
+        return 0;
+    ept_gpa2hva(e->env_pml4e, (void *) gpa, (void **) &list);
+    if (!list)
+        return -E_INVAL;
+    if (op == VMX_BALLOON_INFLATE)
+        return balloon_inflate(e, list, count);
+    return balloon_deflate(e, list, count);
+}
+
+/*
+ * Host policy: ask the guest that e belongs to for a balloon of 'pages'
+ * pages, growing or shrinking it.  The guest adjusts the next time it
+ * polls; it may keep fewer pages in the balloon if it runs short itself.
+ */
+int
+vmx_balloon_set_target(struct Env *e, uint64_t pages)
+{
+    struct VmxGuestInfo *ginfo = &balloon_owner(e)->env_vmxinfo;
+
+    if (pages > ginfo->phys_sz / PGSIZE)
+        return -E_INVAL;
+    ginfo->balloon_target = pages;
+    return 0;
+}
+
+/*
+ * Frees the host pages taken by inflations once every CPU has flushed
+ * the EPT translations to them.  Called on every host timer tick.
+ */
+void
+vmx_balloon_reap(void)
+{
+    struct Page *pp;
+
+    if (!balloon_pending || !vmx_ept_synced(balloon_gen))
+        return;
+    while ((pp = balloon_pending)) {
+        balloon_pending = pp->pp_link;
+        pp->pp_link = NULL;
+        page_decref(pp);
+    }
+}
@@ -0,0 +1,14 @@
+#ifndef JOS_VMM_BALLOON_H
+#define JOS_VMM_BALLOON_H
+
+#include <inc/types.h>
+#include <inc/vmx.h>
+
+struct Env;
+
+int64_t vmx_balloon( struct Env *e, int op, uint64_t gpa, uint64_t count );
+int vmx_balloon_set_target( struct Env *e, uint64_t pages );
+void vmx_balloon_reap( void );
+void vmx_balloon_reclaimed( struct VmxGuestInfo *ginfo );
+
+#endif
@@ -0,0 +1,216 @@
+#include <vmm/vmx.h>
+#include <vmm/cpuid.h>
+
+#include <inc/x86.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <kern/pmap.h>
+
+/*
+ * Guest CPUID emulation.
+ *
+ * Every guest gets a table of all CPUID leaves/subleaves, filled from the
+ * host CPU once at env_guest_alloc() time and then edited by the policy
+ * below.  CPUID exits are served from that table, which is cheaper than
+ * executing the (serializing) instruction and keeps the feature set a guest
+ * sees stable for its whole life.
+ */
+
+/*
+ * Policy applied on top of the host values, in order.  Add entries here to
+ * hide (clear) or expose (set) feature bits for all guests.
+ */
+static const struct vmx_cpuid_policy vmx_cpuid_policy[] = {
+    // Hide VMX from the guest; nested virtualization is not supported.
+    { 0x1, 0, VMX_CPUID_ECX, 1 << 5, 0 },
+    // Hypervisor present bit.
+    { 0x1, 0, VMX_CPUID_ECX, 0, 1u << 31 },
+};
+
+// Hypervisor identification, returned in ebx, ecx, edx of 0x40000000.
+static const char vmx_cpuid_signature[12] = "JOSVMMJOSVMM";
+
+// Leaves whose output depends on the subleaf index in ecx.
+static bool
+cpuid_has_subleaves(uint32_t leaf) {
+    switch (leaf) {
+        case 0x4: case 0x7: case 0xB: case 0xD: case 0xF:
+        case 0x10: case 0x12: case 0x14: case 0x17: case 0x18:
+        case 0x8000001D:
+            return true;
+    }
+    return false;
+}
+
+static struct vmx_cpuid_entry *
+cpuid_add(struct VmxGuestInfo *ginfo, uint32_t leaf, uint32_t subleaf) {
+    struct vmx_cpuid_entry *ent;
+
+    if (ginfo->cpuid_count >= VMX_CPUID_MAX_ENTRIES)
+        return NULL;
+    ent = &ginfo->cpuid_table[ginfo->cpuid_count++];
+    ent->leaf = leaf;
+    ent->subleaf = subleaf;
+    ent->flags = cpuid_has_subleaves(leaf) ? VMX_CPUID_SUBLEAF_INDEXED : 0;
+    cpuid_subleaf(leaf, subleaf, &ent->regs[VMX_CPUID_EAX],
+            &ent->regs[VMX_CPUID_EBX], &ent->regs[VMX_CPUID_ECX],
+            &ent->regs[VMX_CPUID_EDX]);
+    return ent;
+}
+
+// The subleaves of an indexed leaf that exist, as a bitmap, going by what
+// its subleaf 0 (regs) reports.  Leaves that mark their own end instead
+// report every subleaf; see cpuid_subleaf_end().
+static uint64_t
+cpuid_subleaf_mask(uint32_t leaf, const uint32_t *regs) {
+    uint32_t eax, ecx, edx;
+
+    switch (leaf) {
+        case 0x7: case 0x14: case 0x17: case 0x18:
+            // Subleaf 0 eax is the highest subleaf.
+            if (regs[VMX_CPUID_EAX] >= 63)
+                return ~0ULL;
+            return (2ULL << regs[VMX_CPUID_EAX]) - 1;
+        case 0xD:
+            // Subleaf n >= 2 describes XSAVE state component n, which is
+            // supported if set in XCR0 (subleaf 0 edx:eax) or IA32_XSS
+            // (subleaf 1 edx:ecx).  Components can be skipped.
+            cpuid_subleaf(0xD, 1, &eax, NULL, &ecx, &edx);
+            return ((uint64_t) regs[VMX_CPUID_EDX] << 32 | regs[VMX_CPUID_EAX]) |
+                ((uint64_t) edx << 32 | ecx) | 0x3;
+        case 0xF:
+            // Subleaf 0 edx: the resource types that can be monitored.
+            return regs[VMX_CPUID_EDX] | 0x1;
+        case 0x10:
+            // Subleaf 0 ebx: the resource types that can be allocated.
+            return regs[VMX_CPUID_EBX] | 0x1;
+    }
+    return ~0ULL;
+}
+
+// Does subleaf end a leaf that enumerates until a terminating subleaf?
+static bool
+cpuid_subleaf_end(uint32_t leaf, uint32_t subleaf, const uint32_t *regs) {
+    switch (leaf) {
+        case 0x4: case 0x8000001D:
+            // Cache type "null".
+            return (regs[VMX_CPUID_EAX] & 0x1F) == 0;
+        case 0xB:
+            // Level type "invalid".
+            return ((regs[VMX_CPUID_ECX] >> 8) & 0xFF) == 0;
+        case 0x12:
+            // Subleaves 2 and up are EPC sections, up to an invalid one.
+            return subleaf >= 2 && (regs[VMX_CPUID_EAX] & 0xF) == 0;
+    }
+    return false;
+}
+
+// Snapshot leaves [base, max], where max is reported by leaf base itself.
+static void
+cpuid_add_range(struct VmxGuestInfo *ginfo, uint32_t base) {
+    uint32_t leaf, max, subleaf;
+    struct vmx_cpuid_entry *ent;
+    uint64_t mask;
+
+    cpuid(base, &max, NULL, NULL, NULL);
+    if (max < base || max - base > 0xFF)
+        return;
+    for (leaf = base; leaf <= max; leaf++) {
+        if (!(ent = cpuid_add(ginfo, leaf, 0)))
+            return;
+        if (!(ent->flags & VMX_CPUID_SUBLEAF_INDEXED))
+            continue;
+        // Subleaves that are left out read as zeros; see vmx_cpuid_lookup().
+        mask = cpuid_subleaf_mask(leaf, ent->regs);
+        for (subleaf = 1; subleaf < VMX_CPUID_MAX_SUBLEAF; subleaf++) {
+            if (!(mask & (1ULL << subleaf)))
+                continue;
+            if (!(ent = cpuid_add(ginfo, leaf, subleaf)))
+                return;
+            if (cpuid_subleaf_end(leaf, subleaf, ent->regs)) {
+                ginfo->cpuid_count--;
+                break;
+            }
+        }
+    }
+}
+
+static struct vmx_cpuid_entry *
+cpuid_find(struct VmxGuestInfo *ginfo, uint32_t leaf, uint32_t subleaf) {
+    struct vmx_cpuid_entry *ent;
+    int i;
+
+    for (i = 0; i < ginfo->cpuid_count; i++) {
+        ent = &ginfo->cpuid_table[i];
+        if (ent->leaf == leaf &&
+                (!(ent->flags & VMX_CPUID_SUBLEAF_INDEXED) || ent->subleaf == subleaf))
+            return ent;
+    }
+    return NULL;
+}
+
+/*
+ * Builds the CPUID table of a guest in the page at ginfo->cpuid_table.
+ */
+void
+vmx_cpuid_init(struct VmxGuestInfo *ginfo) {
+    const struct vmx_cpuid_policy *pol;
+    struct vmx_cpuid_entry *ent;
+    int i;
+
+    ginfo->cpuid_count = 0;
+    cpuid_add_range(ginfo, 0x0);
+    cpuid_add_range(ginfo, 0x80000000);
+
+    // Hypervisor leaf.
+    if ((ent = cpuid_add(ginfo, VMX_CPUID_HV_LEAF, 0))) {
+        ent->regs[VMX_CPUID_EAX] = VMX_CPUID_HV_LEAF;
+        memcpy(&ent->regs[VMX_CPUID_EBX], &vmx_cpuid_signature[0], 4);
+        memcpy(&ent->regs[VMX_CPUID_ECX], &vmx_cpuid_signature[4], 4);
+        memcpy(&ent->regs[VMX_CPUID_EDX], &vmx_cpuid_signature[8], 4);
+    }
+
+    for (i = 0; i < sizeof(vmx_cpuid_policy) / sizeof(vmx_cpuid_policy[0]); i++) {
+        pol = &vmx_cpuid_policy[i];
+        if (!(ent = cpuid_find(ginfo, pol->leaf, pol->subleaf)))
+            continue;
+        ent->regs[pol->reg] &= ~pol->clear;
+        ent->regs[pol->reg] |= pol->set;
+    }
+
+    // Report the vCPU's virtual APIC ID rather than the host CPU's.
+    if ((ent = cpuid_find(ginfo, 0x1, 0))) {
+        ent->regs[VMX_CPUID_EBX] &= 0x00FFFFFF;
+        ent->regs[VMX_CPUID_EBX] |= (uint32_t)ginfo->vcpu_id << 24;
+    }
+    for (i = 0; i < ginfo->cpuid_count; i++) {
+        ent = &ginfo->cpuid_table[i];
+        if (ent->leaf == 0xB)
+            ent->regs[VMX_CPUID_EDX] = ginfo->vcpu_id;
+    }
+}
+
+/*
+ * Looks up the values the guest sees for CPUID(leaf, subleaf).
+ * Like hardware, unknown basic/extended leaves return the highest basic
+ * leaf; unknown hypervisor leaves and subleaves return zeros.
+ */
+void
+vmx_cpuid_lookup(struct VmxGuestInfo *ginfo, uint32_t leaf, uint32_t subleaf,
+        uint32_t regs[4]) {
+    struct vmx_cpuid_entry *ent = cpuid_find(ginfo, leaf, subleaf);
+
+    // A known leaf with an out of range subleaf reads as zeros.
+    if (!ent && !cpuid_find(ginfo, leaf, 0) &&
+            (leaf & 0xF0000000) != VMX_CPUID_HV_LEAF) {
+        struct vmx_cpuid_entry *max = cpuid_find(ginfo, 0x0, 0);
+        if (max)
+            ent = cpuid_find(ginfo, max->regs[VMX_CPUID_EAX], 0);
+    }
+    if (!ent) {
+        memset(regs, 0, 4 * sizeof(uint32_t));
+        return;
+    }
+    memcpy(regs, ent->regs, 4 * sizeof(uint32_t));
+}
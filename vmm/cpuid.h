@@ -0,0 +1,44 @@
+#ifndef JOS_VMM_CPUID_H
+#define JOS_VMM_CPUID_H
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+#include <inc/vmx.h>
+
+// Register indices in vmx_cpuid_entry.regs.
+enum {
+    VMX_CPUID_EAX = 0,
+    VMX_CPUID_EBX,
+    VMX_CPUID_ECX,
+    VMX_CPUID_EDX,
+};
+
+// vmx_cpuid_entry.flags
+#define VMX_CPUID_SUBLEAF_INDEXED 0x1
+
+struct vmx_cpuid_entry {
+    uint32_t leaf;
+    uint32_t subleaf;
+    uint32_t flags;
+    uint32_t regs[4];
+};
+
+// A bit edit applied to the host's CPUID values for every guest.
+struct vmx_cpuid_policy {
+    uint32_t leaf;
+    uint32_t subleaf;
+    int reg;
+    uint32_t clear;
+    uint32_t set;
+};
+
+#define VMX_CPUID_HV_LEAF 0x40000000
+// Subleaves looked at per leaf; XSAVE (0xD) has one per state component.
+#define VMX_CPUID_MAX_SUBLEAF 64
+#define VMX_CPUID_MAX_ENTRIES (PGSIZE / sizeof(struct vmx_cpuid_entry))
+
+void vmx_cpuid_init(struct VmxGuestInfo *ginfo);
+void vmx_cpuid_lookup(struct VmxGuestInfo *ginfo, uint32_t leaf, uint32_t subleaf,
+        uint32_t regs[4]);
+
+#endif
@@ -1,11 +1,13 @@
 
 #include <vmm/ept.h>
+#include <vmm/balloon.h>
 
 #include <inc/error.h>
 #include <inc/memlayout.h>
 #include <kern/pmap.h>
 #include <inc/string.h>
 #include <kern/env.h>
+#include <inc/x86.h>
 
 // Return the physical address of an ept entry
 static inline uintptr_t epte_addr(epte_t epte)
@@ -31,6 +33,53 @@ static inline int epte_present(epte_t epte)
 	return (epte & __EPTE_FULL) > 0;
 }
 
+// Return true if an ept entry maps a 2MB/1GB page rather than a table
+static inline int epte_large(epte_t epte)
+{
+	return (epte & __EPTE_SZ) != 0;
+}
+
+// Can the CPU map large pages at EPT level 'level' (1 = 2MB, 2 = 1GB)?
+// See Appendix A.10 of the Intel manual.
+static bool ept_large_supported(int level)
+{
+	uint64_t cap = read_msr(IA32_VMX_EPT_VPID_CAP);
+
+	if (level == 1)
+	    return BIT(cap, 16);
+	if (level == 2)
+	    return BIT(cap, 17);
+	return false;
+}
+
+// Replace the large leaf *epte at EPT level 'level' by a table of 512
+// entries one level down that map the same host pages with the same
+// permissions.  The guest pages keep their references.
+//
+// Return 0 on success, -E_NO_MEM if the table cannot be allocated.
+static int ept_split_large(epte_t *epte, int level)
+{
+	struct Page *pt = page_alloc(0);
+	epte_t *dir, flags;
+	physaddr_t pa;
+	int i;
+
+	if (!pt)
+	    return -E_NO_MEM;
+	pt->pp_ref++;
+
+	dir = page2kva(pt);
+	pa = epte_addr(*epte) & ~(EPT_LEVEL_SIZE(level) - 1);
+	flags = epte_flags(*epte);
+	if (level - 1 == 0)
+	    flags &= ~__EPTE_SZ;
+	for (i = 0; i < NPTENTRIES; i++)
+	    dir[i] = (pa + i * EPT_LEVEL_SIZE(level - 1)) | flags;
+
+	*epte = page2pa(pt) | __EPTE_FULL;
+	return 0;
+}
+
 // Find the final ept entry for a given guest physical address,
 // creating any missing intermediate extended page tables if create is non-zero.
 //
@@ -132,6 +181,15 @@ uint64_t e_pdpe_walk(pdpe_t *pdpe, void *gpa, int create)
 {
     uintptr_t index_in_epdp = PDPE(gpa);
     pdpe_t *offset_ptr_in_epdpe = pdpe + index_in_epdp;
+
+    // A 1GB leaf is the final entry unless a 4K entry must be created.
+    if (epte_large(*offset_ptr_in_epdpe))
+    {
+	if (!create)
+	    return (uint64_t) offset_ptr_in_epdpe;
+	if (ept_split_large(offset_ptr_in_epdpe, 2) < 0)
+	    return E_NO_MEM;
+    }
     pde_t *epgdir_base = (pde_t *) PTE_ADDR(*offset_ptr_in_epdpe);
 
     if ( NULL == epgdir_base )
@@ -181,6 +239,15 @@ uint64_t e_pgdir_walk(pde_t *pgdir, void *gpa, int create)
 {
     uintptr_t index_in_epgdir = PDX(gpa);
     pde_t *offset_ptr_in_epgdir = pgdir + index_in_epgdir;
+
+    // A 2MB leaf is the final entry unless a 4K entry must be created.
+    if (epte_large(*offset_ptr_in_epgdir))
+    {
+	if (!create)
+	    return (uint64_t) offset_ptr_in_epgdir;
+	if (ept_split_large(offset_ptr_in_epgdir, 1) < 0)
+	    return E_NO_MEM;
+    }
     pte_t *epage_table_base = (pte_t *)(PTE_ADDR(*offset_ptr_in_epgdir));
 
     if (NULL == epage_table_base)
@@ -219,27 +286,166 @@ uint64_t e_pgdir_walk(pde_t *pgdir, void *gpa, int create)
 }
 		
 
+// Find the leaf ept entry that maps guest physical address gpa, without
+// creating or splitting anything.  The leaf may map 4KB, 2MB or 1GB.
+//
+// Stores the entry in *epte_out and the host physical address backing gpa,
+// including the offset into the page, in *pa_out (either may be NULL).
+//
+// Return 0 on success, -E_NO_ENT if gpa is not mapped.
+int ept_lookup_leaf(epte_t *eptrt, void *gpa, epte_t **epte_out, physaddr_t *pa_out)
+{
+    epte_t *dir = eptrt, *epte;
+    uint64_t mask;
+    int level;
+
+    for (level = EPT_LEVELS - 1; level >= 0; level--) {
+        epte = &dir[ADDR_TO_IDX(gpa, level)];
+        if (!epte_present(*epte))
+            return -E_NO_ENT;
+        if (level == 0 || epte_large(*epte)) {
+            mask = EPT_LEVEL_SIZE(level) - 1;
+            if (epte_out)
+                *epte_out = epte;
+            if (pa_out)
+                *pa_out = (epte_addr(*epte) & ~mask) | ((uint64_t) gpa & mask);
+            return 0;
+        }
+        dir = (epte_t *) epte_page_vaddr(*epte);
+    }
+    return -E_NO_ENT;
+}
+
 void ept_gpa2hva(epte_t* eptrt, void *gpa, void **hva) {
-    epte_t* pte;
-    int ret = ept_lookup_gpa(eptrt, gpa, 0, &pte);
-    if(ret < 0) {
+    physaddr_t pa;
+
+    if(ept_lookup_leaf(eptrt, gpa, NULL, &pa) < 0) {
         *hva = NULL;
     } else {
-        if(!epte_present(*pte)) {
-           *hva = NULL;
-        } else {
-           *hva = KADDR(epte_addr(*pte));
+        *hva = KADDR(pa);
+    }
+}
+
+// Map a whole 1GB or 2MB guest physical region around gpa with a single
+// large ept entry backed by contiguous host pages.  Only regions lying
+// entirely inside guest RAM above EXTPHYSMEM, whose slot is still empty,
+// are mapped this way; everything else (the low 1MB with its holes, partly
+// populated regions) is left to 4KB mappings.
+//
+// Return the number of 4KB pages mapped if a large mapping was created,
+// < 0 if the caller should fall back to 4KB pages.
+int ept_alloc_large(epte_t *eptrt, void *gpa, struct VmxGuestInfo *ginfo)
+{
+    uint64_t size, base;
+    epte_t *dir, *epte;
+    struct Page *pp;
+    int level, l;
+    size_t i;
+
+    for (level = 2; level >= 1; level--) {
+        size = EPT_LEVEL_SIZE(level);
+        base = ROUNDDOWN((uint64_t) gpa, size);
+        if (!ept_large_supported(level) || base < EXTPHYSMEM ||
+                base + size > ginfo->phys_sz)
+            continue;
+
+        // Walk (creating tables) down to the entry at this level.
+        dir = eptrt;
+        for (l = EPT_LEVELS - 1; l > level; l--) {
+            epte = &dir[ADDR_TO_IDX(base, l)];
+            if (!epte_present(*epte)) {
+                struct Page *table = page_alloc(ALLOC_ZERO);
+                if (!table)
+                    return -E_NO_MEM;
+                table->pp_ref++;
+                *epte = page2pa(table) | __EPTE_FULL;
+            } else if (epte_large(*epte)) {
+                return -E_INVAL;
+            }
+            dir = (epte_t *) epte_page_vaddr(*epte);
         }
+        epte = &dir[ADDR_TO_IDX(base, level)];
+        if (*epte)
+            continue;
+
+        pp = page_alloc_contig(size / PGSIZE, size / PGSIZE, ALLOC_ZERO);
+        if (!pp)
+            continue;
+        for (i = 0; i < size / PGSIZE; i++)
+            pp[i].pp_ref = 1;
+        *epte = page2pa(pp) | __EPTE_FULL | __EPTE_IPAT | __EPTE_SZ;
+        return size / PGSIZE;
     }
+    return -E_NO_ENT;
+}
+
+// Is gpa ordinary guest RAM, i.e. backed by pages we allocate on demand?
+static inline bool ept_gpa_is_ram(uint64_t gpa, struct VmxGuestInfo *ginfo)
+{
+    return gpa < 0xA0000 || (gpa >= EXTPHYSMEM && gpa < ginfo->phys_sz);
+}
+
+// Map a fresh host page at the faulting guest RAM address gpa, and at the
+// unmapped RAM pages around it that are not in the balloon: the
+// ginfo->fault_around pages aligned window containing gpa, clipped to the
+// leaf table that maps gpa.  The leaf table is walked once and filled
+// directly.  If gpa itself was in the balloon, the guest took it back.
+//
+// Return the number of pages mapped, 0 if another vCPU already mapped gpa,
+// or -E_NO_MEM if the page at gpa could not be mapped.
+int ept_fault_around(epte_t *eptrt, uint64_t gpa, struct VmxGuestInfo *ginfo)
+{
+    uint64_t pt_base = ROUNDDOWN(gpa, EPT_LEVEL_SIZE(1));
+    int window = MIN(MAX(ginfo->fault_around, 1), NPTENTRIES);
+    int first, last, i, mapped = 0;
+    struct Page *p;
+    epte_t *pt;
+    uint64_t ret;
+
+    ret = e_pml4e_walk(eptrt, (void *) gpa, 1);
+    if (ret == E_NO_ENT || ret == E_NO_MEM)
+        return -E_NO_MEM;
+    pt = (epte_t *) ROUNDDOWN(ret, PGSIZE);
+
+    // The faulting page first, so neighbours never starve it.
+    i = PTX(gpa);
+    if (!epte_present(pt[i])) {
+        if (!(p = page_alloc(ALLOC_ZERO)))
+            return -E_NO_MEM;
+        p->pp_ref++;
+        if (pt[i] == EPTE_BALLOON)
+            vmx_balloon_reclaimed(ginfo);
+        pt[i] = page2pa(p) | __EPTE_FULL | __EPTE_IPAT;
+        mapped++;
+    }
+
+    first = ROUNDDOWN(PTX(gpa), window);
+    last = MIN(first + window, NPTENTRIES);
+    for (i = first; i < last; i++) {
+        if (pt[i] || !ept_gpa_is_ram(pt_base + i * PGSIZE, ginfo))
+            continue;
+        if (!(p = page_alloc(ALLOC_ZERO)))
+            break;
+        p->pp_ref++;
+        pt[i] = page2pa(p) | __EPTE_FULL | __EPTE_IPAT;
+        mapped++;
+    }
+    return mapped;
 }
 
 static void free_ept_level(epte_t* eptrt, int level) {
     epte_t* dir = eptrt;
     int i;
+    size_t j;
 
     for(i=0; i<NPTENTRIES; ++i) {
         if(level != 0) {
-            if(epte_present(dir[i])) {
+            if(epte_present(dir[i]) && epte_large(dir[i])) {
+                // Large leaf, free every guest page it covers.
+                struct Page *pp = pa2page(epte_addr(dir[i]));
+                for(j=0; j < EPT_LEVEL_SIZE(level) / PGSIZE; ++j)
+                    page_decref(pp + j);
+            } else if(epte_present(dir[i])) {
                 physaddr_t pa = epte_addr(dir[i]);
                 free_ept_level((epte_t*) KADDR(pa), level-1);
                 // free the table.
@@ -256,6 +462,48 @@ static void free_ept_level(epte_t* eptrt, int level) {
     return;
 }
 
+// Take the guest RAM page at gpa out of the EPT for the balloon: split a
+// large leaf around it if need be and leave an EPTE_BALLOON entry.  The
+// caller must flush the EPT translations of every CPU before reusing the
+// page.
+//
+// Stores the host page that backed gpa, still holding the guest's
+// reference, in *pp_store, or NULL if gpa was not mapped.
+//
+// Return 0 on success, -E_NO_MEM if a table cannot be allocated, -E_INVAL
+// if gpa already is in the balloon.
+int ept_balloon_page(epte_t *eptrt, void *gpa, struct Page **pp_store)
+{
+    epte_t *epte;
+    uint64_t ret;
+
+    *pp_store = NULL;
+    ret = e_pml4e_walk(eptrt, gpa, 1);
+    if (ret == E_NO_ENT || ret == E_NO_MEM)
+        return -E_NO_MEM;
+    epte = (epte_t *) ret;
+    if (*epte == EPTE_BALLOON)
+        return -E_INVAL;
+    if (epte_present(*epte))
+        *pp_store = pa2page(epte_addr(*epte));
+    *epte = EPTE_BALLOON;
+    return 0;
+}
+
+// Give the ballooned guest page at gpa back to the guest: clear its
+// EPTE_BALLOON entry so that the next access maps a fresh page.
+//
+// Return 0 on success, -E_NO_ENT if gpa is not in the balloon.
+int ept_unballoon_page(epte_t *eptrt, void *gpa)
+{
+    uint64_t ret = e_pml4e_walk(eptrt, gpa, 0);
+
+    if (ret == E_NO_ENT || ret == E_NO_MEM || *(epte_t *) ret != EPTE_BALLOON)
+        return -E_NO_ENT;
+    *(epte_t *) ret = 0;
+    return 0;
+}
+
 // Free the EPT table entries and the EPT tables.
 // NOTE: Does not deallocate EPT PML4 page.
 void free_guest_mem(epte_t* eptrt) {
@@ -272,17 +520,25 @@ int ept_page_insert(epte_t* eptrt, struct Page* pp, void* gpa, int perm) {
     /* Your code here */
     int val = 0;
     pte_t *pte = NULL;
+    uint64_t ret;
+    bool flush;
 
+    // Only a present entry, 4K or a large one the walk below splits, can
+    // have been cached by the guest; a fresh mapping needs no flush.
+    ret = e_pml4e_walk(eptrt, gpa, 0);
+    flush = ret != E_NO_ENT && ret != E_NO_MEM && epte_present(*(epte_t *) ret);
     val = ept_lookup_gpa(eptrt, (void*) gpa, 1, &pte);
 
     if (pte == NULL )
 	return -E_NO_MEM;
     if (val < 0)
 	return val;
-    pp->pp_ref++;
+    __sync_fetch_and_add(&pp->pp_ref, 1);
     if(*pte & PTE_P)
           page_remove(eptrt, gpa);
     *pte = ((uint64_t)page2pa(pp)) | perm | __EPTE_IPAT;
+    if (flush)
+        vmx_invept(eptrt);
     return 0;
 
 }
@@ -327,17 +583,19 @@ int ept_map_hva2gpa(epte_t* eptrt, void* hva, void* gpa, int perm,
     else if (0 == val) 
     {
 //	cprintf("LINE %d\n", __LINE__);
-	if ((*pte_guest) && overwrite == 0 )
+	if (epte_present(*pte_guest) && overwrite == 0 )
 	{
 //	    cprintf("LINE %d\n", __LINE__);
 	    return -E_INVAL;
 	}
-	else if (*pte_guest && overwrite == 1 )
+	else if (epte_present(*pte_guest) && overwrite == 1 )
 	{
 	    *pte_guest = (uint64_t )host_ad | perm | __EPTE_IPAT;// | __EPTE_TYPE(EPTE_TYPE_WB);
+	    // Drop translations cached from the old mapping.
+	    vmx_invept(eptrt);
 	    return 0;
 	}
-	if (!(*pte_guest))
+	if (!epte_present(*pte_guest))
 	{
 	    *pte_guest = (uint64_t )host_ad | perm | __EPTE_IPAT;// | __EPTE_TYPE(EPTE_TYPE_WB);
 //	    *pte_guest = (uint64_t)host_ad | perm;
@@ -16,11 +16,18 @@ int ept_page_insert(epte_t* eptrt, struct Page* pp, void* gpa, int perm);
 uint64_t e_pml4e_walk(epte_t *eptrt, void *gpa, int create);
 uint64_t e_pdpe_walk(pdpe_t *pdpe, void *gpa, int create);
 uint64_t e_pgdir_walk(pde_t *pgdir, void *gpa, int create);
-uint64_t e_pml4e_walk(epte_t *eptrt, void *gpa, int create);
+int ept_lookup_leaf(epte_t *eptrt, void *gpa, epte_t **epte_out, physaddr_t *pa_out);
+int ept_alloc_large(epte_t *eptrt, void *gpa, struct VmxGuestInfo *ginfo);
+int ept_fault_around(epte_t *eptrt, uint64_t gpa, struct VmxGuestInfo *ginfo);
+int ept_balloon_page(epte_t *eptrt, void *gpa, struct Page **pp_store);
+int ept_unballoon_page(epte_t *eptrt, void *gpa);
 //int _export_sys_ept_map(envid_t srcenvid, void *srcva,envid_t guest, void* guest_pa, int perm);
 //int test_ept_map(void);	//test eptfunction
 #define EPT_LEVELS 4
 
+// Default number of guest pages populated per EPT violation.
+#define EPT_FAULT_AROUND_DEFAULT 16
+
 #define VMX_EPT_FAULT_READ	0x01
 #define VMX_EPT_FAULT_WRITE	0x02
 #define VMX_EPT_FAULT_INS	0x04
@@ -29,7 +36,14 @@ uint64_t e_pml4e_walk(epte_t *eptrt, void *gpa, int create);
 #define EPTE_ADDR	(~(PGSIZE - 1))
 #define EPTE_FLAGS	(PGSIZE - 1)
 
+// Software bit (ignored by the CPU) in a not-present leaf: the guest gave
+// the page to the balloon, so fault-around must not map it again.
+#define EPTE_BALLOON	(1ULL << 52)
+
 #define ADDR_TO_IDX(pa, n) \
     ((((uint64_t) (pa)) >> (12 + 9 * (n))) & ((1 << 9) - 1))
 
+// Bytes mapped by one entry at EPT level n (0 = PT, 1 = PD, 2 = PDPT).
+#define EPT_LEVEL_SIZE(n)	(((uint64_t) PGSIZE) << (9 * (n)))
+
 #endif
@@ -120,7 +120,7 @@ fs_init(void)
     else
         ide_set_disk(0);
 #else
-    host_ipc_init();
+    host_disk_init();
 #endif
     bc_init();
 
@@ -50,6 +50,6 @@ void fs_test(void);
 /* vmx_host.c */
 int host_read(uint32_t secno, void *dst, size_t nsecs);
 int host_write(uint32_t secno, const void *src, size_t nsecs);
-void host_ipc_init();
+void host_disk_init();
 #endif
 
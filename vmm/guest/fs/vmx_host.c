@@ -1,87 +1,110 @@
 #ifdef VMM_GUEST
-// Forward FS read/writes to the host instead of the IDE disk.
+// Read and write the disk through the host's paravirtual disk instead of
+// the IDE disk: the guest side of VMX_VMCALL_BLK_SETUP/BLK_NOTIFY, see
+// struct vmx_pvblk_ring in inc/vmx.h.  The host env that launched us
+// serves the requests from its image of our disk, a whole block (or more)
+// per request rather than 1KB per file server round trip.
 
 #include "fs.h"
 
-#include  <inc/vmx.h>
-#include <inc/fs.h>
+#include <inc/vmx.h>
 #include <inc/lib.h>
 
-#define HOST_FS_FILE "/vmm/fs.img"
+static struct vmx_pvblk_ring blk_ring __attribute__((aligned(PGSIZE)));
+static bool blk_ready;
 
-static struct Fd *host_fd;
-static union Fsipc host_fsipcbuf __attribute__((aligned(PGSIZE)));
-
-static int
-host_fsipc(unsigned type, void *dstva)
+static int64_t
+blk_vmcall(int num, uint64_t a1)
 {
-    ipc_host_send(VMX_HOST_FS_ENV, type, &host_fsipcbuf, PTE_P | PTE_W | PTE_U);
-    return ipc_host_recv(dstva);
+    int64_t ret;
+
+    asm volatile("vmcall\n"
+	    : "=a" (ret)
+	    : "a" (num),
+	      "d" (a1)
+	    : "cc", "memory");
+    return ret;
 }
 
-    int
-host_read(uint32_t secno, void *dst, size_t nsecs)
+// Post one request for nsecs (at most VMX_PVBLK_MAXSECTS) sectors at secno
+// and sleep until the host completes it.  buf must be page-aligned and
+// its pages mapped and our own, which the block cache guarantees.
+static int
+host_request(int op, uint32_t secno, void *buf, size_t nsecs)
 {
-    int r, read = 0;
-
-    if(host_fd->fd_file.id == 0) {
-        host_ipc_init();
+    struct vmx_pvblk_req *req;
+    uint32_t slot;
+    int i;
+
+    // We wait for every request, so the ring is always empty here.
+    slot = blk_ring.prod;
+    req = &blk_ring.req[slot % VMX_PVBLK_RING];
+    req->op = op;
+    req->nsecs = nsecs;
+    req->sector = secno;
+    for (i = 0; i * PGSIZE < nsecs * SECTSIZE; i++)
+	req->gpa[i] = PTE_ADDR(vpt[VPN(buf + i * PGSIZE)]);
+    req->status = -E_INVAL;
+    // The host may look at the ring as soon as prod moves.
+    __sync_synchronize();
+    blk_ring.prod++;
+    __sync_synchronize();
+    if (blk_ring.host_idle)
+	blk_vmcall(VMX_VMCALL_BLK_NOTIFY, 0);
+
+    while (blk_ring.cons == slot) {
+	// Ask for an interrupt, then look again in case the request
+	// completed before the host saw it.
+	blk_ring.irq = 1;
+	__sync_synchronize();
+	if (blk_ring.cons == slot)
+	    sys_irq_wait(VMX_PVBLK_IRQ);
     }
+    return req->status;
+}
 
-    host_fd->fd_offset = secno * SECTSIZE;
-    // read from the host, 2 sectors at a time.
-    for(; nsecs > 0; nsecs-=2) {
+static int
+host_rw(int op, uint32_t secno, void *buf, size_t nsecs)
+{
+    size_t n;
+    int r;
 
-        host_fsipcbuf.read.req_fileid = host_fd->fd_file.id;
-        host_fsipcbuf.read.req_n = SECTSIZE * 2;
-        if ((r = host_fsipc(FSREQ_READ, NULL)) < 0)
-            return r;
-        // FIXME: Handle case where r < SECTSIZE * 2;
-        memmove(dst+read, &host_fsipcbuf, SECTSIZE * 2);
-        read += SECTSIZE * 2;
+    if (!blk_ready)
+	host_disk_init();
+    if (PGOFF(buf))
+	return -E_INVAL;
+    for (; nsecs > 0; nsecs -= n, secno += n, buf += n * SECTSIZE) {
+	n = MIN(nsecs, VMX_PVBLK_MAXSECTS);
+	if ((r = host_request(op, secno, buf, n)) < 0)
+	    return r;
     }
-
     return 0;
 }
 
     int
-host_write(uint32_t secno, const void *src, size_t nsecs)
+host_read(uint32_t secno, void *dst, size_t nsecs)
 {
-    int r, written = 0;
-    
-    if(host_fd->fd_file.id == 0) {
-        host_ipc_init();
-    }
+    return host_rw(VMX_PVBLK_READ, secno, dst, nsecs);
+}
 
-    host_fd->fd_offset = secno * SECTSIZE;
-    for(; nsecs > 0; nsecs-=2) {
-        host_fsipcbuf.write.req_fileid = host_fd->fd_file.id;
-        host_fsipcbuf.write.req_n = SECTSIZE * 2;
-        memmove(host_fsipcbuf.write.req_buf, src+written, SECTSIZE * 2);
-        if ((r = host_fsipc(FSREQ_WRITE, NULL)) < 0)
-            return r;
-        written += SECTSIZE * 2;
-    }
-    return 0;
+    int
+host_write(uint32_t secno, const void *src, size_t nsecs)
+{
+    return host_rw(VMX_PVBLK_WRITE, secno, (void *) src, nsecs);
 }
 
     void
-host_ipc_init()
+host_disk_init()
 {
-    int r;
-    if ((r = fd_alloc(&host_fd)) < 0)
-    //if(( host_fd = (struct Fd*)malloc(sizeof(host_fd)))< 0)
-     if((r = sys_page_alloc(0, (void*)host_fd, PTE_P|PTE_W|PTE_U)) < 0)
-		panic("Couldn't allocate an fd!");
-
-    strcpy(host_fsipcbuf.open.req_path, HOST_FS_FILE);
-    host_fsipcbuf.open.req_omode = O_RDWR;
-
-    if ((r = host_fsipc(FSREQ_OPEN, host_fd)) < 0) {
-        fd_close(host_fd, 0);
-        panic("Couldn't open host file!");
-    }
-
+    uintptr_t va = (uintptr_t) &blk_ring;
+    int64_t r;
+
+    // Writing the ring makes its page present and ours before the host
+    // maps it.
+    memset(&blk_ring, 0, sizeof(blk_ring));
+    if ((r = blk_vmcall(VMX_VMCALL_BLK_SETUP, PTE_ADDR(vpt[VPN(va)]))) < 0)
+	panic("Couldn't set up the host disk: %e", (int) r);
+    blk_ready = true;
 }
 
 #endif
@@ -63,6 +63,8 @@ unsigned int sys_time_msec(void);
 
 int sys_net_try_send(char *data, int len);
 int sys_net_try_receive(char *data, int *len);
+int sys_vmx_bench(int op, uint64_t *samples, int n);
+int sys_irq_wait(int irq);
 
 
 // This must be inlined.  Exercise for reader: why?
@@ -86,6 +88,24 @@ envid_t	ipc_find_env(enum EnvType type);
 #ifdef VMM_GUEST
 void	ipc_host_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_host_recv(void *pg);
+
+// multicall.c
+void	multicall_begin(void);
+bool	multicall_active(void);
+int	multicall_queue(uint64_t nr, uint64_t a1, uint64_t a2, uint64_t a3,
+			uint64_t a4, uint64_t a5);
+int	multicall_flush(int flags);
+int64_t	multicall_result(int i);
+
+// ring.c
+int	ring_setup(void);
+bool	ring_active(void);
+void	ring_kick(void);
+int	ring_reserve(void);
+uint32_t ring_submit(uint64_t nr, uint64_t a1, uint64_t a2, uint64_t a3,
+		    uint64_t a4, uint64_t a5);
+int64_t	ring_result(uint32_t seq);
+uint64_t ring_kick_count(void);
 #endif
 
 // fork.c
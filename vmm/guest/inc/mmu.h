@@ -115,6 +115,7 @@
 //x86_64 related changes
 #define CR4_PAE     0x00000020
 #define EFER_MSR    0xC0000080
+#define STAR_MSR    0xC0000081
 #define EFER_LME    8
 
 // Eflags register
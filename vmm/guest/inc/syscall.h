@@ -20,6 +20,8 @@ enum {
 	SYS_time_msec,
 	SYS_net_try_send,
 	SYS_net_try_receive,
+	SYS_vmx_bench,
+	SYS_irq_wait,
 	NSYSCALLS
 };
 
@@ -33,9 +33,177 @@ struct VmxGuestInfo {
 // Network related VMCALLS
 #define VMX_VMCALL_NETSEND 0x4
 #define VMX_VMCALL_NETRECV 0x5
+// Does nothing; measures the bare cost of a vmcall round trip.
+#define VMX_VMCALL_NOP 0x6
+// Runs a batch of the vmcalls above in one exit; see struct vmx_multicall.
+#define VMX_VMCALL_MULTICALL 0x7
+// Registers the exit-less request ring at the guest physical address in
+// rdx, or unregisters it if rdx is 0; see struct vmx_ring.
+#define VMX_VMCALL_RING_REGISTER 0x8
+// Does nothing but exit, so the host drains the ring; see struct vmx_ring.
+#define VMX_VMCALL_RING_KICK 0x9
+// Paravirtual NIC: registers the ring page at the guest physical address
+// in rdx (0 to unregister) as the VMX_PVNET_TX or VMX_PVNET_RX ring (rcx),
+// and makes the host consume posted transmit descriptors now.
+#define VMX_VMCALL_NET_SETUP 0xA
+#define VMX_VMCALL_NET_NOTIFY 0xB
+// Paravirtual disk: register the struct vmx_pvblk_ring page at the guest
+// physical address in rdx (0 to unregister), and wake the host backend.
+#define VMX_VMCALL_BLK_SETUP 0xC
+#define VMX_VMCALL_BLK_NOTIFY 0xD
+// Returns the MAC address of the guest's port on the host's virtual
+// switch, byte i in bits [8i, 8i + 8), or < 0 if there is no free port.
+#define VMX_VMCALL_NET_MAC 0xE
+// Memory balloon, see VMX_BALLOON_* below.
+#define VMX_VMCALL_BALLOON 0xF
+
+#ifndef __ASSEMBLER__
+// One call of a VMX_VMCALL_MULTICALL batch.  'nr' and 'args' are what
+// would go in rax and rdx, rcx, rbx, rdi, rsi for the call on its own;
+// the host stores what it would have returned in rax in 'result'.
+// The batch is an array of these in guest memory, passed as its guest
+// physical address in rdx and its length in rcx; it may not cross a page.
+struct vmx_multicall {
+    uint64_t nr;
+    uint64_t args[5];
+    int64_t result;
+};
+#endif
+
+#define VMX_MULTICALL_MAX (PGSIZE / sizeof(struct vmx_multicall))
+// Flags, in rbx: stop at the first call that returns < 0.
+#define VMX_MULTICALL_STOP_ON_ERROR 0x1
+
+// Memory balloon.  VMX_VMCALL_BALLOON takes the operation in rbx and, for
+// INFLATE and DEFLATE, the guest physical address of a page holding rcx
+// page-aligned guest physical addresses in rdx.  INFLATE hands the listed
+// free guest pages to the host, which unmaps and reuses them; DEFLATE
+// takes them back, and each is mapped again on its first touch.  Both
+// return how many leading entries of the list were done, QUERY returns
+// the number of pages the host wants in the balloon; all return < 0 on
+// error.
+#define VMX_BALLOON_QUERY	0
+#define VMX_BALLOON_INFLATE	1
+#define VMX_BALLOON_DEFLATE	2
+#define VMX_BALLOON_MAX		(PGSIZE / sizeof(uint64_t))
+
+// Exit-less request ring, one guest page registered with
+// VMX_VMCALL_RING_REGISTER.  A single guest producer fills
+// req[prod % VMX_RING_SIZE] and then advances prod; whenever a vCPU of the
+// guest exits to the host, the host runs the queued requests like
+// multicall entries, stores each result and advances cons.  A request
+// that finds the receiver busy (-E_IPC_NOT_RECV, -E_TX_FULL) stays at the
+// head and is retried on a later exit.
+//
+// The host sets host_idle while the guest's vCPU is off the CPU (halted,
+// blocked in IPC receive or descheduled) and clears it when the vCPU is
+// dispatched again.  While it runs, the guest's own exits, the host timer's
+// included, drain the ring, so requests are run without a kick.  The guest
+// fences after advancing prod and kicks (VMX_VMCALL_RING_KICK) only if
+// host_idle is set, or when the ring is full; a producer that needs a
+// result sooner than the next exit may kick as well.
+#define VMX_RING_SIZE 32
+
+#ifndef __ASSEMBLER__
+struct vmx_ring {
+    volatile uint32_t prod;
+    volatile uint32_t cons;
+    volatile uint32_t host_idle;
+    uint32_t pad;
+    struct vmx_multicall req[VMX_RING_SIZE];
+};
+#endif
+
+// Paravirtual NIC descriptor rings, one guest page per direction,
+// registered with VMX_VMCALL_NET_SETUP.  The guest posts descriptors at
+// prod; the host completes them in order and advances cons.
+//
+// TX: a descriptor holds a frame to send.  The host sends posted frames on
+// every exit of the guest and on VMX_VMCALL_NET_NOTIFY, which the guest
+// only needs when it makes the ring non-empty while host_idle is set (the
+// host sets it once every posted frame is out) or when the ring is full.  The card reads the frames
+// straight out of guest memory, so a descriptor is completed, and its
+// buffer may be reused, only once the frame is out.
+//
+// RX: a descriptor holds an empty buffer.  The host copies each received
+// frame into the next one, sets its length, and raises guest IRQ
+// VMX_PVNET_IRQ if the guest has set 'irq', clearing it again.
+//
+// Every buffer must lie within one guest page.
+#define VMX_PVNET_TX 0
+#define VMX_PVNET_RX 1
+#define VMX_PVNET_RING 32
+#define VMX_PVNET_IRQ 11
+
+// Descriptor flags, set by the host on completion.
+#define VMX_PVNET_ERROR 0x1     // bad descriptor (TX) or frame too long (RX)
+
+#ifndef __ASSEMBLER__
+struct vmx_pvnet_desc {
+    uint64_t addr;              // guest physical address of the buffer
+    uint16_t len;               // frame length; RX: buffer size when posted
+    uint16_t flags;
+    uint32_t pad;
+};
+
+struct vmx_pvnet_ring {
+    volatile uint32_t prod;
+    volatile uint32_t cons;
+    volatile uint32_t host_idle;
+    volatile uint32_t irq;
+    struct vmx_pvnet_desc desc[VMX_PVNET_RING];
+};
+#endif
+
+// Paravirtual disk request ring, one guest page registered with
+// VMX_VMCALL_BLK_SETUP.  The guest fills req[prod % VMX_PVBLK_RING] and
+// advances prod; a backend env on the host (user/vmm.c) serves requests
+// in order against the guest's disk image, the host kernel copying the
+// data to or from the guest pages in gpa[], and then sets 'status' and
+// advances cons.  Each completion raises guest IRQ VMX_PVBLK_IRQ if the
+// guest has set 'irq', clearing it again.
+//
+// The host sets host_idle while the backend sleeps for want of requests;
+// the guest must then VMX_VMCALL_BLK_NOTIFY after advancing prod.
+//
+// A request moves 'nsecs' sectors starting at 'sector'; gpa[i] holds bytes
+// [i * PGSIZE, (i + 1) * PGSIZE) of the transfer and must not cross a page.
+#define VMX_PVBLK_RING 8
+#define VMX_PVBLK_IRQ 14        // the IDE line
+#define VMX_PVBLK_MAXPAGES 8
+#define VMX_PVBLK_SECTSIZE 512
+#define VMX_PVBLK_MAXSECTS (VMX_PVBLK_MAXPAGES * PGSIZE / VMX_PVBLK_SECTSIZE)
+
+#define VMX_PVBLK_READ 0
+#define VMX_PVBLK_WRITE 1
+
+#ifndef __ASSEMBLER__
+struct vmx_pvblk_req {
+    uint32_t op;                // VMX_PVBLK_READ or VMX_PVBLK_WRITE
+    uint32_t nsecs;
+    uint64_t sector;
+    uint64_t gpa[VMX_PVBLK_MAXPAGES];
+    int32_t status;             // set by the host: 0, or < 0 on error
+    uint32_t pad;
+};
+
+struct vmx_pvblk_ring {
+    volatile uint32_t prod;
+    volatile uint32_t cons;
+    volatile uint32_t host_idle;
+    volatile uint32_t irq;
+    struct vmx_pvblk_req req[VMX_PVBLK_RING];
+};
+#endif
 
 
 #define VMX_HOST_FS_ENV 0x1
 
+// Privileged exits timed in the kernel by sys_vmx_bench().
+#define VMX_BENCH_RDMSR 0x1
+#define VMX_BENCH_WRMSR 0x2
+#define VMX_BENCH_IO    0x3
+#define VMX_BENCH_EPT   0x4
+
 #endif
 #endif
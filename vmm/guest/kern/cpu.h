@@ -16,6 +16,7 @@
 enum {
 	CPU_UNUSED = 0,
 	CPU_STARTED,
+	CPU_HALTED,
 };
 
 // Per-CPU state
@@ -637,7 +637,7 @@ env_run(struct Env *e)
     curenv = e;
     curenv->env_status = ENV_RUNNING;
     curenv->env_runs++;
-//    unlock_kernel();
+    unlock_kernel();
 
     lcr3(curenv->env_cr3);
     env_pop_tf(&(curenv->env_tf));
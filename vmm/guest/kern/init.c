@@ -84,15 +84,17 @@ i386_init(void)
 	pci_init();
 
 
-#ifndef VMM_GUEST
+	// Acquire the big kernel lock before waking up APs
+	lock_kernel();
+
 	// Starting non-boot CPUs
 	boot_aps();
-#endif
 
 	// Should always have idle processes at first.
 	int i;
 
-     ENV_CREATE(user_idle, ENV_TYPE_IDLE);
+	for (i = 0; i < NCPU; i++)
+		ENV_CREATE(user_idle, ENV_TYPE_IDLE);
    
      ENV_CREATE(user_hello, ENV_TYPE_USER);
 
@@ -181,9 +183,8 @@ mp_main(void)
 	// only one CPU can enter the scheduler at a time!
 	//
 	// Your code here:
-
-	// Remove this after you finish Exercise 4
-	for (;;);
+	lock_kernel();
+	sched_yield();
 }
 
 /*
@@ -11,6 +11,8 @@
 #include <kern/multiboot.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/time.h>
+#include <inc/vmx.h>
 
 #define BOOT_PAGE_TABLE_START 0xf0008000
 #define BOOT_PAGE_TABLE_END   0xf000e000
@@ -24,6 +26,7 @@ pml4e_t *boot_pml4e;		// Kernel's initial page directory
 physaddr_t boot_cr3;		// Physical address of boot time page directory
 struct Page *pages;		// Physical page state array
 static struct Page *page_free_list;	// Free list of physical pages
+static size_t npages_free;		// Pages on page_free_list
 
 // --------------------------------------------------------------
 // Detect machine's physical memory setup.
@@ -378,7 +381,11 @@ mem_init_mp(void)
     //     Permissions: kernel RW, user NONE
     //
     // LAB 4: Your code here:
+    int i;
 
+    for (i = 0; i < NCPU; i++)
+        boot_map_segment(boot_pml4e, KSTACKTOP - i * (KSTKSIZE + KSTKGAP) - KSTKSIZE,
+                KSTKSIZE, PADDR(percpu_kstacks[i]), PTE_W | PTE_P);
 }
 
 // --------------------------------------------------------------
@@ -437,10 +444,127 @@ page_init(void)
 		    pages[i].pp_ref = 0;
 		    pages[i].pp_link = page_free_list;
 		    page_free_list = &pages[i];
+		    npages_free++;
 	    }
     }
 }
 
+//
+// Memory balloon, the guest side of VMX_VMCALL_BALLOON.  The host asks for
+// a number of pages; balloon_poll() takes that many off the free list and
+// hands them over.  Ballooned pages keep a reference so nothing frees
+// them, and are only touched again once the host has given them back.
+// BALLOON_RESERVE free pages are always kept for ourselves, and
+// page_alloc() takes pages back when the free list runs dry.
+//
+#define BALLOON_RESERVE	256
+#define BALLOON_BATCH	64
+#define BALLOON_POLL_MS	1000
+
+static struct Page *balloon_list;	// Pages given to the host
+static size_t balloon_npages;
+static uint64_t *balloon_gpas;		// GPA list passed to the host
+static unsigned int balloon_polled;
+
+static int64_t
+balloon_vmcall(int op, size_t count)
+{
+	int64_t ret;
+
+	asm volatile("vmcall\n"
+		: "=a" (ret)
+		: "a" ((uint64_t) VMX_VMCALL_BALLOON),
+		  "b" ((uint64_t) op),
+		  "d" ((uint64_t) PADDR(balloon_gpas)),
+		  "c" ((uint64_t) count)
+		: "cc", "memory");
+	return ret;
+}
+
+// Give up to n free pages to the host.
+static void
+balloon_inflate(size_t n)
+{
+	struct Page *pp;
+	int64_t done;
+	size_t i, j;
+
+	for (i = 0; i < n && npages_free > BALLOON_RESERVE; i++) {
+		pp = page_alloc(0);
+		pp->pp_ref = 1;
+		balloon_gpas[i] = page2pa(pp);
+	}
+	if (i == 0)
+		return;
+	done = balloon_vmcall(VMX_BALLOON_INFLATE, i);
+	for (j = 0; j < i; j++) {
+		pp = pa2page(balloon_gpas[j]);
+		if ((int64_t) j < done) {
+			pp->pp_link = balloon_list;
+			balloon_list = pp;
+			balloon_npages++;
+		} else {
+			// Refused by the host, still ours.
+			pp->pp_ref = 0;
+			page_free(pp);
+		}
+	}
+}
+
+// Take up to n pages back from the host.
+static void
+balloon_deflate(size_t n)
+{
+	struct Page *pp;
+	int64_t done;
+	size_t i, j;
+
+	for (i = 0; i < n && balloon_list; i++) {
+		pp = balloon_list;
+		balloon_list = pp->pp_link;
+		balloon_gpas[i] = page2pa(pp);
+	}
+	if (i == 0)
+		return;
+	done = balloon_vmcall(VMX_BALLOON_DEFLATE, i);
+	for (j = 0; j < i; j++) {
+		pp = pa2page(balloon_gpas[j]);
+		if ((int64_t) j < done) {
+			balloon_npages--;
+			pp->pp_ref = 0;
+			page_free(pp);
+		} else {
+			pp->pp_link = balloon_list;
+			balloon_list = pp;
+		}
+	}
+}
+
+// Called on every timer interrupt: about once a second, move the balloon
+// towards the size the host asks for.
+void
+balloon_poll(void)
+{
+	struct Page *pp;
+	int64_t target;
+
+	if (time_msec() - balloon_polled < BALLOON_POLL_MS)
+		return;
+	balloon_polled = time_msec();
+	if (!balloon_gpas) {
+		if (!(pp = page_alloc(0)))
+			return;
+		pp->pp_ref++;
+		balloon_gpas = page2kva(pp);
+	}
+	if ((target = balloon_vmcall(VMX_BALLOON_QUERY, 0)) < 0)
+		return;
+	if ((size_t) target > balloon_npages)
+		balloon_inflate(MIN((size_t) target - balloon_npages, VMX_BALLOON_MAX));
+	else if ((size_t) target < balloon_npages)
+		balloon_deflate(MIN(balloon_npages - (size_t) target, VMX_BALLOON_MAX));
+}
+
 //
 // Allocates a physical page.  If (alloc_flags & ALLOC_ZERO), fills the entire
 // returned physical page with '\0' bytes.  Does NOT increment the reference
@@ -456,6 +580,9 @@ page_init(void)
 page_alloc(int alloc_flags)
 {
 	struct Page *pp;
+	// Take pages back from the host's balloon before giving up.
+	if (page_free_list == NULL && balloon_npages)
+		balloon_deflate(BALLOON_BATCH);
 	pp = page_free_list;
 	if (pp == NULL)	return 0; // Out of memory
 	else {
@@ -464,6 +591,7 @@ page_alloc(int alloc_flags)
 		}
 		page_free_list = pp->pp_link;
 		pp->pp_link = NULL;
+		npages_free--;
 		return pp;
 	}
 }
@@ -489,6 +617,7 @@ page_free(struct Page *pp)
 	pp->pp_link = page_free_list;
 	page_free_list = pp;
 	pp->pp_ref = 0;
+	npages_free++;
 }
 
 //
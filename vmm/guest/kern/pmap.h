@@ -57,6 +57,7 @@ int	page_insert(pml4e_t *pml4e, struct Page *pp, void *va, int perm);
 void	page_remove(pml4e_t *pml4e, void *va);
 struct Page *page_lookup(pml4e_t *pml4e, void *va, pte_t **pte_store);
 void	page_decref(struct Page *pp);
+void	balloon_poll(void);
 
 void	tlb_invalidate(pml4e_t *pml4e, void *va);
 
@@ -1,7 +1,9 @@
 #include <inc/assert.h>
+#include <inc/x86.h>
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/spinlock.h>
 
 // Choose a user environment to run and run it.
     void
@@ -64,5 +66,24 @@ sched_yield(void)
     idle = &envs[cpunum()];
     if (!(idle->env_status == ENV_RUNNABLE || idle->env_status == ENV_RUNNING))
         panic("CPU %d: No idle environment!", cpunum());
-    env_run(idle);
+
+    // Nothing else is runnable: hlt so the host can block this vCPU
+    // instead of spinning in the idle env.  Don't sit on the kernel lock
+    // while halted; other vCPUs need it.  Interrupts are enabled across
+    // the hlt so the one the host injects to wake us is taken at once;
+    // trap() takes the lock back when it sees CPU_HALTED.  The interrupt
+    // never returns here, so start from the top of this CPU's stack.
+    xchg(&thiscpu->cpu_status, CPU_HALTED);
+    unlock_kernel();
+    asm volatile (
+        "movq $0, %%rbp\n"
+        "movq %0, %%rsp\n"
+        "pushq $0\n"
+        "pushq $0\n"
+        "sti\n"
+        "1:\n"
+        "hlt\n"
+        "jmp 1b\n"
+        : : "a" (thiscpu->cpu_ts.ts_esp0));
+    panic("sched_yield: woke from hlt");
 }
@@ -12,6 +12,7 @@
 #include <kern/console.h>
 #include <kern/sched.h>
 #include <kern/time.h>
+#include <kern/kclock.h>
 #include <inc/vmx.h>
 
 // Print a string to the system console.
@@ -457,6 +458,105 @@ sys_time_msec(void)
 //    cprintf("should return corretc tiem here\n");
     return time_msec(); 
 }
+// Per paravirtual device IRQ, the env blocked in sys_irq_wait() and
+// whether the interrupt came in while nobody was waiting.
+static envid_t irq_waiter[16];
+static bool irq_pending[16];
+
+// Block until the host raises IRQ 'irq' (VMX_PVNET_IRQ or VMX_PVBLK_IRQ),
+// or return at once if it has since the last call.  The caller asks for
+// the interrupt in its ring, and looks at the ring once more, before
+// calling this.
+    static int
+sys_irq_wait(int irq)
+{
+    if (irq != VMX_PVNET_IRQ && irq != VMX_PVBLK_IRQ)
+	return -E_INVAL;
+    if (irq_pending[irq]) {
+	irq_pending[irq] = false;
+	return 0;
+    }
+    irq_waiter[irq] = curenv->env_id;
+    curenv->env_status = ENV_NOT_RUNNABLE;
+    return 0;
+}
+
+// Called from trap_dispatch() when the host raises a paravirtual device
+// IRQ: it has completed descriptors on that device's ring.
+void
+irq_wakeup(int irq)
+{
+    struct Env *e;
+
+    if (irq_waiter[irq] && envid2env(irq_waiter[irq], &e, 0) == 0 &&
+	    e->env_status == ENV_NOT_RUNNABLE) {
+	e->env_status = ENV_RUNNABLE;
+	irq_waiter[irq] = 0;
+    } else
+	irq_pending[irq] = true;
+}
+
+// Time n round trips of the privileged exit 'op' (VMX_BENCH_*), which user
+// code cannot trigger itself, and store the TSC cycles of each in samples.
+// Returns the number of samples taken, or -E_INVAL for an unknown op.
+//
+// VMX_BENCH_RDMSR reads STAR, the one MSR whose reads the host intercepts
+// (EFER reads go straight through); VMX_BENCH_WRMSR writes EFER back.
+//
+// VMX_BENCH_EPT reads one free page per 2MB region, from the top of memory
+// down, since the host backs guest memory a large page at a time.  Regions
+// touched before (by this call or otherwise) are skipped only as far as
+// their first page is in use, so run it once, early, and expect fewer than
+// n samples on small guests.
+    static int
+sys_vmx_bench(int op, uint64_t *samples, int n)
+{
+    uint64_t t0, efer;
+    physaddr_t pa;
+    int i;
+
+    if (n < 0)
+	return -E_INVAL;
+    user_mem_assert(curenv, samples, n * sizeof(uint64_t), PTE_U | PTE_W | PTE_P);
+
+    switch (op) {
+	case VMX_BENCH_RDMSR:
+	    for (i = 0; i < n; i++) {
+		t0 = read_tsc();
+		(void) read_msr(STAR_MSR);
+		samples[i] = read_tsc() - t0;
+	    }
+	    return n;
+	case VMX_BENCH_WRMSR:
+	    efer = read_msr(EFER_MSR);
+	    for (i = 0; i < n; i++) {
+		t0 = read_tsc();
+		write_msr(EFER_MSR, efer);
+		samples[i] = read_tsc() - t0;
+	    }
+	    return n;
+	case VMX_BENCH_IO:
+	    for (i = 0; i < n; i++) {
+		t0 = read_tsc();
+		outb(IO_RTC, NVRAM_BASELO);
+		samples[i] = read_tsc() - t0;
+	    }
+	    return n;
+	case VMX_BENCH_EPT:
+	    i = 0;
+	    for (pa = ROUNDDOWN(npages * PGSIZE - 1, PTSIZE);
+		    i < n && pa >= PTSIZE; pa -= PTSIZE) {
+		if (pa2page(pa)->pp_ref)
+		    continue;
+		t0 = read_tsc();
+		(void) *(volatile char *) KADDR(pa);
+		samples[i++] = read_tsc() - t0;
+	    }
+	    return i;
+    }
+    return -E_INVAL;
+}
+
 /*
 // Network related VMCALLS
 int
@@ -547,6 +647,10 @@ syscall(uint64_t syscallno, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4,
 			return sys_ipc_try_send((envid_t) a1, (uint32_t) a2, (void *) a3, (unsigned) a4);
 		case SYS_time_msec:
 			return sys_time_msec();
+		case SYS_irq_wait:
+			return sys_irq_wait((int) a1);
+		case SYS_vmx_bench:
+			return sys_vmx_bench((int) a1, (uint64_t *) a2, (int) a3);
 
 		default:
 			return -E_INVAL;
@@ -15,6 +15,7 @@
 #include <kern/spinlock.h>
 #include <kern/time.h>
 #include <inc/string.h>
+#include <inc/vmx.h>
 
 extern uintptr_t gdtdesc_64;
 static struct Taskstate ts;
@@ -274,6 +275,7 @@ trap_dispatch(struct Trapframe *tf)
 		// triggered on every CPU. 								WHY HAS HE LEFT THIS CRYPTIC COMMENT? WHEN IT TRAPS WE ALREADY HAVE LOCK.
 		// LAB 6: Your code here.
 		time_tick();
+		balloon_poll();
 		
 		sched_yield();
 		return;
@@ -285,6 +287,15 @@ trap_dispatch(struct Trapframe *tf)
 	// LAB 6: Your code here.
 
 
+	// The paravirtual NIC has filled receive buffers, or the
+	// paravirtual disk has completed requests.
+	if (tf->tf_trapno == IRQ_OFFSET + VMX_PVNET_IRQ ||
+	    tf->tf_trapno == IRQ_OFFSET + VMX_PVBLK_IRQ) {
+		lapic_eoi();
+		irq_wakeup(tf->tf_trapno - IRQ_OFFSET);
+		return;
+	}
+
 	// Handle keyboard and serial interrupts.
 	// LAB 7: Your code here.
 	if (tf->tf_trapno == T_IRQ1) {
@@ -320,6 +331,11 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
+	// Re-acquire the big kernel lock if we were halted in
+	// sched_yield().
+	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
+		lock_kernel();
+
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
@@ -330,7 +346,7 @@ trap(struct Trapframe *tf)
 		// Acquire the big kernel lock before doing any
 		// serious kernel work.
 		// LAB 4: Your code here.
-		//lock_kernel();
+		lock_kernel();
 		assert(curenv);
 
 		// Garbage collect if current enviroment is a zombie
@@ -171,6 +171,9 @@ ipc_host_send(envid_t to_env, uint32_t val, void *pg, int perm)
     }
 
     a3 = (uint64_t) pg;
+
+    // Never batched, even inside a multicall: a receiver that is not
+    // ready yet makes us retry, which a queued call cannot do.
 //    cprintf("\n DABRAL -2 \n");
     while(1)
     {
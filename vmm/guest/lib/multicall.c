@@ -0,0 +1,98 @@
+// Batching of host vmcalls into a single VMX_VMCALL_MULTICALL exit.
+//
+// Between multicall_begin() and multicall_flush(), callers queue vmcalls
+// here with multicall_queue() instead of exiting to the host, and read
+// their results back with multicall_result().  Anything a queued call
+// points to (packet buffers, IPC pages) is read by the host only at flush
+// time, so it must be left alone until then.  Calls that may need to be
+// retried, like ipc_host_send()'s, are not batched.
+
+#include <inc/lib.h>
+#ifdef VMM_GUEST
+#include <inc/vmx.h>
+
+// One page, so the host can find it from a single guest physical address.
+static struct vmx_multicall mc_batch[VMX_MULTICALL_MAX]
+	__attribute__((aligned(PGSIZE)));
+static int mc_count;
+static int mc_done;
+static bool mc_active;
+
+// Start queueing vmcalls.
+void
+multicall_begin(void)
+{
+    mc_active = true;
+    mc_count = 0;
+    mc_done = 0;
+}
+
+// Returns true between multicall_begin() and multicall_flush().
+bool
+multicall_active(void)
+{
+    return mc_active;
+}
+
+// Append vmcall 'nr' with its arguments to the batch and return its index.
+// A full batch is flushed first and a new one started, so callers that
+// want every result must flush at least every VMX_MULTICALL_MAX calls.
+int
+multicall_queue(uint64_t nr, uint64_t a1, uint64_t a2, uint64_t a3,
+		uint64_t a4, uint64_t a5)
+{
+    struct vmx_multicall *mc;
+
+    if (mc_count >= VMX_MULTICALL_MAX) {
+	multicall_flush(0);
+	multicall_begin();
+    }
+    mc = &mc_batch[mc_count];
+    mc->nr = nr;
+    mc->args[0] = a1;
+    mc->args[1] = a2;
+    mc->args[2] = a3;
+    mc->args[3] = a4;
+    mc->args[4] = a5;
+    mc->result = -E_INVAL;
+    return mc_count++;
+}
+
+// Issue the queued calls in one exit and stop queueing.
+// 'flags' are VMX_MULTICALL_* flags.  Returns the number of calls the host
+// ran, whose results can then be read with multicall_result(), or < 0 if
+// the host rejected the batch.
+int
+multicall_flush(int flags)
+{
+    uintptr_t va = (uintptr_t) mc_batch;
+    int64_t ret;
+
+    mc_active = false;
+    if (mc_count == 0)
+	return mc_done = 0;
+
+    // Queueing wrote to the batch, so its page is present and not shared.
+    asm volatile("vmcall\n"
+	    : "=a" (ret)
+	    : "a" (VMX_VMCALL_MULTICALL),
+	      "d" (PTE_ADDR(vpt[VPN(va)]) | PGOFF(va)),
+	      "c" ((uint64_t) mc_count),
+	      "b" ((uint64_t) flags)
+	    : "cc", "memory");
+    mc_count = 0;
+    mc_done = ret < 0 ? 0 : ret;
+    return ret;
+}
+
+// Return what call 'i' of the last flushed batch returned, or -E_INVAL if
+// the host did not run it.
+int64_t
+multicall_result(int i)
+{
+    if (i < 0 || i >= mc_done)
+	return -E_INVAL;
+    return mc_batch[i].result;
+}
+
+#endif
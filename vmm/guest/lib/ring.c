@@ -0,0 +1,121 @@
+// Exit-less request ring to the host; see struct vmx_ring in inc/vmx.h.
+//
+// The host runs queued requests whenever the guest exits to it anyway, so
+// a steady stream of requests costs no exits of its own.  Only one env of
+// the guest can own the ring, as its single producer, and it must keep
+// the ring (and whatever queued requests point to) alive until the host
+// has consumed them.
+
+#include <inc/lib.h>
+#ifdef VMM_GUEST
+#include <inc/vmx.h>
+
+static struct vmx_ring ring __attribute__((aligned(PGSIZE)));
+static bool ring_ready;
+static uint64_t ring_kicks;
+
+static int64_t
+ring_vmcall(int num, uint64_t a1)
+{
+    int64_t ret;
+
+    asm volatile("vmcall\n"
+	    : "=a" (ret)
+	    : "a" (num),
+	      "d" (a1)
+	    : "cc", "memory");
+    return ret;
+}
+
+// Register this env's ring with the host.
+int
+ring_setup(void)
+{
+    uintptr_t va = (uintptr_t) &ring;
+    int64_t r;
+
+    // Writing the page makes it present and ours before the host maps it.
+    ring.prod = ring.cons = 0;
+    if ((r = ring_vmcall(VMX_VMCALL_RING_REGISTER, PTE_ADDR(vpt[VPN(va)]))) < 0)
+	return r;
+    ring_ready = true;
+    return 0;
+}
+
+// Returns true once ring_setup() has succeeded.
+bool
+ring_active(void)
+{
+    return ring_ready;
+}
+
+// Make the host drain the ring now.
+void
+ring_kick(void)
+{
+    ring_kicks++;
+    ring_vmcall(VMX_VMCALL_RING_KICK, 0);
+}
+
+// Return the slot the next ring_submit() will fill.  Whatever the previous
+// request in that slot pointed to is no longer used by the host.
+// Returns -E_NO_MEM if the ring is still full after a kick.
+int
+ring_reserve(void)
+{
+    if (!ring_ready)
+	return -E_INVAL;
+    if (ring.prod - ring.cons >= VMX_RING_SIZE) {
+	ring_kick();
+	if (ring.prod - ring.cons >= VMX_RING_SIZE)
+	    return -E_NO_MEM;
+    }
+    return ring.prod % VMX_RING_SIZE;
+}
+
+// Queue vmcall 'nr' in the slot returned by ring_reserve().  Returns the
+// request's sequence number, for ring_result().
+uint32_t
+ring_submit(uint64_t nr, uint64_t a1, uint64_t a2, uint64_t a3,
+	    uint64_t a4, uint64_t a5)
+{
+    struct vmx_multicall *mc = &ring.req[ring.prod % VMX_RING_SIZE];
+    uint32_t seq = ring.prod;
+
+    mc->nr = nr;
+    mc->args[0] = a1;
+    mc->args[1] = a2;
+    mc->args[2] = a3;
+    mc->args[3] = a4;
+    mc->args[4] = a5;
+    mc->result = -E_INVAL;
+    // The host may look at the ring as soon as prod moves.
+    __sync_synchronize();
+    ring.prod++;
+    // Pairs with the host's fence after setting host_idle, before the vCPU
+    // leaves the CPU: either a draining exit is still to come or we see it.
+    __sync_synchronize();
+    if (ring.host_idle)
+	ring_kick();
+    return seq;
+}
+
+// Return what request 'seq' returned, or -E_INVAL if the host has not
+// run it yet.  Valid until VMX_RING_SIZE more requests are submitted.
+int64_t
+ring_result(uint32_t seq)
+{
+    if ((int32_t) (ring.cons - seq) <= 0)
+	return -E_INVAL;
+    __sync_synchronize();
+    return ring.req[seq % VMX_RING_SIZE].result;
+}
+
+// Return how many exits ring_kick() has taken, the ring's own exit cost.
+uint64_t
+ring_kick_count(void)
+{
+    return ring_kicks;
+}
+
+#endif
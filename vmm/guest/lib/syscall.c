@@ -135,4 +135,14 @@ sys_net_try_receive(char *data, int *len)
     return syscall(SYS_net_try_receive, 0, (uint64_t)data, (uint64_t)len, 0, 0, 0); 
 }
 
+int
+sys_vmx_bench(int op, uint64_t *samples, int n)
+{
+    return syscall(SYS_vmx_bench, 0, op, (uint64_t)samples, n, 0, 0);
+}
 
+int
+sys_irq_wait(int irq)
+{
+    return syscall(SYS_irq_wait, 0, irq, 0, 0, 0, 0);
+}
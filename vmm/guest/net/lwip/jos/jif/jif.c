@@ -34,6 +34,9 @@
 #include <inc/ns.h>
 
 #include <jif/jif.h>
+#ifdef VMM_GUEST
+#include <inc/vmx.h>
+#endif
 
 #include "lwip/opt.h"
 #include "lwip/def.h"
@@ -67,6 +70,18 @@ low_level_init(struct netif *netif)
     netif->hwaddr[3] = 0x12;
     netif->hwaddr[4] = 0x34;
     netif->hwaddr[5] = 0x56;
+
+#ifdef VMM_GUEST
+    // Each guest has its own port, and MAC, on the host's virtual switch.
+    int64_t mac;
+    asm volatile("vmcall\n"
+	    : "=a" (mac)
+	    : "a" ((uint64_t) VMX_VMCALL_NET_MAC)
+	    : "cc", "memory");
+    if (mac >= 0)
+	for (r = 0; r < 6; r++)
+	    netif->hwaddr[r] = mac >> (8 * r);
+#endif
 }
 
 /*
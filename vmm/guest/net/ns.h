@@ -20,3 +20,9 @@ void input(envid_t ns_envid);
 /* output.c */
 void output(envid_t ns_envid);
 
+/* pvnet.c */
+struct vmx_pvnet_ring;
+int pvnet_setup(struct vmx_pvnet_ring *ring, int which);
+void pvnet_notify(void);
+uint64_t pvnet_gpa(const void *va);
+
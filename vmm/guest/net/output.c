@@ -2,76 +2,66 @@
 #include <inc/vmx.h>
 
 extern union Nsipc nsipcbuf;
-int
-net_try_send(char * data, int len)
-{
-//    cprintf("\n IN GUEST NET SEND :0x%x:\n", data, len);
-    int ret = 0;
-    uintptr_t tmp_adr = (uintptr_t) data;
-    int num = VMX_VMCALL_NETSEND;
-    uint64_t a1, a2;
-/*
-    if (data == NULL)
-	return -E_INVAL;
 
-    if ((uintptr_t)data >= UTOP)
-	return -E_INVAL;
-*/
-//cprintf("DATA IS : 0x%x\n", data);
-    if((vpml4e[VPML4E(tmp_adr)] & PTE_P) && (vpde[VPDPE(tmp_adr)] & PTE_P) && (vpd[VPD(tmp_adr)] & PTE_P)  &&  (vpt[VPN(tmp_adr)] & PTE_P))
-    {
-           data = (void *) PTE_ADDR( vpt[VPN(tmp_adr)] );
-    }
-    else
-    {
-	cprintf("\n Packet address not mapped SOMETHING IS REALLY WRONG \n");
-	if((ret = sys_page_alloc(0, (void *) tmp_adr , PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
-	    return ret;
-        data = (void *) PTE_ADDR( vpt[VPN(tmp_adr)] );
-    }
-    
-//    cprintf("DATA IS LEN IS: 0x%x:%d\n", data, len);
-    a1 = (uint64_t) data; // the packet buffer ptr
-    a2 = (uint64_t) len;
+// Transmit side of the paravirtual NIC, and one frame buffer per
+// descriptor, two to a page so none crosses one.
+static struct vmx_pvnet_ring tx_ring __attribute__((aligned(PGSIZE)));
+static char tx_bufs[VMX_PVNET_RING][PGSIZE / 2] __attribute__((aligned(PGSIZE)));
 
+// Post a frame on the transmit ring.  The host sends it on the guest's
+// next exit; we only notify it if it has gone idle.
+static void
+tx_post(const char *data, int len)
+{
+	struct vmx_pvnet_desc *d;
+	uint32_t slot;
+	bool was_empty;
 
- //	return e1000_transmit(data, len);
-// vmexit to host to send a packet
+	// Slots come back as the host sends frames on our exits.
+	while (tx_ring.prod - tx_ring.cons >= VMX_PVNET_RING) {
+		pvnet_notify();
+		if (tx_ring.prod - tx_ring.cons >= VMX_PVNET_RING)
+			sys_yield();
+	}
+	slot = tx_ring.prod % VMX_PVNET_RING;
+	memmove(tx_bufs[slot], data, len);
+	d = &tx_ring.desc[slot];
+	d->addr = pvnet_gpa(tx_bufs[slot]);
+	d->len = len;
+	d->flags = 0;
 
-    asm volatile("vmcall\n"
-		: "=a" (ret)
-		: "a" (num),
-		  "d" (a1),
-		  "c" (a2)
-		: "cc", "memory");
-//cprintf("RET IN TRANSMIT _GUEST:%d:\n", ret);
-    if (ret > 0)
-	panic("vmcall %d returned %d (> 0) in GUEST NET_SEND", num, ret);
-    return ret;
+	was_empty = tx_ring.prod == tx_ring.cons;
+	// The host may read the descriptor as soon as prod moves.
+	__sync_synchronize();
+	tx_ring.prod++;
+	__sync_synchronize();
+	if (was_empty && tx_ring.host_idle)
+		pvnet_notify();
 }
 
-
 void
 output(envid_t ns_envid)
 {
 	binaryname = "ns_output";
-	char *buf=(char *)malloc(sizeof(char) * 2048);
-	int len=0;
-
-	memset(buf, 0, 2048);
 
 	// LAB 6: Your code here:
 	// 	- read a packet from the network server
 	//	- send the packet to the device driver
-	int r;
+	int r, len;
+
+	// Write the ring and buffers so their pages are our own.
+	memset(&tx_ring, 0, sizeof(tx_ring));
+	memset(tx_bufs, 0, sizeof(tx_bufs));
+	if ((r = pvnet_setup(&tx_ring, VMX_PVNET_TX)) < 0)
+		panic("ns_output: pvnet_setup: %e", r);
 	while(1) {
 		r = sys_ipc_recv(&nsipcbuf);
 		if ( (thisenv->env_ipc_from != ns_envid) || (thisenv->env_ipc_value != NSREQ_OUTPUT)) {
 			continue;
 		}
-		len=nsipcbuf.pkt.jp_len;
-		memmove(buf, nsipcbuf.pkt.jp_data, nsipcbuf.pkt.jp_len);
-		while ((r = net_try_send(buf, len)) != 0);
+		len = nsipcbuf.pkt.jp_len;
+		if (len <= 0 || len > sizeof(tx_bufs[0]))
+			continue;
+		tx_post(nsipcbuf.pkt.jp_data, len);
 	}
-	
 }
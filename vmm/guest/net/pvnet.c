@@ -0,0 +1,45 @@
+// Paravirtual NIC: the guest side of VMX_VMCALL_NET_SETUP/NET_NOTIFY.
+// See struct vmx_pvnet_ring in inc/vmx.h; input.c and output.c each own
+// one ring.
+
+#include "ns.h"
+#include <inc/vmx.h>
+
+static int64_t
+pvnet_vmcall(int num, uint64_t a1, uint64_t a2)
+{
+    int64_t ret;
+
+    asm volatile("vmcall\n"
+	    : "=a" (ret)
+	    : "a" (num),
+	      "d" (a1),
+	      "c" (a2)
+	    : "cc", "memory");
+    return ret;
+}
+
+// Register 'ring' as this guest's VMX_PVNET_TX or VMX_PVNET_RX ring.
+// The ring and every buffer it will point to must already be written to,
+// so the pages are present and not shared copy-on-write.
+int
+pvnet_setup(struct vmx_pvnet_ring *ring, int which)
+{
+    uintptr_t va = (uintptr_t) ring;
+
+    return pvnet_vmcall(VMX_VMCALL_NET_SETUP, PTE_ADDR(vpt[VPN(va)]), which);
+}
+
+// Make the host send the posted transmit descriptors now.
+void
+pvnet_notify(void)
+{
+    pvnet_vmcall(VMX_VMCALL_NET_NOTIFY, 0, 0);
+}
+
+// Guest physical address of the buffer at va.
+uint64_t
+pvnet_gpa(const void *va)
+{
+    return PTE_ADDR(vpt[VPN(va)]) | PGOFF(va);
+}
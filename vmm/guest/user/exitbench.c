@@ -0,0 +1,225 @@
+// Measure the round-trip cost, in TSC cycles, of each kind of VM exit
+// this guest takes.  Every result line starts with "exitbench:" so the
+// host's "make exitbench" target can scrape them off the console.
+//
+// CPUID, the null vmcall (alone, BATCH to a multicall and BATCH through
+// the request ring) and the IPC send vmcall are issued from here;
+// the exits that need ring 0 are timed in the kernel by sys_vmx_bench().
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+#include <inc/vmx.h>
+
+#define WARMUP  64
+#define SAMPLES 1024
+// Null vmcalls per multicall batch.
+#define BATCH   16
+
+static uint64_t samples[SAMPLES];
+
+static int64_t
+vmcall(int num, uint64_t a1, uint64_t a2, uint64_t a3)
+{
+    int64_t ret;
+
+    asm volatile("vmcall\n"
+            : "=a" (ret)
+            : "a" (num),
+            "d" (a1),
+            "c" (a2),
+            "b" (a3),
+            "D" (0),
+            "S" (0)
+            : "cc", "memory");
+    return ret;
+}
+
+static void
+run_cpuid(int n)
+{
+    uint32_t eax;
+    uint64_t t0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        t0 = read_tsc();
+        cpuid(0, &eax, NULL, NULL, NULL);
+        samples[i] = read_tsc() - t0;
+    }
+}
+
+static void
+run_vmcall_nop(int n)
+{
+    uint64_t t0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        t0 = read_tsc();
+        vmcall(VMX_VMCALL_NOP, 0, 0, 0);
+        samples[i] = read_tsc() - t0;
+    }
+}
+
+// A batch of BATCH null vmcalls in one exit; samples are per batch.
+static void
+run_multicall(int n)
+{
+    uint64_t t0;
+    int i, j;
+
+    for (i = 0; i < n; i++) {
+        t0 = read_tsc();
+        multicall_begin();
+        for (j = 0; j < BATCH; j++)
+            multicall_queue(VMX_VMCALL_NOP, 0, 0, 0, 0, 0);
+        if (multicall_flush(0) != BATCH)
+            panic("multicall ran fewer than %d calls", BATCH);
+        samples[i] = read_tsc() - t0;
+    }
+}
+
+// A steady stream of null vmcalls through the exit-less ring, BATCH per
+// sample.  Nothing waits for the host: the guest's other exits drain the
+// ring, and ring_reserve() only kicks when it finds the ring full.
+// Returns the exits the ring took, to set against one per multicall batch.
+static uint64_t
+run_ring(int n)
+{
+    uint64_t t0, kicks;
+    uint32_t seq = 0;
+    int i, j;
+
+    kicks = ring_kick_count();
+    for (i = 0; i < n; i++) {
+        t0 = read_tsc();
+        for (j = 0; j < BATCH; j++) {
+            if (ring_reserve() < 0)
+                panic("ring full");
+            seq = ring_submit(VMX_VMCALL_NOP, 0, 0, 0, 0, 0);
+        }
+        samples[i] = read_tsc() - t0;
+    }
+    // Let the next timer exit run the tail before the next test.
+    while (ring_result(seq) == -E_INVAL)
+        ;
+    if (ring_result(seq) != 0)
+        panic("ring request returned %e", (int) ring_result(seq));
+    return ring_kick_count() - kicks;
+}
+
+// Sends to envid 0, which the host resolves to this guest.  The guest is
+// running rather than receiving, so the host walks the whole IPC path and
+// fails it with -E_IPC_NOT_RECV without blocking anyone.
+static void
+run_ipcsend(int n)
+{
+    uint64_t t0;
+    int64_t r;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        t0 = read_tsc();
+        r = vmcall(VMX_VMCALL_IPCSEND, 0, 0, UTOP);
+        samples[i] = read_tsc() - t0;
+        if (r != -E_IPC_NOT_RECV)
+            panic("ipcsend vmcall returned %e", (int) r);
+    }
+}
+
+static int
+run_kernel(int op, int n)
+{
+    int r;
+
+    if ((r = sys_vmx_bench(op, samples, n)) < 0)
+        panic("sys_vmx_bench(%d): %e", op, r);
+    return r;
+}
+
+static void
+sort(uint64_t *v, int n)
+{
+    int gap, i, j;
+    uint64_t t;
+
+    for (gap = n / 2; gap > 0; gap /= 2)
+        for (i = gap; i < n; i++)
+            for (j = i; j >= gap && v[j - gap] > v[j]; j -= gap) {
+                t = v[j];
+                v[j] = v[j - gap];
+                v[j - gap] = t;
+            }
+}
+
+static uint64_t
+pct(int n, int p)
+{
+    return samples[(n - 1) * p / 100];
+}
+
+static void
+report(const char *name, int n)
+{
+    if (n <= 0) {
+        cprintf("exitbench: %-8s n=0\n", name);
+        return;
+    }
+    sort(samples, n);
+    cprintf("exitbench: %-8s n=%d min=%ld p50=%ld p90=%ld p99=%ld max=%ld\n",
+            name, n, samples[0], pct(n, 50), pct(n, 90), pct(n, 99),
+            samples[n - 1]);
+}
+
+// Exits the test asked for itself, over n batches; timer exits not counted.
+static void
+report_exits(const char *name, int n, uint64_t exits)
+{
+    cprintf("exitbench: %-8s batches=%d exits=%ld\n", name, n, exits);
+}
+
+    void
+umain(int argc, char **argv)
+{
+    uint64_t exits;
+
+    // First-touch faults can only be taken once, so measure them before
+    // anything else grows into fresh guest memory.
+    report("ept", run_kernel(VMX_BENCH_EPT, SAMPLES));
+
+    run_cpuid(WARMUP);
+    run_cpuid(SAMPLES);
+    report("cpuid", SAMPLES);
+
+    run_kernel(VMX_BENCH_RDMSR, WARMUP);
+    report("rdmsr", run_kernel(VMX_BENCH_RDMSR, SAMPLES));
+
+    run_kernel(VMX_BENCH_WRMSR, WARMUP);
+    report("wrmsr", run_kernel(VMX_BENCH_WRMSR, SAMPLES));
+
+    run_kernel(VMX_BENCH_IO, WARMUP);
+    report("io", run_kernel(VMX_BENCH_IO, SAMPLES));
+
+    run_vmcall_nop(WARMUP);
+    run_vmcall_nop(SAMPLES);
+    report("vmcall", SAMPLES);
+
+    run_multicall(WARMUP);
+    run_multicall(SAMPLES);
+    report("mc16", SAMPLES);
+    // One vmcall per flush.
+    report_exits("mc16", SAMPLES, SAMPLES);
+
+    if (ring_setup() < 0)
+        panic("ring_setup failed");
+    run_ring(WARMUP);
+    exits = run_ring(SAMPLES);
+    report("ring16", SAMPLES);
+    report_exits("ring16", SAMPLES, exits);
+
+    run_ipcsend(WARMUP);
+    run_ipcsend(SAMPLES);
+    report("ipcsend", SAMPLES);
+
+    cprintf("exitbench: done\n");
+}
@@ -0,0 +1,106 @@
+// Check that the host resumes the guest after each handled exit, not at
+// a stale RIP: run different exiting instructions back to back, counting
+// the instructions in between.  A resume at the wrong place skips or
+// repeats a count.  Also checks multicall and request ring results.  Every
+// line starts with "exitseq:" so the host's "make exitseq" target can
+// scrape it off the console.
+
+#include <inc/lib.h>
+#include <inc/vmx.h>
+
+#define ROUNDS 1000
+
+// cpuid, vmcall, cpuid and vmcall in a row; returns the count, 5.
+static int
+run_sequence(void)
+{
+    int steps = 0;
+
+    asm volatile("incl %0\n\t"
+                 "xorl %%eax, %%eax\n\t"
+                 "cpuid\n\t"
+                 "incl %0\n\t"
+                 "movq %1, %%rax\n\t"
+                 "vmcall\n\t"
+                 "incl %0\n\t"
+                 "xorl %%eax, %%eax\n\t"
+                 "cpuid\n\t"
+                 "incl %0\n\t"
+                 "movq %1, %%rax\n\t"
+                 "vmcall\n\t"
+                 "incl %0\n"
+            : "+m" (steps)
+            : "i" (VMX_VMCALL_NOP)
+            : "rax", "rbx", "rcx", "rdx", "rdi", "rsi", "cc", "memory");
+    return steps;
+}
+
+// A multicall batch runs every call once and in order: a NOP, then a
+// call the host rejects, then a NOP.
+static int
+check_multicall(void)
+{
+    multicall_begin();
+    multicall_queue(VMX_VMCALL_NOP, 0, 0, 0, 0, 0);
+    multicall_queue(VMX_VMCALL_MBMAP, 0, 0, 0, 0, 0);
+    multicall_queue(VMX_VMCALL_NOP, 0, 0, 0, 0, 0);
+    if (multicall_flush(0) != 3)
+        return -1;
+    if (multicall_result(0) != 0 || multicall_result(1) >= 0 ||
+            multicall_result(2) != 0)
+        return -1;
+    return 0;
+}
+
+// Requests on the exit-less ring are all run, in order, by the exits the
+// guest takes anyway: a running guest never has to kick.
+static int
+check_ring(void)
+{
+    uint32_t seq[3];
+    uint64_t kicks;
+    int i;
+
+    if (ring_setup() < 0)
+        return -1;
+    kicks = ring_kick_count();
+    for (i = 0; i < 3; i++) {
+        if (ring_reserve() < 0)
+            return -1;
+        seq[i] = ring_submit(VMX_VMCALL_NOP, 0, 0, 0, 0, 0);
+    }
+    // The next timer exit drains them.
+    while (ring_result(seq[2]) == -E_INVAL)
+        ;
+    for (i = 0; i < 3; i++)
+        if (ring_result(seq[i]) != 0)
+            return -1;
+    if (ring_kick_count() != kicks)
+        return -1;
+    return 0;
+}
+
+    void
+umain(int argc, char **argv)
+{
+    int i, steps;
+
+    for (i = 0; i < ROUNDS; i++)
+        if ((steps = run_sequence()) != 5) {
+            cprintf("exitseq: FAIL round %d: %d steps, expected 5\n", i, steps);
+            cprintf("exitseq: done\n");
+            return;
+        }
+    if (check_multicall() < 0) {
+        cprintf("exitseq: FAIL multicall results\n");
+        cprintf("exitseq: done\n");
+        return;
+    }
+    if (check_ring() < 0) {
+        cprintf("exitseq: FAIL ring results\n");
+        cprintf("exitseq: done\n");
+        return;
+    }
+    cprintf("exitseq: OK %d rounds\n", ROUNDS);
+    cprintf("exitseq: done\n");
+}
@@ -0,0 +1,219 @@
+#include <vmm/vmx.h>
+#include <vmm/pvblk.h>
+#include <vmm/ept.h>
+
+#include <inc/mmu.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/trap.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+
+/*
+ * Paravirtual disk for guests.
+ *
+ * The guest's file system used to read its disk image through the host
+ * file server, one IPC round trip (two exits) per 1KB.  Instead it now
+ * posts block requests on a ring in its own memory (struct
+ * vmx_pvblk_ring).  The host kernel cannot read files itself, so a user
+ * env, the one that built the guest, serves the ring: it sleeps in
+ * sys_vmx_blk_next() until there is a request, moves the whole extent
+ * to or from the image in one go, and completes it with
+ * sys_vmx_blk_done().  The kernel only copies data between the backend's
+ * buffer and the guest pages and raises the completion interrupt.  The
+ * ring belongs to the guest's BSP.
+ */
+
+static struct Env *
+pvblk_owner(struct Env *e)
+{
+    return &envs[ENVX(e->env_vmxinfo.vcpu_bsp)];
+}
+
+// Wakes the backend of guest g if it sleeps in sys_vmx_blk_next().
+static void
+pvblk_wake(struct Env *g)
+{
+    struct Env *s;
+
+    if (!g->env_vmxinfo.pvblk_waiting)
+        return;
+    g->env_vmxinfo.pvblk_waiting = false;
+    if (envid2env(g->env_vmxinfo.pvblk_server, &s, 0) == 0 &&
+            s->env_status == ENV_NOT_RUNNABLE)
+        sched_wakeup(s);
+}
+
+// Copies the data of request r between buf and the guest pages it names:
+// to the guest if to_guest, else from it.  With buf NULL, only checks the
+// pages.  Returns -E_INVAL if a page is not mapped or a buffer crosses
+// a page.
+static int
+pvblk_copy(struct Env *g, struct vmx_pvblk_req *r, char *buf, bool to_guest)
+{
+    int bytes = r->nsecs * VMX_PVBLK_SECTSIZE;
+    int i, n, ret = 0;
+    char *hva;
+
+    spin_lock(env_as_lock(g));
+    for (i = 0; i * PGSIZE < bytes; i++) {
+        n = MIN(bytes - i * PGSIZE, PGSIZE);
+        hva = NULL;
+        if (PGOFF(r->gpa[i]) + n <= PGSIZE &&
+                r->gpa[i] < g->env_vmxinfo.phys_sz)
+            ept_gpa2hva(g->env_pml4e, (void *) r->gpa[i], (void **) &hva);
+        if (!hva) {
+            ret = -E_INVAL;
+            break;
+        }
+        if (!buf)
+            continue;
+        if (to_guest)
+            memmove(hva, buf + i * PGSIZE, n);
+        else
+            memmove(buf + i * PGSIZE, hva, n);
+    }
+    spin_unlock(env_as_lock(g));
+    return ret;
+}
+
+// Completes the request at the head of g's ring with 'status'.
+static void
+pvblk_complete(struct Env *g, struct vmx_pvblk_ring *ring, int status)
+{
+    ring->req[ring->cons % VMX_PVBLK_RING].status = status;
+    // Publish the status (and data) before handing the slot back.
+    __sync_synchronize();
+    ring->cons++;
+    if (ring->irq) {
+        ring->irq = 0;
+        vmx_inject_irq(g, IRQ_OFFSET + VMX_PVBLK_IRQ);
+    }
+}
+
+/*
+ * Registers the guest page at gpa as the disk ring of e's guest, or
+ * unregisters it if gpa is 0.
+ */
+int
+vmx_pvblk_setup(struct Env *e, uint64_t gpa)
+{
+    struct Env *g = pvblk_owner(e);
+    struct vmx_pvblk_ring *ring = NULL;
+
+    if (gpa) {
+        if (PGOFF(gpa) || gpa >= g->env_vmxinfo.phys_sz)
+            return -E_INVAL;
+        spin_lock(env_as_lock(g));
+        ept_gpa2hva(g->env_pml4e, (void *) gpa, (void **) &ring);
+        spin_unlock(env_as_lock(g));
+        if (!ring)
+            return -E_INVAL;
+        // Nothing is being served yet, so the first request must notify.
+        ring->host_idle = 1;
+    }
+    g->env_vmxinfo.pvblk = ring;
+    return 0;
+}
+
+/*
+ * VMX_VMCALL_BLK_NOTIFY: the guest has posted requests while the backend
+ * was idle.
+ */
+void
+vmx_pvblk_notify(struct Env *e)
+{
+    pvblk_wake(pvblk_owner(e));
+}
+
+/*
+ * Copies the request at the head of guest g's ring to req and, for a
+ * write, its data to buf (VMX_PVBLK_MAXPAGES pages of the calling
+ * backend).  Malformed requests are failed on the spot.  The request
+ * stays at the head until vmx_pvblk_done(), so asking again returns it
+ * again.
+ *
+ * Returns 0, or -E_NO_ENT if the ring is empty, in which case the caller
+ * is recorded as the backend to wake when the guest notifies.
+ */
+int
+vmx_pvblk_next(struct Env *g, struct vmx_pvblk_req *req, char *buf)
+{
+    struct vmx_pvblk_ring *ring;
+
+    while (1) {
+        ring = g->env_vmxinfo.pvblk;
+        if (ring && ring->prod - ring->cons > VMX_PVBLK_RING)
+            // Corrupt indices: drop whatever is queued.
+            ring->cons = ring->prod;
+        if (!ring || ring->cons == ring->prod) {
+            if (ring) {
+                ring->host_idle = 1;
+                // Look again in case a request came before the guest
+                // could see host_idle.
+                __sync_synchronize();
+                if (ring->cons != ring->prod)
+                    continue;
+            }
+            g->env_vmxinfo.pvblk_server = curenv->env_id;
+            g->env_vmxinfo.pvblk_waiting = true;
+            return -E_NO_ENT;
+        }
+        ring->host_idle = 0;
+        // Read the request only after seeing prod move past it.
+        __sync_synchronize();
+        *req = ring->req[ring->cons % VMX_PVBLK_RING];
+        if ((req->op != VMX_PVBLK_READ && req->op != VMX_PVBLK_WRITE) ||
+                req->nsecs == 0 || req->nsecs > VMX_PVBLK_MAXSECTS ||
+                pvblk_copy(g, req, req->op == VMX_PVBLK_WRITE ? buf : NULL,
+                    false) < 0) {
+            pvblk_complete(g, ring, -E_INVAL);
+            continue;
+        }
+        return 0;
+    }
+}
+
+/*
+ * Completes the request at the head of guest g's ring with 'status',
+ * copying the data of a successful read from buf into the guest first.
+ * Returns -E_INVAL if there is no request to complete.
+ */
+int
+vmx_pvblk_done(struct Env *g, int status, const char *buf)
+{
+    struct vmx_pvblk_ring *ring = g->env_vmxinfo.pvblk;
+    struct vmx_pvblk_req req;
+
+    if (!ring || ring->cons == ring->prod)
+        return -E_INVAL;
+    req = ring->req[ring->cons % VMX_PVBLK_RING];
+    if (status >= 0) {
+        status = 0;
+        if (req.nsecs > VMX_PVBLK_MAXSECTS)
+            status = -E_INVAL;
+        else if (req.op == VMX_PVBLK_READ)
+            status = pvblk_copy(g, &req, (char *) buf, true);
+    }
+    if (status == 0) {
+        g->env_vmxinfo.pvblk_reqs++;
+        g->env_vmxinfo.pvblk_sectors += req.nsecs;
+    }
+    pvblk_complete(g, ring, status);
+    return 0;
+}
+
+/*
+ * Forgets the ring of guest e when it is freed, and lets its backend see
+ * that the guest is gone.
+ */
+void
+vmx_pvblk_free(struct Env *e)
+{
+    if (e->env_vmxinfo.vcpu_id)
+        return;
+    e->env_vmxinfo.pvblk = NULL;
+    pvblk_wake(e);
+}
@@ -0,0 +1,15 @@
+#ifndef JOS_VMM_PVBLK_H
+#define JOS_VMM_PVBLK_H
+
+#include <inc/types.h>
+#include <inc/vmx.h>
+
+struct Env;
+
+int vmx_pvblk_setup( struct Env *e, uint64_t gpa );
+void vmx_pvblk_notify( struct Env *e );
+int vmx_pvblk_next( struct Env *g, struct vmx_pvblk_req *req, char *buf );
+int vmx_pvblk_done( struct Env *g, int status, const char *buf );
+void vmx_pvblk_free( struct Env *e );
+
+#endif
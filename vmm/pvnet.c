@@ -0,0 +1,248 @@
+#include <vmm/vmx.h>
+#include <vmm/pvnet.h>
+#include <vmm/vswitch.h>
+#include <vmm/ept.h>
+
+#include <inc/mmu.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/trap.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/spinlock.h>
+#include <kern/e1000.h>
+
+/*
+ * Paravirtual NIC for guests.
+ *
+ * Instead of one vmcall per packet (VMX_VMCALL_NETSEND/NETRECV), a guest
+ * registers a transmit and a receive descriptor ring (struct
+ * vmx_pvnet_ring) that live in its own memory.  Transmit descriptors are
+ * handed to the virtual switch (vmm/vswitch.c) whenever the guest exits,
+ * those for the wire to the e1000 in bulk; the switch copies frames for
+ * the guest straight into posted guest buffers, and the guest is told
+ * with an interrupt only when it asked for one.  Both rings belong to the
+ * guest's BSP.
+ */
+
+static struct Env *
+pvnet_owner(struct Env *e)
+{
+    return &envs[ENVX(e->env_vmxinfo.vcpu_bsp)];
+}
+
+// Host address of the guest buffer [gpa, gpa + len), or NULL if it is not
+// mapped or crosses a page.  Called with the guest's AS lock held.
+static char *
+pvnet_buf(struct Env *g, uint64_t gpa, int len)
+{
+    char *hva;
+
+    if (len <= 0 || PGOFF(gpa) + len > PGSIZE || gpa >= g->env_vmxinfo.phys_sz)
+        return NULL;
+    ept_gpa2hva(g->env_pml4e, (void *) gpa, (void **) &hva);
+    return hva;
+}
+
+// Copies descriptor idx of ring, which the guest may be rewriting, to *d.
+// Callers check and use only the copy.
+static void
+pvnet_desc_read(struct vmx_pvnet_ring *ring, uint32_t idx,
+        struct vmx_pvnet_desc *d)
+{
+    volatile struct vmx_pvnet_desc *src = &ring->desc[idx % VMX_PVNET_RING];
+
+    d->addr = src->addr;
+    d->len = src->len;
+    d->flags = src->flags;
+    d->pad = 0;
+}
+
+/*
+ * Registers the guest page at gpa as the 'which' (VMX_PVNET_TX/RX) ring of
+ * e's guest, or unregisters that ring if gpa is 0.
+ */
+int
+vmx_pvnet_setup(struct Env *e, uint64_t gpa, int which)
+{
+    struct Env *g = pvnet_owner(e);
+    struct vmx_pvnet_ring *ring = NULL;
+
+    if (which != VMX_PVNET_TX && which != VMX_PVNET_RX)
+        return -E_INVAL;
+    if (vsw_guest_port(g) < 0)
+        return -E_NO_MEM;
+    if (gpa) {
+        if (PGOFF(gpa) || gpa >= g->env_vmxinfo.phys_sz)
+            return -E_INVAL;
+        spin_lock(env_as_lock(g));
+        ept_gpa2hva(g->env_pml4e, (void *) gpa, (void **) &ring);
+        spin_unlock(env_as_lock(g));
+        if (!ring)
+            return -E_INVAL;
+        ring->host_idle = 1;
+        if (which == VMX_PVNET_TX)
+            g->env_vmxinfo.pvnet_tx_next = ring->cons;
+    }
+    g->env_vmxinfo.pvnet[which] = ring;
+    return 0;
+}
+
+/*
+ * Hands the frames posted on the transmit ring of e's guest to the virtual
+ * switch, runs of frames for the wire to the e1000 as many at a time as it
+ * will take, and completes those that are out.  The card reads the frames
+ * straight out of guest memory, so descriptors go back to the guest only
+ * once it is done with them.  Runs with the kernel lock held, on every
+ * exit that reaches vmexit() and on VMX_VMCALL_NET_NOTIFY.
+ */
+void
+vmx_pvnet_tx(struct Env *e)
+{
+    struct Env *g = pvnet_owner(e);
+    struct vmx_pvnet_ring *ring = g->env_vmxinfo.pvnet[VMX_PVNET_TX];
+    struct vmx_pvnet_desc *d, dc;
+    char *frames[VMX_PVNET_RING];
+    int lens[VMX_PVNET_RING];
+    uint32_t cons, next, prod;
+    uint64_t stamp;
+    int i, n, sent, port;
+
+    if (!ring)
+        return;
+    cons = ring->cons;
+    next = g->env_vmxinfo.pvnet_tx_next;
+    prod = ring->prod;
+    if (prod - cons > VMX_PVNET_RING || next - cons > prod - cons) {
+        // Corrupt indices: drop whatever is queued.
+        ring->cons = g->env_vmxinfo.pvnet_tx_next = prod;
+        return;
+    }
+    // Hand back the descriptors whose frames are out.
+    if (cons != next && e1000_tx_poll() >= g->env_vmxinfo.pvnet_tx_stamp)
+        cons = next;
+    if (next == prod) {
+        if (cons == prod)
+            ring->host_idle = 1;
+        goto out;
+    }
+    ring->host_idle = 0;
+    port = g->env_vmxinfo.vsw_port;
+    // Read descriptors only after seeing prod move past them.
+    __sync_synchronize();
+
+    spin_lock(env_as_lock(g));
+    while (next != prod) {
+        // Gather the run of frames that go to the wire alone.  Other
+        // vCPUs may rewrite a descriptor at any time, so each is copied
+        // once and only the copy is checked and used.
+        for (n = 0; next + n != prod; n++) {
+            pvnet_desc_read(ring, next + n, &dc);
+            if (dc.len > E1000_TXPCKTSZ ||
+                    !(frames[n] = pvnet_buf(g, dc.addr, dc.len)) ||
+                    vsw_route(port, frames[n], dc.len) != 1 << VSW_PORT_WIRE)
+                break;
+            lens[n] = dc.len;
+        }
+        if (n == 0) {
+            pvnet_desc_read(ring, next, &dc);
+            d = &ring->desc[next % VMX_PVNET_RING];
+            if (dc.len > E1000_TXPCKTSZ ||
+                    !(frames[0] = pvnet_buf(g, dc.addr, dc.len))) {
+                // Bad descriptor: it completes, with an error, along
+                // with the frames before it.
+                d->flags = VMX_PVNET_ERROR;
+                next++;
+                continue;
+            }
+            // A frame for other ports of the switch goes on its own.
+            stamp = g->env_vmxinfo.pvnet_tx_stamp;
+            if (vsw_forward(port, vsw_route(port, frames[0], dc.len),
+                        frames[0], dc.len, true, &stamp) < 0)
+                // The card is full; try again on a later exit.
+                break;
+            g->env_vmxinfo.pvnet_tx_stamp = stamp;
+            g->env_vmxinfo.pvnet_tx_frames++;
+            d->flags = 0;
+            next++;
+            continue;
+        }
+        sent = e1000_transmit_pages(frames, lens, n, &stamp);
+        g->env_vmxinfo.pvnet_tx_frames += sent;
+        for (i = 0; i < sent; i++) {
+            ring->desc[(next + i) % VMX_PVNET_RING].flags = 0;
+            vsw_account_wire(port, lens[i]);
+        }
+        next += sent;
+        if (sent)
+            g->env_vmxinfo.pvnet_tx_stamp = stamp;
+        if (sent < n)
+            // The card is full; the rest goes out on a later exit.
+            break;
+    }
+    spin_unlock(env_as_lock(g));
+    g->env_vmxinfo.pvnet_tx_next = next;
+    // Frames that went out while we queued the rest, or bad descriptors
+    // with nothing on the card before them, complete now.
+    if (e1000_tx_poll() >= g->env_vmxinfo.pvnet_tx_stamp)
+        cons = next;
+out:
+    // Publish the completions before handing the slots back.
+    __sync_synchronize();
+    ring->cons = cons;
+}
+
+/*
+ * Copies frame [frame, frame + len) into the next buffer posted on guest
+ * g's receive ring and raises VMX_PVNET_IRQ if the guest asked for it.
+ * Called by the virtual switch.  Returns false if the frame was dropped.
+ */
+bool
+vmx_pvnet_rx(struct Env *g, const char *frame, int len)
+{
+    struct vmx_pvnet_ring *ring = g->env_vmxinfo.pvnet[VMX_PVNET_RX];
+    struct vmx_pvnet_desc *d;
+    bool ok = false;
+    char *buf;
+
+    if (!ring)
+        return false;
+    if (ring->cons == ring->prod) {
+        // No buffer posted.
+        g->env_vmxinfo.pvnet_rx_drops++;
+        return false;
+    }
+    __sync_synchronize();
+    d = &ring->desc[ring->cons % VMX_PVNET_RING];
+    spin_lock(env_as_lock(g));
+    if (len <= d->len && (buf = pvnet_buf(g, d->addr, len))) {
+        memmove(buf, frame, len);
+        d->len = len;
+        d->flags = 0;
+        g->env_vmxinfo.pvnet_rx_frames++;
+        ok = true;
+    } else {
+        d->flags = VMX_PVNET_ERROR;
+        g->env_vmxinfo.pvnet_rx_drops++;
+    }
+    spin_unlock(env_as_lock(g));
+    __sync_synchronize();
+    ring->cons++;
+    if (ring->irq) {
+        ring->irq = 0;
+        vmx_inject_irq(g, IRQ_OFFSET + VMX_PVNET_IRQ);
+    }
+    return ok;
+}
+
+/*
+ * Forgets the rings of guest e when it is freed.
+ */
+void
+vmx_pvnet_free(struct Env *e)
+{
+    if (e->env_vmxinfo.vcpu_id)
+        return;
+    e->env_vmxinfo.pvnet[VMX_PVNET_TX] = NULL;
+    e->env_vmxinfo.pvnet[VMX_PVNET_RX] = NULL;
+}
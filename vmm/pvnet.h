@@ -0,0 +1,14 @@
+#ifndef JOS_VMM_PVNET_H
+#define JOS_VMM_PVNET_H
+
+#include <inc/types.h>
+#include <inc/vmx.h>
+
+struct Env;
+
+int vmx_pvnet_setup( struct Env *e, uint64_t gpa, int which );
+void vmx_pvnet_tx( struct Env *e );
+bool vmx_pvnet_rx( struct Env *g, const char *frame, int len );
+void vmx_pvnet_free( struct Env *e );
+
+#endif
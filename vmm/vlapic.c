@@ -0,0 +1,490 @@
+#include <vmm/vmx.h>
+#include <vmm/vlapic.h>
+#include <vmm/ept.h>
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+
+/*
+ * Local APIC emulation for guests.
+ *
+ * The guest's APIC page at VMX_LAPIC_GPA is never mapped in the EPT, so
+ * every access exits as an EPT violation and is emulated here against the
+ * per-vCPU register file in VmxGuestInfo.vlapic.  This gives each vCPU its
+ * own APIC ID, lets the guest boot its APs with INIT/STARTUP IPIs, and
+ * keeps guests off the host's real APIC.
+ *
+ * Only the plain MOV forms a compiler emits for "lapic[idx] = v" and
+ * "v = lapic[idx]" are decoded.
+ */
+
+#define VLAPIC_MAX_INSN   15
+// Physical address bits of a guest page table entry (strip NX/ignored bits).
+#define VLAPIC_PTE_ADDR(pte) ((pte) & 0x000FFFFFFFFFF000ULL)
+
+struct vlapic_op {
+    bool write;
+    int reg;            // source/destination GPR, -1 for an immediate
+    uint32_t imm;
+    int len;
+};
+
+// Translate guest linear address va to a host kernel address using the
+// guest's own page tables.  Only 4-level (long mode) paging is supported.
+static int
+vlapic_gva2hva(epte_t *eptrt, uint64_t va, void **hva) {
+    uint64_t cr0 = vmcs_read64(VMCS_GUEST_CR0);
+    uint64_t table = VLAPIC_PTE_ADDR(vmcs_read64(VMCS_GUEST_CR3));
+    uint64_t pte, gpa = va, size;
+    void *t;
+    int level;
+
+    if (cr0 & CR0_PG) {
+        for (level = 3; level >= 0; level--) {
+            ept_gpa2hva(eptrt, (void *)table, &t);
+            if (!t)
+                return -E_FAULT;
+            pte = ((uint64_t *)t)[(va >> (PGSHIFT + 9 * level)) & 0x1FF];
+            if (!(pte & PTE_P))
+                return -E_FAULT;
+            if (level == 0 || (level < 3 && (pte & PTE_PS))) {
+                size = 1ULL << (PGSHIFT + 9 * level);
+                gpa = (VLAPIC_PTE_ADDR(pte) & ~(size - 1)) | (va & (size - 1));
+                break;
+            }
+            table = VLAPIC_PTE_ADDR(pte);
+        }
+    }
+    ept_gpa2hva(eptrt, (void *)gpa, hva);
+    return *hva ? 0 : -E_FAULT;
+}
+
+// Copy the (up to 15 byte) instruction at guest rip, which may straddle
+// a page boundary.
+static int
+vlapic_fetch(epte_t *eptrt, uint64_t rip, uint8_t *insn) {
+    size_t n = MIN(VLAPIC_MAX_INSN, PGSIZE - (rip & (PGSIZE - 1)));
+    void *hva;
+    int r;
+
+    if ((r = vlapic_gva2hva(eptrt, rip, &hva)) < 0)
+        return r;
+    memcpy(insn, hva, n);
+    if (n == VLAPIC_MAX_INSN)
+        return 0;
+    if ((r = vlapic_gva2hva(eptrt, rip + n, &hva)) < 0)
+        return r;
+    memcpy(insn + n, hva, VLAPIC_MAX_INSN - n);
+    return 0;
+}
+
+// Decode "mov r32, m32" (0x8B), "mov m32, r32" (0x89) and
+// "mov m32, imm32" (0xC7 /0), with an optional REX prefix.
+static int
+vlapic_decode(const uint8_t *insn, struct vlapic_op *op) {
+    const uint8_t *p = insn;
+    uint8_t rex = 0, opc, modrm, mod, rm;
+
+    if ((*p & 0xF0) == 0x40)
+        rex = *p++;
+    opc = *p++;
+    modrm = *p++;
+    mod = modrm >> 6;
+    rm = modrm & 7;
+    if (mod == 3)
+        return -E_INVAL;
+
+    switch (opc) {
+        case 0x89:
+        case 0x8B:
+            op->write = (opc == 0x89);
+            op->reg = ((modrm >> 3) & 7) | ((rex & 0x4) << 1);
+            break;
+        case 0xC7:
+            if ((modrm >> 3) & 7)
+                return -E_INVAL;
+            op->write = true;
+            op->reg = -1;
+            break;
+        default:
+            return -E_INVAL;
+    }
+
+    if (rm == 4) {
+        // SIB; base 5 with mod 0 means disp32 and no base.
+        if ((*p & 7) == 5 && mod == 0)
+            p += 4;
+        p++;
+    } else if (rm == 5 && mod == 0) {
+        p += 4;     // rip-relative disp32
+    }
+    if (mod == 1)
+        p += 1;
+    else if (mod == 2)
+        p += 4;
+
+    if (op->reg < 0) {
+        memcpy(&op->imm, p, 4);
+        p += 4;
+    }
+    op->len = p - insn;
+    return 0;
+}
+
+// Reads guest GPR reg into *val.  Returns false for rsp, which lives in
+// the VMCS; the compiler never uses it for APIC values.  struct PushRegs
+// is packed, so its members are accessed by value, never by pointer.
+static bool
+vlapic_get_gpr(struct Trapframe *tf, int reg, uint64_t *val) {
+    struct PushRegs *r = &tf->tf_regs;
+
+    switch (reg) {
+        case 0: *val = r->reg_rax; return true;
+        case 1: *val = r->reg_rcx; return true;
+        case 2: *val = r->reg_rdx; return true;
+        case 3: *val = r->reg_rbx; return true;
+        case 5: *val = r->reg_rbp; return true;
+        case 6: *val = r->reg_rsi; return true;
+        case 7: *val = r->reg_rdi; return true;
+        case 8: *val = r->reg_r8; return true;
+        case 9: *val = r->reg_r9; return true;
+        case 10: *val = r->reg_r10; return true;
+        case 11: *val = r->reg_r11; return true;
+        case 12: *val = r->reg_r12; return true;
+        case 13: *val = r->reg_r13; return true;
+        case 14: *val = r->reg_r14; return true;
+        case 15: *val = r->reg_r15; return true;
+    }
+    return false;
+}
+
+// Writes val to guest GPR reg; see vlapic_get_gpr().
+static bool
+vlapic_set_gpr(struct Trapframe *tf, int reg, uint64_t val) {
+    struct PushRegs *r = &tf->tf_regs;
+
+    switch (reg) {
+        case 0: r->reg_rax = val; return true;
+        case 1: r->reg_rcx = val; return true;
+        case 2: r->reg_rdx = val; return true;
+        case 3: r->reg_rbx = val; return true;
+        case 5: r->reg_rbp = val; return true;
+        case 6: r->reg_rsi = val; return true;
+        case 7: r->reg_rdi = val; return true;
+        case 8: r->reg_r8 = val; return true;
+        case 9: r->reg_r9 = val; return true;
+        case 10: r->reg_r10 = val; return true;
+        case 11: r->reg_r11 = val; return true;
+        case 12: r->reg_r12 = val; return true;
+        case 13: r->reg_r13 = val; return true;
+        case 14: r->reg_r14 = val; return true;
+        case 15: r->reg_r15 = val; return true;
+    }
+    return false;
+}
+
+static uint32_t
+vlapic_read(struct VmxGuestInfo *ginfo, uint32_t offset) {
+    struct vmx_vlapic *l = &ginfo->vlapic;
+
+    switch (offset) {
+        case VLAPIC_ID:     return (uint32_t)ginfo->vcpu_id << 24;
+        case VLAPIC_VER:    return VLAPIC_VERSION;
+        case VLAPIC_TPR:    return l->tpr;
+        case VLAPIC_SVR:    return l->svr;
+        case VLAPIC_ESR:    return l->esr;
+        // IPIs are delivered synchronously, so never report "pending".
+        case VLAPIC_ICRLO:  return l->icr_lo & ~VLAPIC_ICR_DELIVS;
+        case VLAPIC_ICRHI:  return l->icr_hi;
+        case VLAPIC_TIMER:  return l->lvt_timer;
+        case VLAPIC_PCINT:  return l->lvt_pcint;
+        case VLAPIC_LINT0:  return l->lvt_lint0;
+        case VLAPIC_LINT1:  return l->lvt_lint1;
+        case VLAPIC_ERROR:  return l->lvt_error;
+        case VLAPIC_TICR:   return l->ticr;
+        case VLAPIC_TCCR:   return l->tccr;
+        case VLAPIC_TDCR:   return l->tdcr;
+    }
+    return 0;
+}
+
+// Deliver the IPI described by icr to vCPU t.
+static void
+vlapic_deliver(struct Env *t, uint32_t icr) {
+    struct VmxGuestInfo *g = &t->env_vmxinfo;
+
+    switch (icr & VLAPIC_ICR_MODE) {
+        case VLAPIC_ICR_FIXED:
+            vmx_inject_irq(t, icr & VLAPIC_ICR_VECTOR);
+            break;
+        case VLAPIC_ICR_INIT:
+            // The level de-assert INIT only resyncs arbitration IDs.
+            if ((icr & VLAPIC_ICR_LEVEL) && !(icr & VLAPIC_ICR_ASSERT))
+                break;
+            if (g->vcpu_state == VMX_VCPU_WAIT_INIT)
+                g->vcpu_state = VMX_VCPU_WAIT_SIPI;
+            break;
+        case VLAPIC_ICR_STARTUP:
+            // Only the first STARTUP after INIT counts.
+            if (g->vcpu_state != VMX_VCPU_WAIT_SIPI)
+                break;
+            g->sipi_vector = icr & VLAPIC_ICR_VECTOR;
+            g->vcpu_state = VMX_VCPU_RUNNING;
+            sched_wakeup(t);
+            break;
+    }
+}
+
+static void
+vlapic_send_ipi(struct Env *src) {
+    struct VmxGuestInfo *g = &src->env_vmxinfo;
+    uint32_t icr = g->vlapic.icr_lo;
+    int dest = g->vlapic.icr_hi >> 24;
+    struct Env *bsp, *t;
+    int i;
+
+    if (envid2env(g->vcpu_bsp, &bsp, 0) < 0)
+        return;
+    for (i = 0; i < bsp->env_vmxinfo.nvcpus; i++) {
+        // vcpus[] is indexed by APIC ID.
+        if (!bsp->env_vmxinfo.vcpus[i] ||
+                envid2env(bsp->env_vmxinfo.vcpus[i], &t, 0) < 0)
+            continue;
+        switch (icr & VLAPIC_ICR_DEST) {
+            case VLAPIC_ICR_DEST_FIELD:
+                if (i != dest)
+                    continue;
+                break;
+            case VLAPIC_ICR_DEST_SELF:
+                if (t != src)
+                    continue;
+                break;
+            case VLAPIC_ICR_DEST_OTHERS:
+                if (t == src)
+                    continue;
+                break;
+        }
+        vlapic_deliver(t, icr);
+    }
+}
+
+static void
+vlapic_write(struct Env *e, uint32_t offset, uint32_t val) {
+    struct vmx_vlapic *l = &e->env_vmxinfo.vlapic;
+
+    switch (offset) {
+        case VLAPIC_TPR:    l->tpr = val & 0xFF; break;
+        case VLAPIC_SVR:    l->svr = val; break;
+        case VLAPIC_ESR:    l->esr = 0; break;
+        case VLAPIC_ICRHI:  l->icr_hi = val; break;
+        case VLAPIC_ICRLO:
+            l->icr_lo = val;
+            vlapic_send_ipi(e);
+            break;
+        case VLAPIC_TIMER:  l->lvt_timer = val; break;
+        case VLAPIC_PCINT:  l->lvt_pcint = val; break;
+        case VLAPIC_LINT0:  l->lvt_lint0 = val; break;
+        case VLAPIC_LINT1:  l->lvt_lint1 = val; break;
+        case VLAPIC_ERROR:  l->lvt_error = val; break;
+        case VLAPIC_TICR:   l->ticr = l->tccr = val; break;
+        case VLAPIC_TDCR:   l->tdcr = val & VLAPIC_TDCR_MASK; break;
+        // EOI needs no work: injected interrupts are not tracked in an ISR.
+    }
+}
+
+void
+vlapic_init(struct VmxGuestInfo *ginfo) {
+    struct vmx_vlapic *l = &ginfo->vlapic;
+
+    memset(l, 0, sizeof(*l));
+    l->svr = 0xFF;
+    l->lvt_timer = l->lvt_pcint = VLAPIC_LVT_MASKED;
+    l->lvt_lint0 = l->lvt_lint1 = l->lvt_error = VLAPIC_LVT_MASKED;
+}
+
+/*
+ * Emulates the guest access that caused an EPT violation on the APIC page.
+ * Returns false if the instruction could not be emulated.
+ */
+bool
+vlapic_mmio(struct Env *e, struct vmx_exit_info *exit) {
+    struct Trapframe *tf = &e->env_tf;
+    uint32_t offset = exit->gpa - VMX_LAPIC_GPA;
+    uint8_t insn[VLAPIC_MAX_INSN];
+    struct vlapic_op op;
+    uint64_t val = 0;
+
+    if (vlapic_fetch(e->env_pml4e, exit->rip, insn) < 0 ||
+            vlapic_decode(insn, &op) < 0 ||
+            (op.reg >= 0 && !vlapic_get_gpr(tf, op.reg, &val))) {
+        cprintf("vlapic: can't emulate APIC access at rip %lx\n", exit->rip);
+        return false;
+    }
+    if (op.write)
+        vlapic_write(e, offset, op.reg >= 0 ? (uint32_t)val : op.imm);
+    else
+        vlapic_set_gpr(tf, op.reg, vlapic_read(&e->env_vmxinfo, offset));
+    tf->tf_rip += op.len;
+    return true;
+}
+
+// Counts the timer's divider takes off per host tick.  TDCR encodes divide
+// by 2^(n+1) in bits 0, 1 and 3, with n == 7 meaning divide by 1.
+static uint64_t
+vlapic_tick_counts(uint32_t tdcr) {
+    int n = (tdcr & 3) | ((tdcr & 8) >> 1);
+
+    return n == 7 ? VLAPIC_TICK_COUNTS : VLAPIC_TICK_COUNTS >> (n + 1);
+}
+
+/*
+ * Called on every host timer tick.  Counts the virtual APIC timer down by
+ * VLAPIC_TICK_COUNTS, scaled by the guest's divider, and fires it when the
+ * count runs out: at most once per tick, so a count shorter than a tick
+ * fires at the host tick rate.  A periodic timer reloads from TICR.
+ */
+void
+vlapic_tick(struct Env *e) {
+    struct VmxGuestInfo *g = &e->env_vmxinfo;
+    struct vmx_vlapic *l = &g->vlapic;
+    uint64_t counts;
+
+    if (g->vcpu_state != VMX_VCPU_RUNNING || !(l->svr & VLAPIC_SVR_ENABLE) ||
+            !l->tccr)
+        return;
+    counts = vlapic_tick_counts(l->tdcr);
+    if (counts < l->tccr) {
+        l->tccr -= counts;
+        return;
+    }
+    if (l->lvt_timer & VLAPIC_TIMER_PERIODIC)
+        l->tccr = l->ticr - (counts - l->tccr) % l->ticr;
+    else
+        l->tccr = 0;
+    if (!(l->lvt_timer & VLAPIC_LVT_MASKED))
+        vmx_inject_irq(e, l->lvt_timer & 0xFF);
+}
+
+// MP specification structures, laid out as kern/mpconfig.c expects them.
+struct vlapic_mp {
+    uint8_t signature[4];
+    uint32_t physaddr;
+    uint8_t length;
+    uint8_t specrev;
+    uint8_t checksum;
+    uint8_t type;
+    uint8_t imcrp;
+    uint8_t reserved[3];
+} __attribute__((__packed__));
+
+struct vlapic_mpconf {
+    uint8_t signature[4];
+    uint16_t length;
+    uint8_t version;
+    uint8_t checksum;
+    uint8_t product[20];
+    uint32_t oemtable;
+    uint16_t oemlength;
+    uint16_t entry;
+    uint32_t lapicaddr;
+    uint16_t xlength;
+    uint8_t xchecksum;
+    uint8_t reserved;
+} __attribute__((__packed__));
+
+struct vlapic_mpproc {
+    uint8_t type;
+    uint8_t apicid;
+    uint8_t version;
+    uint8_t flags;
+    uint8_t signature[4];
+    uint32_t feature;
+    uint8_t reserved[8];
+} __attribute__((__packed__));
+
+#define VLAPIC_MPPROC_EN    0x01
+#define VLAPIC_MPPROC_BOOT  0x02
+
+static uint8_t
+vlapic_sum(void *addr, int len) {
+    uint8_t sum = 0;
+    int i;
+
+    for (i = 0; i < len; i++)
+        sum += ((uint8_t *)addr)[i];
+    return sum;
+}
+
+/*
+ * Builds an MP floating pointer and configuration table describing the
+ * guest's vCPUs at VMX_MPTABLE_GPA, and points the BIOS data area's EBDA
+ * segment at it so the guest's mpsearch() finds it first.  A page from an
+ * earlier call is rebuilt in place; only the host's BIOS, which the EPT
+ * fault path maps there, is replaced.
+ */
+int
+vlapic_mptable(epte_t *eptrt, struct VmxGuestInfo *ginfo) {
+    struct vlapic_mp *mp;
+    struct vlapic_mpconf *conf;
+    struct vlapic_mpproc *proc;
+    struct Page *pp = NULL;
+    uint8_t *bda;
+    int i, r;
+
+    ept_gpa2hva(eptrt, (void *)VMX_MPTABLE_GPA, (void **)&mp);
+    if (mp && mp != KADDR(VMX_MPTABLE_GPA)) {
+        memset(mp, 0, PGSIZE);
+    } else {
+        if (!(pp = page_alloc(ALLOC_ZERO)))
+            return -E_NO_MEM;
+        pp->pp_ref++;
+        mp = page2kva(pp);
+    }
+    conf = (struct vlapic_mpconf *)(mp + 1);
+    proc = (struct vlapic_mpproc *)(conf + 1);
+
+    memcpy(conf->signature, "PCMP", 4);
+    conf->version = 4;
+    memcpy(conf->product, "JOS VMM", 7);
+    conf->entry = ginfo->nvcpus;
+    conf->lapicaddr = VMX_LAPIC_GPA;
+    conf->length = sizeof(*conf) + ginfo->nvcpus * sizeof(*proc);
+    for (i = 0; i < ginfo->nvcpus; i++) {
+        proc[i].apicid = i;
+        proc[i].version = VLAPIC_VERSION & 0xFF;
+        proc[i].flags = VLAPIC_MPPROC_EN | (i == 0 ? VLAPIC_MPPROC_BOOT : 0);
+    }
+    conf->checksum = -vlapic_sum(conf, conf->length);
+
+    memcpy(mp->signature, "_MP_", 4);
+    mp->physaddr = VMX_MPTABLE_GPA + sizeof(*mp);
+    mp->length = 1;
+    mp->specrev = 4;
+    mp->checksum = -vlapic_sum(mp, sizeof(*mp));
+
+    if (pp && (r = ept_map_hva2gpa(eptrt, mp, (void *)VMX_MPTABLE_GPA,
+                    __EPTE_FULL, 1)) < 0) {
+        page_decref(pp);
+        return r;
+    }
+
+    ept_gpa2hva(eptrt, (void *)0, (void **)&bda);
+    if (!bda) {
+        if (!(pp = page_alloc(ALLOC_ZERO)))
+            return -E_NO_MEM;
+        pp->pp_ref++;
+        bda = page2kva(pp);
+        if ((r = ept_map_hva2gpa(eptrt, bda, (void *)0, __EPTE_FULL, 0)) < 0) {
+            page_decref(pp);
+            return r;
+        }
+    }
+    *(uint16_t *)(bda + 0x40E) = VMX_MPTABLE_GPA >> 4;
+    return 0;
+}
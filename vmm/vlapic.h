@@ -0,0 +1,67 @@
+#ifndef JOS_VMM_VLAPIC_H
+#define JOS_VMM_VLAPIC_H
+
+#include <inc/types.h>
+#include <inc/vmx.h>
+#include <inc/env.h>
+#include <vmm/vmx.h>
+#include <vmm/ept.h>
+
+// Guest-physical address of the emulated local APIC (same as hardware).
+#define VMX_LAPIC_GPA   0xFEE00000
+// Where the guest's MP floating pointer and configuration table live.
+#define VMX_MPTABLE_GPA 0xF0000
+
+// Local APIC register offsets (see kern/lapic.c).
+#define VLAPIC_ID       0x020
+#define VLAPIC_VER      0x030
+#define VLAPIC_TPR      0x080
+#define VLAPIC_EOI      0x0B0
+#define VLAPIC_SVR      0x0F0
+#define VLAPIC_ESR      0x280
+#define VLAPIC_ICRLO    0x300
+#define VLAPIC_ICRHI    0x310
+#define VLAPIC_TIMER    0x320
+#define VLAPIC_PCINT    0x340
+#define VLAPIC_LINT0    0x350
+#define VLAPIC_LINT1    0x360
+#define VLAPIC_ERROR    0x370
+#define VLAPIC_TICR     0x380
+#define VLAPIC_TCCR     0x390
+#define VLAPIC_TDCR     0x3E0
+
+#define VLAPIC_VERSION          0x00050014  // 6 LVT entries, integrated APIC
+#define VLAPIC_SVR_ENABLE       0x00000100
+#define VLAPIC_LVT_MASKED       0x00010000
+#define VLAPIC_TIMER_PERIODIC   0x00020000
+#define VLAPIC_TDCR_MASK        0x0000000B
+
+// Timer counts per host tick at divide by 1.  Chosen so the count JOS
+// programs (10000000 at divide by 1) fires once per host tick.
+#define VLAPIC_TICK_COUNTS      10000000ULL
+
+// ICR low word fields.
+#define VLAPIC_ICR_VECTOR       0x000000FF
+#define VLAPIC_ICR_MODE         0x00000700
+#define VLAPIC_ICR_FIXED        0x00000000
+#define VLAPIC_ICR_INIT         0x00000500
+#define VLAPIC_ICR_STARTUP      0x00000600
+#define VLAPIC_ICR_DELIVS       0x00001000
+#define VLAPIC_ICR_ASSERT       0x00004000
+#define VLAPIC_ICR_LEVEL        0x00008000
+#define VLAPIC_ICR_DEST         0x000C0000
+#define VLAPIC_ICR_DEST_FIELD   0x00000000
+#define VLAPIC_ICR_DEST_SELF    0x00040000
+#define VLAPIC_ICR_DEST_ALL     0x00080000
+#define VLAPIC_ICR_DEST_OTHERS  0x000C0000
+
+static __inline bool vlapic_gpa( uint64_t gpa ) {
+    return gpa >= VMX_LAPIC_GPA && gpa < VMX_LAPIC_GPA + PGSIZE;
+}
+
+void vlapic_init( struct VmxGuestInfo *ginfo );
+bool vlapic_mmio( struct Env *e, struct vmx_exit_info *exit );
+void vlapic_tick( struct Env *e );
+int vlapic_mptable( epte_t *eptrt, struct VmxGuestInfo *ginfo );
+
+#endif
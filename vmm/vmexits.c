@@ -3,6 +3,12 @@
 #include <inc/error.h>
 #include <vmm/vmexits.h>
 #include <vmm/ept.h>
+#include <vmm/cpuid.h>
+#include <vmm/vlapic.h>
+#include <vmm/pvnet.h>
+#include <vmm/pvblk.h>
+#include <vmm/vswitch.h>
+#include <vmm/balloon.h>
 #include <inc/x86.h>
 #include <inc/assert.h>
 #include <kern/pmap.h>
@@ -14,88 +20,154 @@
 #include <kern/env.h>
 #include <kern/sched.h>
 #include <kern/e1000.h>
+#include <kern/time.h>
+#include <kern/spinlock.h>
 
 extern char *multiboot_info;
 
-bool
-find_msr_in_region(uint32_t msr_idx, uintptr_t *area, int area_sz, struct vmx_msr_entry **msr_entry) {
-    struct vmx_msr_entry *entry = (struct vmx_msr_entry *)area;
-    int i;
-    for(i=0; i<area_sz; ++i) {
-        if(entry->msr_index == msr_idx) {
-            *msr_entry = entry;
-            return true;
-        }
+/*
+ * Guest MSR emulation.
+ *
+ * vmx_msr_table[] is indexed by slot (see vmx_msr_slot()).  The first
+ * VMX_MSR_NAUTOLOAD slots are also the indices of the MSRs in the VM-entry
+ * load / VM-exit store area (msr_guest_area) and the VM-exit load area
+ * (msr_host_area) built by msr_setup(); TSC_AUX comes last so it can be left
+ * out on CPUs without RDTSCP.  FS/GS base live in the VMCS guest-state area
+ * instead.  MSRs whose rd_exit/wr_exit is false are cleared in the MSR bitmap
+ * and never exit; the handlers are still used if the bitmap is unavailable.
+ */
+static bool msr_area_read(struct VmxGuestInfo *ginfo, int slot, uint64_t *val);
+static bool msr_area_write(struct VmxGuestInfo *ginfo, int slot, uint64_t val,
+        struct vmx_exit_info *exit);
+static bool msr_efer_write(struct VmxGuestInfo *ginfo, int slot, uint64_t val,
+        struct vmx_exit_info *exit);
+static bool msr_vmcs_read(struct VmxGuestInfo *ginfo, int slot, uint64_t *val);
+static bool msr_vmcs_write(struct VmxGuestInfo *ginfo, int slot, uint64_t val,
+        struct vmx_exit_info *exit);
+
+const struct vmx_msr_desc vmx_msr_table[VMX_MSR_NSLOTS] = {
+    [VMX_MSR_EFER] = { EFER_MSR, 0, false, true,
+        msr_area_read, msr_efer_write },
+    // Reads exit only so that exitbench can time an RDMSR exit; nothing
+    // reads STAR often.
+    [VMX_MSR_STAR] = { STAR_MSR, 0, true, false,
+        msr_area_read, msr_area_write },
+    [VMX_MSR_LSTAR] = { LSTAR_MSR, 0, false, false,
+        msr_area_read, msr_area_write },
+    [VMX_MSR_KERNEL_GS_BASE] = { KERNEL_GS_BASE_MSR, 0, false, false,
+        msr_area_read, msr_area_write },
+    [VMX_MSR_TSC_AUX] = { TSC_AUX_MSR, 0, false, false,
+        msr_area_read, msr_area_write },
+    [VMX_MSR_FS_BASE] = { FS_BASE_MSR, VMCS_GUEST_FS_BASE, false, false,
+        msr_vmcs_read, msr_vmcs_write },
+    [VMX_MSR_GS_BASE] = { GS_BASE_MSR, VMCS_GUEST_GS_BASE, false, false,
+        msr_vmcs_read, msr_vmcs_write },
+};
+
+// Map an MSR index to its slot in vmx_msr_table[], -1 if not emulated.
+int
+vmx_msr_slot(uint32_t msr) {
+    switch(msr) {
+        case EFER_MSR:              return VMX_MSR_EFER;
+        case STAR_MSR:              return VMX_MSR_STAR;
+        case LSTAR_MSR:             return VMX_MSR_LSTAR;
+        case KERNEL_GS_BASE_MSR:    return VMX_MSR_KERNEL_GS_BASE;
+        case TSC_AUX_MSR:           return VMX_MSR_TSC_AUX;
+        case FS_BASE_MSR:           return VMX_MSR_FS_BASE;
+        case GS_BASE_MSR:           return VMX_MSR_GS_BASE;
     }
-    return false;
+    return -1;
 }
 
-bool
-handle_rdmsr(struct Trapframe *tf, struct VmxGuestInfo *ginfo) {
-    uint64_t msr = tf->tf_regs.reg_rcx;
-    if(msr == EFER_MSR) {
-        // TODO: setup msr_bitmap to ignore EFER_MSR
-        uint64_t val;
-        struct vmx_msr_entry *entry;
-        bool r = find_msr_in_region(msr, ginfo->msr_guest_area, ginfo->msr_count, &entry);
-        assert(r);
-        val = entry->msr_value;
-
-        tf->tf_regs.reg_rdx = val << 32;
-        tf->tf_regs.reg_rax = val & 0xFFFFFFFF;
-
-        tf->tf_rip += vmcs_read32(VMCS_32BIT_VMEXIT_INSTRUCTION_LENGTH);
-        return true;
+static bool
+msr_area_read(struct VmxGuestInfo *ginfo, int slot, uint64_t *val) {
+    if(slot >= ginfo->msr_count)
+        return false;
+    *val = ((struct vmx_msr_entry *)ginfo->msr_guest_area)[slot].msr_value;
+    return true;
+}
+
+static bool
+msr_area_write(struct VmxGuestInfo *ginfo, int slot, uint64_t val,
+        struct vmx_exit_info *exit) {
+    if(slot >= ginfo->msr_count)
+        return false;
+    ((struct vmx_msr_entry *)ginfo->msr_guest_area)[slot].msr_value = val;
+    return true;
+}
+
+static bool
+msr_efer_write(struct VmxGuestInfo *ginfo, int slot, uint64_t new_val,
+        struct vmx_exit_info *exit) {
+    uint64_t cur_val;
+
+    if(!msr_area_read(ginfo, slot, &cur_val))
+        return false;
+    if(BIT(cur_val, EFER_LME) == 0 && BIT(new_val, EFER_LME) == 1) {
+        // Long mode enable.
+        // Staged; written by vmx_exit_flush() before re-entry.
+        exit->entry_ctls = vmcs_read32( VMCS_32BIT_CONTROL_VMENTRY_CONTROLS );
+        exit->entry_ctls |= VMCS_VMENTRY_x64_GUEST;
+        exit->entry_ctls_dirty = true;
     }
+    return msr_area_write(ginfo, slot, new_val, exit);
+}
 
-    return false;
+static bool
+msr_vmcs_read(struct VmxGuestInfo *ginfo, int slot, uint64_t *val) {
+    *val = vmcs_read64(vmx_msr_table[slot].vmcs_field);
+    return true;
 }
 
-bool 
-handle_wrmsr(struct Trapframe *tf, struct VmxGuestInfo *ginfo) {
-    uint64_t msr = tf->tf_regs.reg_rcx;
-    if(msr == EFER_MSR) {
-
-        uint64_t cur_val, new_val;
-        struct vmx_msr_entry *entry;
-        bool r = 
-            find_msr_in_region(msr, ginfo->msr_guest_area, ginfo->msr_count, &entry);
-        assert(r);
-        cur_val = entry->msr_value;
-
-        new_val = (tf->tf_regs.reg_rdx << 32)|tf->tf_regs.reg_rax;
-        if(BIT(cur_val, EFER_LME) == 0 && BIT(new_val, EFER_LME) == 1) {
-            // Long mode enable.
-            uint32_t entry_ctls = vmcs_read32( VMCS_32BIT_CONTROL_VMENTRY_CONTROLS );
-            entry_ctls |= VMCS_VMENTRY_x64_GUEST;
-            vmcs_write32( VMCS_32BIT_CONTROL_VMENTRY_CONTROLS, 
-                    entry_ctls );
+static bool
+msr_vmcs_write(struct VmxGuestInfo *ginfo, int slot, uint64_t val,
+        struct vmx_exit_info *exit) {
+    vmcs_write64(vmx_msr_table[slot].vmcs_field, val);
+    return true;
+}
 
-        }
+bool
+handle_rdmsr(struct Trapframe *tf, struct VmxGuestInfo *ginfo, struct vmx_exit_info *exit) {
+    int slot = vmx_msr_slot(tf->tf_regs.reg_rcx);
+    uint64_t val;
 
-        entry->msr_value = new_val;
-        tf->tf_rip += vmcs_read32(VMCS_32BIT_VMEXIT_INSTRUCTION_LENGTH);
-        return true;
-    }
+    if(slot < 0 || !vmx_msr_table[slot].rdmsr(ginfo, slot, &val))
+        return false;
 
-    return false;
+    tf->tf_regs.reg_rdx = val >> 32;
+    tf->tf_regs.reg_rax = val & 0xFFFFFFFF;
+    tf->tf_rip += exit->instr_len;
+    return true;
+}
+
+bool 
+handle_wrmsr(struct Trapframe *tf, struct VmxGuestInfo *ginfo, struct vmx_exit_info *exit) {
+    int slot = vmx_msr_slot(tf->tf_regs.reg_rcx);
+    uint64_t val = (tf->tf_regs.reg_rdx << 32) | (tf->tf_regs.reg_rax & 0xFFFFFFFF);
+
+    if(slot < 0 || !vmx_msr_table[slot].wrmsr(ginfo, slot, val, exit))
+        return false;
+
+    tf->tf_rip += exit->instr_len;
+    return true;
 }
 
 bool
-handle_eptviolation(uint64_t *eptrt, struct VmxGuestInfo *ginfo) {
-    uint64_t gpa = vmcs_read64(VMCS_64BIT_GUEST_PHYSICAL_ADDR);
+handle_eptviolation(uint64_t *eptrt, struct VmxGuestInfo *ginfo, struct vmx_exit_info *exit) {
+    uint64_t gpa = exit->gpa;
     int r;
+
+    ginfo->ept_violations++;
 //    cprintf("EPT_VIO:0x%x::\n", gpa);
     if(gpa < 0xA0000 || (gpa >= 0x100000 && gpa < ginfo->phys_sz)) {
-        // Allocate a new page to the guest.
-        struct Page *p = page_alloc(0);
-        if(!p)
+        // Back the whole surrounding 2MB/1GB region at once if we can,
+        // else map the page and its unmapped neighbours.
+        if((r = ept_alloc_large(eptrt, (void *)gpa, ginfo)) < 0)
+            r = ept_fault_around(eptrt, gpa, ginfo);
+        if(r < 0)
             return false;
-        p->pp_ref += 1;
-        r = ept_map_hva2gpa(eptrt, 
-                page2kva(p), (void *)ROUNDDOWN(gpa, PGSIZE), __EPTE_FULL, 0);
-        assert(r >= 0);
-        /* cprintf("EPT violation for gpa:%x mapped KVA:%x\n", gpa, page2kva(p)); */
+        ginfo->ept_pages_mapped += r;
+        /* cprintf("EPT violation for gpa:%x mapped %d pages\n", gpa, r); */
         return true;
     } else if (gpa >= CGA_BUF && gpa < CGA_BUF + PGSIZE) {
         // FIXME: This give direct access to VGA MMIO region.
@@ -109,19 +181,16 @@ handle_eptviolation(uint64_t *eptrt, struct VmxGuestInfo *ginfo) {
 	r = ept_map_hva2gpa(eptrt, (void *)(KERNBASE + gpa), (void *)gpa, __EPTE_FULL, 0);
 	assert(r >= 0);
 	return true;
-    } else if (gpa >= 0xfee00000 ) {
-	r = ept_map_hva2gpa(eptrt, (void *)(KERNBASE + gpa), (void *)(gpa), __EPTE_FULL, 0);
-	assert(r >= 0);
-	return true;
-    }   
+    }
+    // The APIC page (VMX_LAPIC_GPA) is never mapped; see vmm/vlapic.c.
     return false;
 }
 
 bool
-handle_ioinstr(struct Trapframe *tf, struct VmxGuestInfo *ginfo) {
+handle_ioinstr(struct Trapframe *tf, struct VmxGuestInfo *ginfo, struct vmx_exit_info *exit) {
     static int port_iortc;
 
-    uint64_t qualification = vmcs_read64(VMCS_VMEXIT_QUALIFICATION);
+    uint64_t qualification = exit->qualification;
     int port_number = (qualification >> 16) & 0xFFFF;
     bool is_in = BIT(qualification, 3);
     bool handled = false;
@@ -147,12 +216,16 @@ handle_ioinstr(struct Trapframe *tf, struct VmxGuestInfo *ginfo) {
                 tf->tf_regs.reg_rax = (((ginfo->phys_sz / 1024) - 1024) >> 8) & 0xFF;
                 handled = true;
             }
+        } else {
+            // CMOS writes (the shutdown code set by lapic_startap()) are
+            // ignored; vCPUs are started by the emulated STARTUP IPI.
+            handled = true;
         }
 
     }
 
     if(handled) {
-        tf->tf_rip += vmcs_read32(VMCS_32BIT_VMEXIT_INSTRUCTION_LENGTH);
+        tf->tf_rip += exit->instr_len;
         return true;
     } else {
         cprintf("%x %x\n", qualification, port_iortc);
@@ -161,9 +234,8 @@ handle_ioinstr(struct Trapframe *tf, struct VmxGuestInfo *ginfo) {
 }
 
 // Emulate a cpuid instruction.
-// It is sufficient to issue the cpuid instruction here and collect the return value.
-// You can store the output of the instruction in Trapframe tf,
-//  but you should hide the presence of vmx from the guest if processor features are requested.
+// The values come from the guest's CPUID table (see vmm/cpuid.c), which
+// already hides the presence of vmx from the guest.
 // 
 // Return true if the exit is handled properly, false if the VM should be terminated.
 //
@@ -171,29 +243,51 @@ handle_ioinstr(struct Trapframe *tf, struct VmxGuestInfo *ginfo) {
 // 
 // Hint: The TA's solution does not hard-code the length of the cpuid instruction.
 bool
-handle_cpuid(struct Trapframe *tf, struct VmxGuestInfo *ginfo)
+handle_cpuid(struct Trapframe *tf, struct VmxGuestInfo *ginfo, struct vmx_exit_info *exit)
 {
     /* Your code here */
 //    cprintf("Handle cpuid not implemented\n"); 
-    uint32_t mask = 32;
-    uint32_t in_rax = (uint32_t) tf->tf_regs.reg_rax;
-    uint32_t eax, ebx, ecx, edx;
-    cpuid(in_rax, &eax, &ebx, &ecx, &edx );
-    if (in_rax == 1)
-    {
-	ecx = ecx & ~mask;
-    }
-    tf->tf_regs.reg_rax = (uint64_t)eax;
-    tf->tf_regs.reg_rbx = (uint64_t)ebx;
-    tf->tf_regs.reg_rcx = (uint64_t)ecx;
-    tf->tf_regs.reg_rdx = (uint64_t)edx;
+    uint32_t regs[4];
+
+    vmx_cpuid_lookup(ginfo, (uint32_t) tf->tf_regs.reg_rax,
+            (uint32_t) tf->tf_regs.reg_rcx, regs);
+    tf->tf_regs.reg_rax = (uint64_t)regs[VMX_CPUID_EAX];
+    tf->tf_regs.reg_rbx = (uint64_t)regs[VMX_CPUID_EBX];
+    tf->tf_regs.reg_rcx = (uint64_t)regs[VMX_CPUID_ECX];
+    tf->tf_regs.reg_rdx = (uint64_t)regs[VMX_CPUID_EDX];
 
-    tf->tf_rip += vmcs_read32(VMCS_32BIT_VMEXIT_INSTRUCTION_LENGTH);
+    tf->tf_rip += exit->instr_len;
 	    
    return true;
 
 }
 
+// Emulate hlt: block the guest until something is pending for it.
+// The guest is made ENV_NOT_RUNNABLE and woken by vmx_guest_wake() when a
+// virtual interrupt, an IPC or a packet arrives for it, or by
+// vmx_halt_poll() once VMX_HLT_TIMEOUT_MS have passed.
+bool
+handle_hlt(struct Trapframe *tf, struct VmxGuestInfo *ginfo, struct vmx_exit_info *exit)
+{
+    uint32_t intr_state;
+
+    tf->tf_rip += exit->instr_len;
+    // Skipping the hlt ends an sti interrupt shadow.
+    intr_state = vmcs_read32(VMCS_32BIT_GUEST_INTERRUPTIBILITY_STATE);
+    if(intr_state & VMX_INTR_BLOCK_STI)
+        vmcs_write32(VMCS_32BIT_GUEST_INTERRUPTIBILITY_STATE,
+                intr_state & ~VMX_INTR_BLOCK_STI);
+
+    ginfo->halt_count++;
+    if(vmx_irq_pending(ginfo) || vsw_guest_pending(curenv))
+        return true;
+    ginfo->halted = true;
+    vmx_halted_guests++;
+    ginfo->halt_deadline = time_msec() + VMX_HLT_TIMEOUT_MS;
+    curenv->env_status = ENV_NOT_RUNNABLE;
+    return true;
+}
+
 // Handle vmcall traps from the guest.
 // We currently support 3 traps: read the virtual e820 map, 
 //   and use host-level IPC (send andrecv).
@@ -204,8 +298,180 @@ handle_cpuid(struct Trapframe *tf, struct VmxGuestInfo *ginfo)
 // 
 // Hint: The TA's solution does not hard-code the length of the cpuid instruction.//
 
+/*
+ * Copies the multicall entry or ring request at src, which other vCPUs of
+ * the guest may be rewriting, to *mc.  Only the copy is checked and run.
+ */
+static void
+vmcall_batched_read(volatile struct vmx_multicall *src, struct vmx_multicall *mc)
+{
+    int i;
+
+    mc->nr = src->nr;
+    for (i = 0; i < 5; i++)
+	mc->args[i] = src->args[i];
+    mc->result = 0;
+}
+
+/*
+ * Runs the batched vmcall 'mc' (a host copy of a multicall entry or ring
+ * request) of the guest vCPU whose registers are 'tf', exactly as if the
+ * guest had issued it on its own, and returns its result.  Only calls that
+ * complete without leaving the host may be batched.
+ */
+static int64_t
+vmcall_batched(struct Trapframe *tf, struct VmxGuestInfo *gInfo, uint64_t *eptrt,
+	struct vmx_exit_info *exit, const struct vmx_multicall *mc)
+{
+    struct Trapframe call;
+
+    switch (mc->nr) {
+	case VMX_VMCALL_NOP:
+	case VMX_VMCALL_IPCSEND:
+	case VMX_VMCALL_NETSEND:
+	case VMX_VMCALL_NETRECV:
+	    call = *tf;
+	    call.tf_regs.reg_rax = mc->nr;
+	    call.tf_regs.reg_rdx = mc->args[0];
+	    call.tf_regs.reg_rcx = mc->args[1];
+	    call.tf_regs.reg_rbx = mc->args[2];
+	    call.tf_regs.reg_rdi = mc->args[3];
+	    call.tf_regs.reg_rsi = mc->args[4];
+	    if (handle_vmcall(&call, gInfo, eptrt, exit))
+		return (int64_t) call.tf_regs.reg_rax;
+	    return -E_INVAL;
+    }
+    // Blocking calls, MBMAP, the ring calls and nested batches.
+    return -E_INVAL;
+}
+
+/*
+ * Runs the VMX_VMCALL_MULTICALL batch described by tf, one entry at a time
+ * and in order.  Returns the number of entries run, or -E_INVAL for a bad
+ * batch.
+ */
+static int64_t
+handle_multicall(struct Trapframe *tf, struct VmxGuestInfo *gInfo, uint64_t *eptrt, struct vmx_exit_info *exit)
+{
+    uint64_t gpa = tf->tf_regs.reg_rdx;
+    uint64_t count = tf->tf_regs.reg_rcx;
+    uint64_t flags = tf->tf_regs.reg_rbx;
+    struct vmx_multicall *mc, req;
+    uint64_t i;
+    int64_t r;
+
+    if (count == 0)
+	return 0;
+    if (count > VMX_MULTICALL_MAX || PGOFF(gpa) + count * sizeof(*mc) > PGSIZE)
+	return -E_INVAL;
+    ept_gpa2hva(eptrt, (void *) gpa, (void **) &mc);
+    if (mc == NULL)
+	return -E_INVAL;
+
+    for (i = 0; i < count; i++) {
+	vmcall_batched_read(&mc[i], &req);
+	r = vmcall_batched(tf, gInfo, eptrt, exit, &req);
+	mc[i].result = r;
+	if (r < 0 && (flags & VMX_MULTICALL_STOP_ON_ERROR))
+	    return i + 1;
+    }
+    return count;
+}
+
+// The guest (BSP) that owns vCPU e's shared state.
+static struct Env *
+vmx_ring_owner(struct Env *e)
+{
+    return &envs[ENVX(e->env_vmxinfo.vcpu_bsp)];
+}
+
+/*
+ * Registers the request ring of e's guest at guest physical address gpa,
+ * which must be a page of guest RAM the guest has already touched, or
+ * unregisters it if gpa is 0.
+ */
+static int
+handle_ring_register(struct Env *e, uint64_t *eptrt, uint64_t gpa)
+{
+    struct Env *bsp = vmx_ring_owner(e);
+    struct vmx_ring *ring;
+
+    if (gpa == 0) {
+	bsp->env_vmxinfo.ring = NULL;
+	return 0;
+    }
+    if (PGOFF(gpa) || gpa >= bsp->env_vmxinfo.phys_sz)
+	return -E_INVAL;
+    ept_gpa2hva(eptrt, (void *) gpa, (void **) &ring);
+    if (ring == NULL)
+	return -E_INVAL;
+    // Registered from a running vCPU, which drains the ring as it exits.
+    ring->host_idle = bsp->env_vmxinfo.ring_running <= 0;
+    bsp->env_vmxinfo.ring = ring;
+    return 0;
+}
+
+/*
+ * Records that vCPU e is leaving the CPU (idle: halting, blocking or being
+ * descheduled) or being dispatched again, with the kernel lock held.  The
+ * guest is told to kick only while none of its vCPUs runs: otherwise their
+ * exits, the host timer's included, drain the ring.
+ */
+void
+vmx_ring_idle(struct Env *e, bool idle)
+{
+    struct Env *bsp = vmx_ring_owner(e);
+    struct vmx_ring *ring = bsp->env_vmxinfo.ring;
+
+    bsp->env_vmxinfo.ring_running += idle ? -1 : 1;
+    if (ring == NULL)
+	return;
+    ring->host_idle = bsp->env_vmxinfo.ring_running <= 0;
+    // Make the flag visible before the guest runs, or before the caller
+    // gives up the CPU and stops draining.
+    __sync_synchronize();
+}
+
+/*
+ * Runs the requests queued on the ring of e's guest, on behalf of its vCPU
+ * e, which has just exited.  Called on every exit that reaches vmexit(),
+ * with the kernel lock held, which also keeps the vCPUs of a guest from
+ * draining the ring at the same time.  At most VMX_RING_SIZE requests are
+ * run per exit, so a busy guest cannot keep the host here.
+ */
+void
+vmx_ring_service(struct Env *e, struct vmx_exit_info *exit)
+{
+    struct vmx_ring *ring = vmx_ring_owner(e)->env_vmxinfo.ring;
+    struct vmx_multicall *mc, req;
+    uint32_t cons, n;
+    int64_t r;
+
+    if (ring == NULL)
+	return;
+    cons = ring->cons;
+    if (ring->prod - cons > VMX_RING_SIZE) {
+	// Corrupt indices: drop whatever is queued.
+	ring->cons = ring->prod;
+	return;
+    }
+    for (n = 0; n < VMX_RING_SIZE && cons != ring->prod; n++, cons++) {
+	// Read the request only after seeing prod move past it.
+	__sync_synchronize();
+	mc = &ring->req[cons % VMX_RING_SIZE];
+	vmcall_batched_read(mc, &req);
+	r = vmcall_batched(&e->env_tf, &e->env_vmxinfo, e->env_pml4e, exit, &req);
+	mc->result = r;
+	if (r == -E_IPC_NOT_RECV || r == -E_TX_FULL)
+	    break;
+	// Publish the result before handing the slot back.
+	__sync_synchronize();
+	ring->cons = cons + 1;
+    }
+}
+
 bool
-handle_vmcall(struct Trapframe *tf, struct VmxGuestInfo *gInfo, uint64_t *eptrt)
+handle_vmcall(struct Trapframe *tf, struct VmxGuestInfo *gInfo, uint64_t *eptrt, struct vmx_exit_info *exit)
 {
     bool handled = false;
     multiboot_info_t mbinfo;
@@ -282,9 +548,18 @@ handle_vmcall(struct Trapframe *tf, struct VmxGuestInfo *gInfo, uint64_t *eptrt)
 		    memcpy((void *)host_va,(void *)& mbinfo, (size_t)sizeof(multiboot_info_t)); 
 		    memcpy(((void *)host_va + sizeof(multiboot_info_t)), (void *)tmp_arr,sizeof(tmp_arr));
 //	        }
+	    // Other vCPUs fault pages into the shared EPT without the kernel
+	    // lock; see vmexit_local().
+	    spin_lock(env_as_lock(curenv));
 	ept_map_hva2gpa((epte_t*) eptrt, (void *) host_va, (void *)multiboot_map_addr, __EPTE_FULL, 1);	
 	    tf->tf_regs.reg_rbx = (uint64_t) multiboot_map_addr;
 
+	    // The MP table describes the vCPUs created before the guest ran.
+	    r = vlapic_mptable((epte_t *) eptrt, gInfo);
+	    spin_unlock(env_as_lock(curenv));
+	    if (r < 0)
+		return false;
+
 //    cprintf("e820 map hypercall not implemented\n");	    
 	    handled = true;
 	    break;
@@ -325,13 +600,81 @@ handle_vmcall(struct Trapframe *tf, struct VmxGuestInfo *gInfo, uint64_t *eptrt)
 	    /* Your code here */
 
 //	    cprintf("ABHIROOP:%d:\n",__LINE__);
-    	    tf->tf_rip += vmcs_read32(VMCS_32BIT_VMEXIT_INSTRUCTION_LENGTH);  //cause it never returns
+    	    tf->tf_rip += exit->instr_len;  //cause it never returns
+	    // The VMCS may not be current when we are scheduled again.
+	    vmx_exit_flush(tf, exit);
+	    // The guest may not run again for a while; record the exit now.
+	    vmx_exit_account(curenv, exit);
+	    vmx_ring_idle(curenv, true);
 //	    cprintf("ABHIROOP:%d:\n",__LINE__);
 	    ret = syscall(SYS_ipc_recv, (uint64_t)tf->tf_regs.reg_rdx, (uint64_t)0, (uint64_t)0, (uint64_t)0,(uint64_t)0);
+	    vmx_ring_idle(curenv, false);
 // cprintf("IPC recv hypercall not implemented\n");	    
+	    // Only reached on error; rip has already been advanced.
 	    tf->tf_regs.reg_rax = (uint64_t)ret;
-            handled = true;
-            break;
+            return true;
+
+	case VMX_VMCALL_NOP:
+	    tf->tf_regs.reg_rax = 0;
+	    handled = true;
+	    break;
+
+	case VMX_VMCALL_MULTICALL:
+	    tf->tf_regs.reg_rax = (uint64_t) handle_multicall(tf, gInfo, eptrt, exit);
+	    handled = true;
+	    break;
+
+	case VMX_VMCALL_RING_REGISTER:
+	    tf->tf_regs.reg_rax = (uint64_t) handle_ring_register(curenv, eptrt, tf->tf_regs.reg_rdx);
+	    handled = true;
+	    break;
+
+	case VMX_VMCALL_RING_KICK:
+	    // vmexit() has already drained the ring; the exit was the point.
+	    tf->tf_regs.reg_rax = 0;
+	    handled = true;
+	    break;
+
+	case VMX_VMCALL_NET_SETUP:
+	    tf->tf_regs.reg_rax = (uint64_t) vmx_pvnet_setup(curenv, tf->tf_regs.reg_rdx, (int) tf->tf_regs.reg_rcx);
+	    handled = true;
+	    break;
+
+	case VMX_VMCALL_BALLOON:
+	    tf->tf_regs.reg_rax = (uint64_t) vmx_balloon(curenv,
+		    tf->tf_regs.reg_rbx, tf->tf_regs.reg_rdx, tf->tf_regs.reg_rcx);
+	    handled = true;
+	    break;
+
+	case VMX_VMCALL_NET_MAC:
+	    // Attach the guest to the virtual switch and return the MAC
+	    // address of its port, byte i in bits [8i, 8i + 8).
+	    if ((ret = vsw_guest_port(curenv)) < 0)
+		tf->tf_regs.reg_rax = (uint64_t) ret;
+	    else {
+		tf->tf_regs.reg_rax = 0;
+		for (len = 5; len >= 0; len--)
+		    tf->tf_regs.reg_rax = (tf->tf_regs.reg_rax << 8) | vsw_ports[ret].mac[len];
+	    }
+	    handled = true;
+	    break;
+
+	case VMX_VMCALL_NET_NOTIFY:
+	    // Like the ring kick, vmexit() has already sent what was posted.
+	    tf->tf_regs.reg_rax = 0;
+	    handled = true;
+	    break;
+
+	case VMX_VMCALL_BLK_SETUP:
+	    tf->tf_regs.reg_rax = (uint64_t) vmx_pvblk_setup(curenv, tf->tf_regs.reg_rdx);
+	    handled = true;
+	    break;
+
+	case VMX_VMCALL_BLK_NOTIFY:
+	    vmx_pvblk_notify(curenv);
+	    tf->tf_regs.reg_rax = 0;
+	    handled = true;
+	    break;
 
 	case VMX_VMCALL_NETSEND:
 	    // handles vmcalls for NW send requests from the guest
@@ -343,7 +686,12 @@ handle_vmcall(struct Trapframe *tf, struct VmxGuestInfo *gInfo, uint64_t *eptrt)
 //	    cprintf("LEN IS :%d:\n", tf->tf_regs.reg_rcx);
 	    ret = -1;
 //	    ret = syscall(SYS_net_try_send, (uint64_t) hva_net, (uint64_t)tf->tf_regs.reg_rcx, (uint64_t)0, (uint64_t)0,(uint64_t)0) ; 
-	    ret = e1000_transmit((char *) hva_net, len);
+	    // Through the guest's switch port.  The frame is copied: the
+	    // guest reuses its buffer as soon as the vmcall returns.
+	    if (!hva_net || len < 0 || PGOFF(gpa_net) + len > PGSIZE)
+		ret = -E_INVAL;
+	    else if ((ret = vsw_guest_port(curenv)) >= 0)
+		ret = vsw_transmit(ret, (char *) hva_net, len);
 	    tf->tf_regs.reg_rax = (uint64_t) ret;
 //	    cprintf("RET IS :%d:\n", ret);
 	    handled = true;
@@ -360,7 +708,11 @@ handle_vmcall(struct Trapframe *tf, struct VmxGuestInfo *gInfo, uint64_t *eptrt)
 //	    cprintf("RCV:LEN IS :%d:\n", tf->tf_regs.reg_rcx);
 	    // copying pkt 
 
-	   ret = (int) guest_rcv((char *) hva_net, &rcv_len, &rv_ret); //ret is the len of the pkt returned 
+	   // The next frame queued on the guest's switch port.
+	   rv_ret = -E_RCV_EMPTY;
+	   if (hva_net && (ret = vsw_guest_port(curenv)) >= 0 &&
+		   (rcv_len = vsw_receive(ret, (char *) hva_net)) > 0)
+	       rv_ret = 0;
 //	   cprintf("RET-ABHI- IN RCV VMEXIT IS:%d:\n", rv_ret);
 	   if (rv_ret == 0)
 	   {
@@ -389,7 +741,7 @@ handle_vmcall(struct Trapframe *tf, struct VmxGuestInfo *gInfo, uint64_t *eptrt)
 	     * Hint: The TA solution does not hard-code the length of the vmcall instruction.
 	     */
 	    /* Your code here */
-    		tf->tf_rip += vmcs_read32(VMCS_32BIT_VMEXIT_INSTRUCTION_LENGTH);
+    		tf->tf_rip += exit->instr_len;
     }
     return handled;
 }
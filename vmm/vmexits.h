@@ -1,10 +1,43 @@
 
 #include <inc/trap.h>
 
-bool handle_eptviolation(uint64_t *eptrt, struct VmxGuestInfo *ginfo);
-bool handle_rdmsr(struct Trapframe *tf, struct VmxGuestInfo *ginfo);
-bool handle_wrmsr(struct Trapframe *tf, struct VmxGuestInfo *ginfo);
-bool handle_ioinstr(struct Trapframe *tf, struct VmxGuestInfo *ginfo);
-bool handle_cpuid(struct Trapframe *tf, struct VmxGuestInfo *ginfo);
-bool handle_vmcall(struct Trapframe *tf, struct VmxGuestInfo *gInfo, uint64_t *eptrt );
+struct vmx_exit_info;
+struct Env;
+
+// Slots of the guest MSR emulation table.  The autoloaded MSRs come first,
+// in the order of the guest/host MSR areas.
+enum {
+    VMX_MSR_EFER = 0,
+    VMX_MSR_STAR,
+    VMX_MSR_LSTAR,
+    VMX_MSR_KERNEL_GS_BASE,
+    VMX_MSR_TSC_AUX,
+    VMX_MSR_NAUTOLOAD,
+    VMX_MSR_FS_BASE = VMX_MSR_NAUTOLOAD,
+    VMX_MSR_GS_BASE,
+    VMX_MSR_NSLOTS
+};
+
+struct vmx_msr_desc {
+    uint32_t msr;
+    uint32_t vmcs_field;        // Guest-state field holding it, if any.
+    bool rd_exit;               // Intercept reads in the MSR bitmap.
+    bool wr_exit;               // Intercept writes in the MSR bitmap.
+    bool (*rdmsr)(struct VmxGuestInfo *ginfo, int slot, uint64_t *val);
+    bool (*wrmsr)(struct VmxGuestInfo *ginfo, int slot, uint64_t val,
+            struct vmx_exit_info *exit);
+};
+
+extern const struct vmx_msr_desc vmx_msr_table[VMX_MSR_NSLOTS];
+int vmx_msr_slot(uint32_t msr);
+
+bool handle_eptviolation(uint64_t *eptrt, struct VmxGuestInfo *ginfo, struct vmx_exit_info *exit);
+bool handle_rdmsr(struct Trapframe *tf, struct VmxGuestInfo *ginfo, struct vmx_exit_info *exit);
+bool handle_wrmsr(struct Trapframe *tf, struct VmxGuestInfo *ginfo, struct vmx_exit_info *exit);
+bool handle_ioinstr(struct Trapframe *tf, struct VmxGuestInfo *ginfo, struct vmx_exit_info *exit);
+bool handle_cpuid(struct Trapframe *tf, struct VmxGuestInfo *ginfo, struct vmx_exit_info *exit);
+bool handle_hlt(struct Trapframe *tf, struct VmxGuestInfo *ginfo, struct vmx_exit_info *exit);
+bool handle_vmcall(struct Trapframe *tf, struct VmxGuestInfo *gInfo, uint64_t *eptrt, struct vmx_exit_info *exit);
+void vmx_ring_service(struct Env *e, struct vmx_exit_info *exit);
+void vmx_ring_idle(struct Env *e, bool idle);
 
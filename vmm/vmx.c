@@ -3,6 +3,10 @@
 #include <vmm/vmx_asm.h>
 #include <vmm/ept.h>
 #include <vmm/vmexits.h>
+#include <vmm/vlapic.h>
+#include <vmm/pvnet.h>
+#include <vmm/vswitch.h>
+#include <vmm/balloon.h>
 
 #include <inc/x86.h>
 #include <inc/error.h>
@@ -13,8 +17,11 @@
 #include <kern/sched.h>
 #include <kern/env.h>
 #include <kern/trap.h>
+#include <kern/spinlock.h>
 #include <kern/kclock.h>
 #include <kern/console.h>
+#include <kern/time.h>
+#include <kern/e1000.h>
 
 /* static uintptr_t *msr_bitmap; */
 
@@ -66,6 +73,136 @@ static inline bool vmx_check_ept() {
     }
 }
 
+/* The EPT and VPID capabilities (Appendix A.10 of the Intel manual).  The
+ * MSR is the same on every CPU, so it is read once.
+ */
+static uint64_t vmx_ept_vpid_cap() {
+    static uint64_t cap;
+    static bool read;
+
+    if ( !read ) {
+        cap = read_msr( IA32_VMX_EPT_VPID_CAP );
+        read = true;
+    }
+    return cap;
+}
+
+/* Checks that VPIDs can be enabled and invalidated, per guest with
+ * single-context INVVPID or else with all-context INVVPID.  See Appendix
+ * A.3.3 and A.10 of the Intel manual.
+ */
+static inline bool vmx_check_vpid() {
+    uint64_t cap = vmx_ept_vpid_cap();
+
+    return BIT( read_msr(IA32_VMX_PROCBASED_CTLS2), 37 ) == 1
+        && BIT( cap, 32 ) == 1                          // INVVPID supported.
+        && ( BIT( cap, 41 ) == 1 || BIT( cap, 42 ) == 1 );
+}
+
+bool vmx_vpid_enable = true;
+
+/*
+ * Returns the VPID to use for the guest e, or 0 to run it untagged.
+ * VPID 0 is reserved for the host, so the env index is offset by one; an
+ * env slot is only ever used by one live guest.
+ */
+uint16_t
+vmx_alloc_vpid( struct Env *e ) {
+    if ( !vmx_vpid_enable || !vmx_check_support() || !vmx_check_vpid() )
+        return 0;
+    return (uint16_t) ( ( e - envs ) + 1 );
+}
+
+/*
+ * Drops this CPU's TLB entries tagged with the VPID of e; those of every
+ * VPID if the CPU has no single-context INVVPID.
+ */
+void
+vmx_invvpid( struct Env *e ) {
+    if ( e->env_vmxinfo.vpid == 0 || !thiscpu->is_vmx_root )
+        return;
+    if ( BIT( vmx_ept_vpid_cap(), 41 ) )
+        invvpid( VMX_INVVPID_SINGLE_CONTEXT, e->env_vmxinfo.vpid, 0 );
+    else
+        invvpid( VMX_INVVPID_ALL_CONTEXT, 0, 0 );
+}
+
+/*
+ * Drops this CPU's cached translations derived from the EPT rooted at
+ * eptrt; those of every EPT if the CPU has no single-context INVEPT.
+ * Needed whenever a present EPT entry is changed.
+ */
+void
+vmx_invept( uint64_t *eptrt ) {
+    if ( !thiscpu->is_vmx_root || !BIT( vmx_ept_vpid_cap(), 20 ) )
+        return;
+    if ( BIT( vmx_ept_vpid_cap(), 25 ) )
+        invept( VMX_INVEPT_SINGLE_CONTEXT,
+                PADDR(eptrt) | ( ( EPT_LEVELS - 1 ) << 3 ) );
+    else
+        invept( VMX_INVEPT_ALL_CONTEXT, 0 );
+}
+
+volatile uint64_t vmx_ept_gen;
+
+/*
+ * Starts a new EPT generation after entries were removed from an EPT whose
+ * vCPUs may be running on other CPUs, and flushes this CPU.  Returns the
+ * new generation, for vmx_ept_synced().
+ */
+uint64_t
+vmx_ept_bump( void ) {
+    uint64_t gen = __sync_add_and_fetch( &vmx_ept_gen, 1 );
+
+    vmx_ept_sync();
+    return gen;
+}
+
+/*
+ * Drops all of this CPU's EPT-derived translations if it has not done so
+ * since the last vmx_ept_bump().  Called before every VM entry.  Without
+ * all-context INVEPT each vCPU instead flushes its own EPT before it next
+ * runs, which is all a CPU running it can still be using.
+ */
+void
+vmx_ept_sync( void ) {
+    uint64_t gen = vmx_ept_gen;
+    struct Env *e = curenv;
+
+    if ( !thiscpu->is_vmx_root )
+        return;
+    if ( BIT( vmx_ept_vpid_cap(), 26 ) ) {
+        if ( thiscpu->ept_gen != gen )
+            invept( VMX_INVEPT_ALL_CONTEXT, 0 );
+    } else {
+        if ( !e || e->env_type != ENV_TYPE_GUEST )
+            return;
+        if ( e->env_vmxinfo.ept_gen != gen )
+            vmx_invept( e->env_pml4e );
+        e->env_vmxinfo.ept_gen = gen;
+    }
+    thiscpu->ept_gen = gen;
+}
+
+/*
+ * Have all CPUs that may be running a guest flushed EPT generation gen?
+ * The others flush before they enter one.  Called with the kernel lock
+ * held, so no CPU starts running a guest meanwhile.
+ */
+bool
+vmx_ept_synced( uint64_t gen ) {
+    struct Env *e;
+    int i;
+
+    for ( i = 0; i < ncpu; i++ ) {
+        e = cpus[i].cpu_env;
+        if ( e && e->env_type == ENV_TYPE_GUEST &&
+                (int64_t) ( cpus[i].ept_gen - gen ) < 0 )
+            return false;
+    }
+    return true;
+}
+
 /* Checks if curr_val is compatible with fixed0 and fixed1 
 * (allowed values read from the MSR). This is to ensure current processor
 * operating mode meets the required fixed bit requirement of VMX.  
@@ -280,6 +417,9 @@ void vmx_read_capability_msr( uint32_t msr, uint32_t* hi, uint32_t* lo ) {
     *lo = (uint32_t)( msr_val );
 }
 
+// Preemption timer rate from IA32_VMX_MISC, read in vmcs_ctls_init().
+static uint8_t vmx_preempt_rate;
+
 static void 
 vmcs_ctls_init( struct Env* e ) {
     // Set pin based vm exec controls.
@@ -287,6 +427,15 @@ vmcs_ctls_init( struct Env* e ) {
     vmx_read_capability_msr( IA32_VMX_PINBASED_CTLS, 
             &pinbased_ctls_and, &pinbased_ctls_or );
 
+    // Enforce the guest's time slice with the VMX-preemption timer.
+    e->env_vmxinfo.preempt_timer =
+        pinbased_ctls_and & VMCS_PIN_BASED_VMEXEC_CTL_PREEMPT_TIMER;
+    if ( e->env_vmxinfo.preempt_timer ) {
+        pinbased_ctls_or |= VMCS_PIN_BASED_VMEXEC_CTL_PREEMPT_TIMER;
+        vmx_preempt_rate = read_msr( IA32_VMX_MISC ) & VMX_MISC_PREEMPT_RATE_MASK;
+    }
+    // Host interrupts exit to the host instead of going to the guest IDT.
+    pinbased_ctls_or |= VMCS_PIN_BASED_VMEXEC_CTL_EXINTEXIT;
     vmcs_write32( VMCS_32BIT_CONTROL_PIN_BASED_EXEC_CONTROLS, 
             pinbased_ctls_or & pinbased_ctls_and );
 
@@ -300,14 +449,16 @@ vmcs_ctls_init( struct Env* e ) {
     procbased_ctls_or |= VMCS_PROC_BASED_VMEXEC_CTL_ACTIVESECCTL; 
     procbased_ctls_or |= VMCS_PROC_BASED_VMEXEC_CTL_HLTEXIT;
     procbased_ctls_or |= VMCS_PROC_BASED_VMEXEC_CTL_USEIOBMP;
+    procbased_ctls_or |= VMCS_PROC_BASED_VMEXEC_CTL_USEMSRBMP;
     /* CR3 accesses and invlpg don't need to cause VM Exits when EPT
        enabled */
     procbased_ctls_or &= ~( VMCS_PROC_BASED_VMEXEC_CTL_CR3LOADEXIT |
             VMCS_PROC_BASED_VMEXEC_CTL_CR3STOREXIT | 
             VMCS_PROC_BASED_VMEXEC_CTL_INVLPGEXIT );
 
+    e->env_vmxinfo.procbased_ctls = procbased_ctls_or & procbased_ctls_and;
     vmcs_write32( VMCS_32BIT_CONTROL_PROCESSOR_BASED_VMEXEC_CONTROLS, 
-            procbased_ctls_or & procbased_ctls_and );
+            e->env_vmxinfo.procbased_ctls );
 
     // Set Proc based secondary controls.
     uint32_t procbased_ctls2_or, procbased_ctls2_and;
@@ -317,6 +468,10 @@ vmcs_ctls_init( struct Env* e ) {
     // Enable EPT.
     procbased_ctls2_or |= VMCS_SECONDARY_VMEXEC_CTL_ENABLE_EPT;
     procbased_ctls2_or |= VMCS_SECONDARY_VMEXEC_CTL_UNRESTRICTED_GUEST;
+    if ( e->env_vmxinfo.vpid ) {
+        procbased_ctls2_or |= VMCS_SECONDARY_VMEXEC_CTL_ENABLE_VPID;
+        vmcs_write16( VMCS_16BIT_CONTROL_VPID, e->env_vmxinfo.vpid );
+    }
     vmcs_write32( VMCS_32BIT_CONTROL_SECONDARY_VMEXEC_CONTROLS, 
             procbased_ctls2_or & procbased_ctls2_and );
 
@@ -326,6 +481,13 @@ vmcs_ctls_init( struct Env* e ) {
             &exit_ctls_and, &exit_ctls_or );
 
     exit_ctls_or |= VMCS_VMEXIT_HOST_ADDR_SIZE;
+    // Read the vector from the exit info instead of taking the interrupt
+    // again through the host IDT.
+    exit_ctls_or |= VMCS_VMEXIT_ACK_INTR;
+    e->env_vmxinfo.preempt_save = e->env_vmxinfo.preempt_timer &&
+        ( exit_ctls_and & VMCS_VMEXIT_SAVE_PREEMPT_TIMER );
+    if ( e->env_vmxinfo.preempt_save )
+        exit_ctls_or |= VMCS_VMEXIT_SAVE_PREEMPT_TIMER;
     vmcs_write32( VMCS_32BIT_CONTROL_VMEXIT_CONTROLS, 
             exit_ctls_or & exit_ctls_and );
 
@@ -360,6 +522,8 @@ vmcs_ctls_init( struct Env* e ) {
             PADDR(e->env_vmxinfo.io_bmap_a));
     vmcs_write64( VMCS_64BIT_CONTROL_IO_BITMAP_B,
             PADDR(e->env_vmxinfo.io_bmap_b));
+    vmcs_write64( VMCS_64BIT_CONTROL_MSR_BITMAPS,
+            PADDR(e->env_vmxinfo.msr_bitmap));
 
 }
 
@@ -379,10 +543,381 @@ void vmcs_dump_cpu() {
 
 }
 
-void vmexit() {
-    int exit_reason = -1;
-    bool exit_handled = false;
-    exit_reason = vmcs_read32(VMCS_32BIT_VMEXIT_REASON);
+/*
+ * Exits that are handled entirely from VMCS/guest state and never block or
+ * touch another environment.  These may be resumed in place.
+ */
+static inline bool vmexit_is_fast(struct vmx_exit_info *exit) {
+    switch(exit->reason) {
+        case EXIT_REASON_EPT_VIOLATION:
+            return vlapic_gpa(exit->gpa);
+        case EXIT_REASON_EXTERNAL_INT:
+        case EXIT_REASON_CPUID:
+        case EXIT_REASON_RDMSR:
+        case EXIT_REASON_WRMSR:
+        case EXIT_REASON_IO_INSTRUCTION:
+        case EXIT_REASON_INTERRUPT_WINDOW:
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Reads the exit fields that are valid for this exit reason, once, and
+ * the guest RIP into tf, where the handlers advance it.
+ */
+static void
+vmx_read_exit_info(struct Trapframe *tf, struct vmx_exit_info *exit) {
+    memset(exit, 0, sizeof(*exit));
+    exit->reason = vmcs_read32(VMCS_32BIT_VMEXIT_REASON) & EXIT_REASON_MASK;
+    exit->rip = vmcs_read64(VMCS_GUEST_RIP);
+    tf->tf_rip = exit->rip;
+
+    switch(exit->reason) {
+        case EXIT_REASON_EPT_VIOLATION:
+        case EXIT_REASON_EPT_MISCONFIG:
+            exit->gpa = vmcs_read64(VMCS_64BIT_GUEST_PHYSICAL_ADDR);
+            exit->qualification = vmcs_read64(VMCS_VMEXIT_QUALIFICATION);
+            break;
+        case EXIT_REASON_IO_INSTRUCTION:
+            exit->qualification = vmcs_read64(VMCS_VMEXIT_QUALIFICATION);
+            exit->instr_len = vmcs_read32(VMCS_32BIT_VMEXIT_INSTRUCTION_LENGTH);
+            break;
+        case EXIT_REASON_CPUID:
+        case EXIT_REASON_RDMSR:
+        case EXIT_REASON_WRMSR:
+        case EXIT_REASON_VMCALL:
+        case EXIT_REASON_HLT:
+            exit->instr_len = vmcs_read32(VMCS_32BIT_VMEXIT_INSTRUCTION_LENGTH);
+            break;
+        case EXIT_REASON_EXCEPTION_OR_NMI:
+        case EXIT_REASON_EXTERNAL_INT:
+            exit->intr_info = vmcs_read32(VMCS_32BIT_VMEXIT_INTERRUPTION_INFO);
+            break;
+    }
+}
+
+/*
+ * Writes back the VMCS state staged by the exit handlers.  The VMCS of the
+ * exiting guest must still be current.
+ */
+void
+vmx_exit_flush(struct Trapframe *tf, struct vmx_exit_info *exit) {
+    if(tf->tf_rip != exit->rip) {
+        vmcs_write64(VMCS_GUEST_RIP, tf->tf_rip);
+        exit->rip = tf->tf_rip;
+    }
+    if(exit->entry_ctls_dirty) {
+        vmcs_write32(VMCS_32BIT_CONTROL_VMENTRY_CONTROLS, exit->entry_ctls);
+        exit->entry_ctls_dirty = false;
+    }
+}
+
+int vmx_halted_guests;
+
+/*
+ * Makes a guest blocked in HLT runnable again.  reason is one of VMX_WAKE_*.
+ * Guests that are not halted (running, or blocked in an IPC receive) are
+ * left alone.
+ */
+void
+vmx_guest_wake(struct Env *e, int reason) {
+    if(e->env_type != ENV_TYPE_GUEST || !e->env_vmxinfo.halted)
+        return;
+    e->env_vmxinfo.halted = false;
+    vmx_halted_guests--;
+    e->env_vmxinfo.wake_reason = reason;
+    sched_wakeup(e);
+}
+
+/*
+ * Queues external interrupt 'vector' for guest e.  It is injected on the
+ * first VM entry at which the guest can take it; a halted guest is woken.
+ * Vectors below 32 are exceptions and are rejected.
+ */
+int
+vmx_inject_irq(struct Env *e, int vector) {
+    if(e->env_type != ENV_TYPE_GUEST)
+        return -E_BAD_ENV;
+    if(vector < 32 || vector > 255)
+        return -E_INVAL;
+    // The vCPU may be running on another CPU, without the kernel lock.
+    __sync_fetch_and_or(&e->env_vmxinfo.irq_pending[vector / 64],
+            1ULL << (vector % 64));
+    vmx_guest_wake(e, VMX_WAKE_IRQ);
+    return 0;
+}
+
+/*
+ * Sets the time slice of guest e, in TSC cycles; 0 selects the default.
+ * Takes effect the next time the guest is dispatched.
+ */
+int
+vmx_set_quantum(struct Env *e, uint64_t cycles) {
+    if(e->env_type != ENV_TYPE_GUEST)
+        return -E_BAD_ENV;
+    e->env_vmxinfo.quantum = cycles ? cycles : VMX_GUEST_QUANTUM_DEFAULT;
+    return 0;
+}
+
+/*
+ * Loads the preemption timer with what is left of the current slice.
+ */
+static void
+vmx_arm_preempt_timer(struct VmxGuestInfo *ginfo) {
+    uint64_t used = read_tsc() - ginfo->slice_start;
+    uint64_t left = used < ginfo->quantum ? ginfo->quantum - used : 0;
+
+    left >>= vmx_preempt_rate;
+    if(left > 0xFFFFFFFF)
+        left = 0xFFFFFFFF;
+    vmcs_write32(VMCS_32BIT_GUEST_PREEMPTION_TIMER_VALUE, left);
+}
+
+static void
+vmx_set_intr_window(struct VmxGuestInfo *ginfo, bool on) {
+    uint32_t ctls = ginfo->procbased_ctls;
+
+    if(on)
+        ctls |= VMCS_PROC_BASED_VMEXEC_CTL_INTRWINEXIT;
+    else
+        ctls &= ~VMCS_PROC_BASED_VMEXEC_CTL_INTRWINEXIT;
+    if(ctls != ginfo->procbased_ctls) {
+        vmcs_write32(VMCS_32BIT_CONTROL_PROCESSOR_BASED_VMEXEC_CONTROLS, ctls);
+        ginfo->procbased_ctls = ctls;
+    }
+}
+
+/*
+ * Runs right before every VM entry.  Injects the highest pending vector if
+ * the guest can take an interrupt now; otherwise turns on interrupt-window
+ * exiting so we get control back as soon as it can.
+ */
+static void
+vmx_irq_deliver(struct VmxGuestInfo *ginfo) {
+    int i, vector;
+
+    if(!vmx_irq_pending(ginfo)) {
+        vmx_set_intr_window(ginfo, false);
+        return;
+    }
+    if(!(vmcs_read64(VMCS_GUEST_RFLAGS) & FL_IF) ||
+            (vmcs_read32(VMCS_32BIT_GUEST_INTERRUPTIBILITY_STATE) &
+             (VMX_INTR_BLOCK_STI | VMX_INTR_BLOCK_MOV_SS))) {
+        vmx_set_intr_window(ginfo, true);
+        return;
+    }
+    for(i = 3; !ginfo->irq_pending[i]; i--)
+        ;
+    vector = i * 64 + 63 - __builtin_clzll(ginfo->irq_pending[i]);
+    __sync_fetch_and_and(&ginfo->irq_pending[i], ~(1ULL << (vector % 64)));
+    vmcs_write32(VMCS_32BIT_CONTROL_VMENTRY_INTERRUPTION_INFO,
+            VMX_INTR_INFO_VALID | VMX_INTR_TYPE_EXT_INTR | vector);
+    ginfo->irq_injecting = vector;
+    ginfo->irqs_injected++;
+    vmx_set_intr_window(ginfo, vmx_irq_pending(ginfo));
+}
+
+/*
+ * Runs after every VM exit.  If the exit interrupted the delivery of the
+ * vector we injected (e.g. an EPT violation on the guest IDT or stack),
+ * queue it again so the next entry retries it.
+ */
+static void
+vmx_irq_requeue(struct VmxGuestInfo *ginfo) {
+    uint32_t info;
+
+    if(!ginfo->irq_injecting)
+        return;
+    info = vmcs_read32(VMCS_32BIT_IDT_VECTORING_INFO);
+    if((info & VMX_INTR_INFO_VALID) &&
+            (info & VMX_INTR_INFO_TYPE_MASK) == VMX_INTR_TYPE_EXT_INTR) {
+        info &= VMX_INTR_INFO_VECTOR_MASK;
+        __sync_fetch_and_or(&ginfo->irq_pending[info / 64], 1ULL << (info % 64));
+    }
+    ginfo->irq_injecting = 0;
+}
+
+/*
+ * Wakes halted guests whose deadline has passed.  Packets wake their
+ * guest from the virtual switch when they are delivered.
+ */
+void
+vmx_halt_poll(void) {
+    unsigned int now = time_msec();
+    int i;
+
+    for(i = 0; i < NENV; i++) {
+        if(envs[i].env_type != ENV_TYPE_GUEST || !envs[i].env_vmxinfo.halted)
+            continue;
+        if((int)(now - envs[i].env_vmxinfo.halt_deadline) >= 0)
+            vmx_guest_wake(&envs[i], VMX_WAKE_TIMER);
+    }
+}
+
+/*
+ * Called on every host timer tick: runs the guests' virtual APIC timers,
+ * switches frames that arrived from the wire, frees ballooned pages and
+ * wakes halted guests.
+ */
+void
+vmx_guest_tick(void) {
+    int i;
+
+    for(i = 0; i < NENV; i++) {
+        if(envs[i].env_type == ENV_TYPE_GUEST && envs[i].env_status != ENV_FREE)
+            vlapic_tick(&envs[i]);
+    }
+    vsw_poll();
+    vmx_balloon_reap();
+    vmx_halt_poll();
+}
+
+static void
+vmx_exit_stat_add(struct vmx_exit_stat *st, uint64_t cycles) {
+    int b = cycles ? 63 - __builtin_clzll(cycles) : 0;
+
+    if(!st->count || cycles < st->min)
+        st->min = cycles;
+    if(cycles > st->max)
+        st->max = cycles;
+    st->count++;
+    st->cycles += cycles;
+    st->hist[b < VMX_EXIT_HIST_BUCKETS ? b : VMX_EXIT_HIST_BUCKETS - 1]++;
+}
+
+/*
+ * Records the host time spent on exit, from the exit until now, in e's exit
+ * statistics.  Each vCPU has its own, so this needs no lock.  Handlers that
+ * give up the CPU (an IPC receive, a destroyed guest) call it before they
+ * do; an exit is recorded only once.
+ */
+void
+vmx_exit_account(struct Env *e, struct vmx_exit_info *exit) {
+    struct vmx_exit_stats *s = e->env_vmxinfo.exit_stats;
+    uint64_t cycles = read_tsc() - exit->tsc;
+
+    if(exit->accounted)
+        return;
+    exit->accounted = true;
+
+    if(exit->reason < VMX_EXIT_REASONS)
+        vmx_exit_stat_add(&s->reason[exit->reason], cycles);
+    if(exit->reason == EXIT_REASON_VMCALL && exit->vmcall < VMX_VMCALLS)
+        vmx_exit_stat_add(&s->vmcall[exit->vmcall], cycles);
+}
+
+static void
+vmx_exit_stat_merge(struct vmx_exit_stat *to, struct vmx_exit_stat *from) {
+    int i;
+
+    if(!from->count)
+        return;
+    if(!to->count || from->min < to->min)
+        to->min = from->min;
+    if(from->max > to->max)
+        to->max = from->max;
+    to->count += from->count;
+    to->cycles += from->cycles;
+    for(i = 0; i < VMX_EXIT_HIST_BUCKETS; i++)
+        to->hist[i] += from->hist[i];
+}
+
+/*
+ * Sums the exit statistics of all vCPUs of the guest that e belongs to.
+ */
+void
+vmx_exit_stats_sum(struct Env *e, struct vmx_exit_stats *out) {
+    struct Env *bsp = e, *v;
+    int i, j;
+
+    memset(out, 0, sizeof(*out));
+    if(e->env_vmxinfo.vcpu_id && envid2env(e->env_vmxinfo.vcpu_bsp, &bsp, 0) < 0)
+        bsp = e;
+    for(i = 0; i < VMX_MAX_VCPUS; i++) {
+        if(i == 0)
+            v = bsp;
+        else if(i >= bsp->env_vmxinfo.nvcpus || !bsp->env_vmxinfo.vcpus[i] ||
+                envid2env(bsp->env_vmxinfo.vcpus[i], &v, 0) < 0)
+            continue;
+        for(j = 0; j < VMX_EXIT_REASONS; j++)
+            vmx_exit_stat_merge(&out->reason[j], &v->env_vmxinfo.exit_stats->reason[j]);
+        for(j = 0; j < VMX_VMCALLS; j++)
+            vmx_exit_stat_merge(&out->vmcall[j], &v->env_vmxinfo.exit_stats->vmcall[j]);
+    }
+}
+
+// Names of the exit reasons guests commonly take, for the monitor.
+const char *
+vmx_exit_reason_name(int reason) {
+    static const char * const names[VMX_EXIT_REASONS] = {
+        [EXIT_REASON_EXCEPTION_OR_NMI] = "exception",
+        [EXIT_REASON_EXTERNAL_INT] = "external-int",
+        [EXIT_REASON_TRIPLE_FAULT] = "triple-fault",
+        [EXIT_REASON_INTERRUPT_WINDOW] = "int-window",
+        [EXIT_REASON_CPUID] = "cpuid",
+        [EXIT_REASON_HLT] = "hlt",
+        [EXIT_REASON_VMCALL] = "vmcall",
+        [EXIT_REASON_MOV_CR] = "mov-cr",
+        [EXIT_REASON_IO_INSTRUCTION] = "io",
+        [EXIT_REASON_RDMSR] = "rdmsr",
+        [EXIT_REASON_WRMSR] = "wrmsr",
+        [EXIT_REASON_EPT_VIOLATION] = "ept-violation",
+        [EXIT_REASON_EPT_MISCONFIG] = "ept-misconfig",
+        [EXIT_REASON_VMX_PREEMPT_TIMER] = "preempt-timer",
+    };
+
+    if(reason < 0 || reason >= VMX_EXIT_REASONS)
+        return NULL;
+    return names[reason];
+}
+
+/*
+ * Handles exits that only touch the exiting vCPU's own state: its VMCS,
+ * CPUID and MSR tables, and its guest's EPT under the address space lock.
+ * Called without the kernel lock.  Returns false if the exit must take the
+ * slow path, vmexit(); a handler that fails also goes there, which runs it
+ * again and reports the failure.
+ */
+static bool
+vmexit_local(struct Env *e, struct vmx_exit_info *exit) {
+    bool handled = false;
+
+    switch(exit->reason) {
+        case EXIT_REASON_CPUID:
+            handled = handle_cpuid(&e->env_tf, &e->env_vmxinfo, exit);
+            break;
+        case EXIT_REASON_RDMSR:
+            handled = handle_rdmsr(&e->env_tf, &e->env_vmxinfo, exit);
+            break;
+        case EXIT_REASON_WRMSR:
+            handled = handle_wrmsr(&e->env_tf, &e->env_vmxinfo, exit);
+            break;
+        case EXIT_REASON_EPT_VIOLATION:
+            // The virtual APIC can signal other vCPUs.
+            if(vlapic_gpa(exit->gpa))
+                return false;
+            spin_lock(env_as_lock(e));
+            handled = handle_eptviolation(e->env_pml4e, &e->env_vmxinfo, exit);
+            spin_unlock(env_as_lock(e));
+            break;
+        case EXIT_REASON_INTERRUPT_WINDOW:
+            handled = true;
+            break;
+    }
+    if(handled)
+        vmx_exit_flush(&e->env_tf, exit);
+    return handled;
+}
+
+/*
+ * Handles VM exit 'exit' of curenv, with the kernel lock held.  Returns true
+ * if the guest can be resumed in place by the caller; otherwise it gives up
+ * the CPU through sched_yield() and does not return.
+ */
+bool vmexit(struct vmx_exit_info *exit) {
+    int exit_reason = exit->reason;
+    bool exit_handled = false, yield = false;
 
 //    cprintf( "---VMEXIT Reason: %d : %16x---\n", exit_reason, exit_reason & EXIT_REASON_MASK );
     // Get the reason for VMEXIT from the VMCS.
@@ -390,42 +925,78 @@ void vmexit() {
 
     /* cprintf( "---VMEXIT Reason: %d---\n", exit_reason ); */
     /* vmcs_dump_cpu(); */
+
+    // Any exit to here, the timer's included, drains the guest's request
+    // ring and sends what it posted to its paravirtual NIC; see struct
+    // vmx_ring and struct vmx_pvnet_ring.
+    vmx_ring_service(curenv, exit);
+    vmx_pvnet_tx(curenv);
  
-    switch(exit_reason & EXIT_REASON_MASK) {
+    switch(exit_reason) {
         case EXIT_REASON_RDMSR:
-            exit_handled = handle_rdmsr(&curenv->env_tf, &curenv->env_vmxinfo);
+            exit_handled = handle_rdmsr(&curenv->env_tf, &curenv->env_vmxinfo, exit);
             break;
         case EXIT_REASON_WRMSR:
-            exit_handled = handle_wrmsr(&curenv->env_tf, &curenv->env_vmxinfo);
+            exit_handled = handle_wrmsr(&curenv->env_tf, &curenv->env_vmxinfo, exit);
             break;
         case EXIT_REASON_EPT_VIOLATION:
-            exit_handled = handle_eptviolation(curenv->env_pml4e, &curenv->env_vmxinfo);
+            if(vlapic_gpa(exit->gpa)) {
+                exit_handled = vlapic_mmio(curenv, exit);
+                break;
+            }
+            // Other vCPUs of the guest fault into the EPT without the
+            // kernel lock.
+            spin_lock(env_as_lock(curenv));
+            exit_handled = handle_eptviolation(curenv->env_pml4e, &curenv->env_vmxinfo, exit);
+            spin_unlock(env_as_lock(curenv));
             break;
         case EXIT_REASON_IO_INSTRUCTION:
-            exit_handled = handle_ioinstr(&curenv->env_tf, &curenv->env_vmxinfo);
+            exit_handled = handle_ioinstr(&curenv->env_tf, &curenv->env_vmxinfo, exit);
             break;
         case EXIT_REASON_CPUID:
-            exit_handled = handle_cpuid(&curenv->env_tf, &curenv->env_vmxinfo);
+            exit_handled = handle_cpuid(&curenv->env_tf, &curenv->env_vmxinfo, exit);
             break;
         case EXIT_REASON_VMCALL:
+            exit->vmcall = curenv->env_tf.tf_regs.reg_rax;
             exit_handled = handle_vmcall(&curenv->env_tf, &curenv->env_vmxinfo,
-                    curenv->env_pml4e);
+                    curenv->env_pml4e, exit);
             break;
         case EXIT_REASON_HLT:
-            cprintf("\nHLT in guest, exiting guest.\n");
-            env_destroy(curenv);
+            exit_handled = handle_hlt(&curenv->env_tf, &curenv->env_vmxinfo, exit);
+            break;
+        case EXIT_REASON_EXTERNAL_INT:
+            // The host timer ends the slice so the scheduler can run.
+            yield = trap_guest_irq(exit->intr_info & VMX_INTR_INFO_VECTOR_MASK);
+            exit_handled = true;
+            break;
+        case EXIT_REASON_INTERRUPT_WINDOW:
+            // The pending vector is injected on the way back in.
+            exit_handled = true;
+            break;
+        case EXIT_REASON_VMX_PREEMPT_TIMER:
+            // Slice used up, let the scheduler pick the next env.
+            curenv->env_vmxinfo.preempt_exits++;
             exit_handled = true;
             break;
     }
     if(!exit_handled) {
         cprintf( "Unhandled VMEXIT, aborting guest.\n" );
         vmcs_dump_cpu();
+        vmx_exit_account(curenv, exit);
         env_destroy(curenv);
     }
+    vmx_exit_flush(&curenv->env_tf, exit);
+    vmx_exit_account(curenv, exit);
+    if(!yield && vmexit_is_fast(exit)
+            && curenv->env_status == ENV_RUNNING
+            && read_tsc() - curenv->env_vmxinfo.slice_start < curenv->env_vmxinfo.quantum) {
+        return true;
+    }
 //    cprintf("\n Before YIELD\n");
 //curenv->env_runs++;
 //vmx_vmrun(curenv);
 //	while(1);    
+    vmx_ring_idle(curenv, true);
     sched_yield();
 }
 
@@ -434,7 +1005,8 @@ void asm_vmrun(struct Trapframe *tf) {
 //     cprintf("VMRUN\n"); 
     // NOTE: Since we re-use Trapframe structure, tf.tf_err contains the value
     // of cr2 of the guest.
-    tf->tf_ds = curenv->env_runs;
+    // tf_ds == 1 selects VMLAUNCH below, anything else VMRESUME.
+    tf->tf_ds = curenv->env_vmxinfo.vmcs_launched ? 2 : 1;
     tf->tf_es = 0;
     asm(
             "push %%rdx; push %%rbp;"
@@ -457,7 +1029,7 @@ void asm_vmrun(struct Trapframe *tf) {
             /* Check if vmlaunch of vmresume is needed, set the condition code
 	     * appropriately for use below.  
 	     * 
-	     * Hint: We store the number of times the VM has run in tf->tf_ds
+	     * Hint: We store whether the VMCS needs a VMLAUNCH in tf->tf_ds
 	     * 
 	     * Hint: In this function, 
 	     *       you can use register offset addressing mode, such as '%c[rax](%0)' 
@@ -572,30 +1144,68 @@ void asm_vmrun(struct Trapframe *tf) {
 
     if(tf->tf_es) {
         cprintf("Error during VMLAUNCH/VMRESUME\n");
+    }
+    // Guest RIP is read into tf by vmx_read_exit_info(); guest RSP is never
+    // changed by the host, so it stays in the VMCS and is not read back.
+}
+
+// Stop intercepting accesses to msr in the MSR bitmap.  Only the low
+// (0 - 0x1FFF) and high (0xC0000000 - 0xC0001FFF) ranges have bits.
+// See Section 24.6.9 of the Intel manual.
+static void
+msr_bitmap_passthrough(uint8_t *bitmap, uint32_t msr, bool rd, bool wr) {
+    int base;
+
+    if(msr <= 0x1FFF) {
+        base = 0;
+    } else if (msr >= 0xC0000000 && msr <= 0xC0001FFF) {
+        base = 1024;
+        msr -= 0xC0000000;
     } else {
-        curenv->env_tf.tf_rsp = vmcs_read64(VMCS_GUEST_RSP);
-        curenv->env_tf.tf_rip = vmcs_read64(VMCS_GUEST_RIP);
-//	cprintf("END OF VMRUN\n");
-        vmexit();
+        return;
     }
+    if(rd)
+        bitmap[base + msr / 8] &= ~(1 << (msr % 8));
+    if(wr)
+        bitmap[base + 2048 + msr / 8] &= ~(1 << (msr % 8));
 }
 
+/*
+ * Builds the MSR areas swapped on VM entry/exit and the MSR bitmap from
+ * vmx_msr_table[].  The guest area is both the VM-entry load and the VM-exit
+ * store area; the host area is the VM-exit load area.
+ */
 void
 msr_setup(struct VmxGuestInfo *ginfo) {
     struct vmx_msr_entry *entry;
-    uint32_t idx[] = { EFER_MSR };
-    int i, count = sizeof(idx) / sizeof(idx[0]);
+    uint32_t eax, ebx, ecx, edx;
+    int i, count = VMX_MSR_NAUTOLOAD;
+
+    // TSC_AUX only exists with RDTSCP (CPUID.80000001H:EDX[27]).
+    cpuid( 0x80000001, &eax, &ebx, &ecx, &edx );
+    if(!BIT(edx, 27))
+        count = VMX_MSR_TSC_AUX;
 
     assert(count <= MAX_MSR_COUNT);
     ginfo->msr_count = count;
     
     for(i=0; i<count; ++i) {
         entry = ((struct vmx_msr_entry *)ginfo->msr_host_area) + i;
-        entry->msr_index = idx[i];
-        entry->msr_value = read_msr(idx[i]);
+        entry->msr_index = vmx_msr_table[i].msr;
+        entry->msr_value = read_msr(vmx_msr_table[i].msr);
         
         entry = ((struct vmx_msr_entry *)ginfo->msr_guest_area) + i;
-        entry->msr_index = idx[i];
+        entry->msr_index = vmx_msr_table[i].msr;
+    }
+
+    // Intercept everything except MSRs the guest owns outright: the
+    // autoloaded ones and those kept in the VMCS guest-state area.
+    memset(ginfo->msr_bitmap, 0xFF, PGSIZE);
+    for(i=0; i<VMX_MSR_NSLOTS; ++i) {
+        if(i < VMX_MSR_NAUTOLOAD && i >= count)
+            continue;
+        msr_bitmap_passthrough((uint8_t *)ginfo->msr_bitmap, vmx_msr_table[i].msr,
+                !vmx_msr_table[i].rd_exit, !vmx_msr_table[i].wr_exit);
     }
 }
 
@@ -616,30 +1226,87 @@ bitmap_setup(struct VmxGuestInfo *ginfo) {
     }
 }
 
+/*
+ * Makes the VMCS of e the current VMCS on this CPU.  The VMPTRLD is skipped
+ * when this CPU already has it loaded, which is the common case of a guest
+ * being rescheduled on the CPU it last ran on.
+ *
+ * A VMCS may only be VMCLEARed on the CPU where it was last active, and
+ * nothing here sends an IPI to do that elsewhere.  So a guest that has run
+ * must stay on vmcs_cpu: sched_runs_here() only dispatches it there and
+ * env_destroy() leaves freeing it to that CPU.  Moving guests between CPUs
+ * needs a VMCLEAR on the old CPU first.
+ */
+static int
+vmx_load_vmcs( struct Env *e ) {
+    struct VmxGuestInfo *ginfo = &e->env_vmxinfo;
+    physaddr_t vmcs_phy_addr = PADDR(ginfo->vmcs);
+
+    if ( ginfo->vmcs_cpu == cpunum() &&
+            thiscpu->loaded_vmcs == (uintptr_t) ginfo->vmcs ) {
+        thiscpu->vmptrld_skipped++;
+        return 0;
+    }
+
+    if ( ginfo->vmcs_cpu != cpunum() ) {
+        // First run: clear the VMCS so that it is launched on this CPU.
+        assert( ginfo->vmcs_cpu < 0 );
+        // Check if VMCLEAR succeeded. ( RFLAGS.CF = 0 and RFLAGS.ZF = 0 )
+        if ( vmclear(vmcs_phy_addr) )
+            return -E_VMCS_INIT;
+        ginfo->vmcs_launched = false;
+    }
+
+    // Make this VMCS working VMCS.
+    if ( vmptrld(vmcs_phy_addr) )
+        return -E_VMCS_INIT;
+    thiscpu->loaded_vmcs = (uintptr_t) ginfo->vmcs;
+    return 0;
+}
+
+/*
+ * Forgets the VMCS of e on every CPU that has it cached as current, and
+ * VMCLEARs it if it is current on this CPU.  Called before the VMCS page is
+ * freed, on the CPU the guest last ran on (see vmx_load_vmcs()).
+ */
+void
+vmx_vmcs_release( struct Env *e ) {
+    int i;
+
+    assert( e->env_vmxinfo.vmcs_cpu < 0 || e->env_vmxinfo.vmcs_cpu == cpunum() );
+
+    for ( i = 0; i < NCPU; i++ ) {
+        if ( cpus[i].loaded_vmcs != (uintptr_t) e->env_vmxinfo.vmcs )
+            continue;
+        if ( i == cpunum() )
+            vmclear( PADDR(e->env_vmxinfo.vmcs) );
+        cpus[i].loaded_vmcs = 0;
+    }
+    e->env_vmxinfo.vmcs_cpu = -1;
+}
+
 /* 
  * Processor must be in VMX root operation before executing this function.
  */
 int vmx_vmrun( struct Env *e ) {
+    struct vmx_exit_info exit;
+    bool locked, handled;
+    uint64_t tsc;
 
     if ( e->env_type != ENV_TYPE_GUEST ) {
         return -E_INVAL;
     }
-    uint8_t error;
-
-    if( e->env_runs == 1 ) {
-        physaddr_t vmcs_phy_addr = PADDR(e->env_vmxinfo.vmcs);
-
-        // Call VMCLEAR on the VMCS region.
-        error = vmclear(vmcs_phy_addr);
-        // Check if VMCLEAR succeeded. ( RFLAGS.CF = 0 and RFLAGS.ZF = 0 )
-        if ( error )
-            return -E_VMCS_INIT; 
-
-        // Make this VMCS working VMCS.
-        error = vmptrld(vmcs_phy_addr);
-        if ( error )
-            return -E_VMCS_INIT; 
+    int last_cpu = e->env_vmxinfo.vmcs_cpu;
+
+    if ( vmx_load_vmcs(e) < 0 )
+        return -E_VMCS_INIT;
+    e->env_vmxinfo.vmcs_cpu = cpunum();
+    if ( last_cpu != cpunum() ) {
+        // The VPID may have been used on this CPU by an earlier guest.
+        vmx_invvpid(e);
+    }
 
+    if( last_cpu == -1 ) {
         vmcs_host_init();
         vmcs_guest_init();
         // Setup IO and exception bitmaps.
@@ -650,17 +1317,95 @@ int vmx_vmrun( struct Env *e ) {
 
         /* ept_alloc_static(e->env_pml4e, &e->env_vmxinfo); */
 
-    } else {
-        // Make this VMCS working VMCS.
-        error = vmptrld(PADDR(e->env_vmxinfo.vmcs));
-        if ( error ) {
-            return -E_VMCS_INIT; 
+        // From here on the VMCS holds the authoritative guest RIP/RSP;
+        // vmx_exit_flush() keeps RIP in sync with env_tf.
+        if ( e->env_vmxinfo.vcpu_id ) {
+            // APs start in real mode at the page named by the STARTUP IPI.
+            vmcs_write16( VMCS_16BIT_GUEST_CS_SELECTOR, e->env_vmxinfo.sipi_vector << 8 );
+            vmcs_write64( VMCS_GUEST_CS_BASE, (uint64_t)e->env_vmxinfo.sipi_vector << 12 );
+            e->env_tf.tf_rip = 0;
         }
+        vmcs_write64( VMCS_GUEST_RSP, e->env_tf.tf_rsp );
+        vmcs_write64( VMCS_GUEST_RIP, e->env_tf.tf_rip );
+
+    } else if ( last_cpu != cpunum() ) {
+        // Host state (TR, GDT, IDT bases) is per CPU.
+        vmcs_host_init();
     }
 
-    vmcs_write64( VMCS_GUEST_RSP, curenv->env_tf.tf_rsp  );
-    vmcs_write64( VMCS_GUEST_RIP, curenv->env_tf.tf_rip );
+    e->env_vmxinfo.slice_start = read_tsc();
+    if ( e->env_vmxinfo.preempt_timer )
+        vmx_arm_preempt_timer( &e->env_vmxinfo );
+    // Running again: its exits drain the ring, no kicks needed.
+    vmx_ring_idle( e, false );
 //    panic ("asm vmrun incomplete\n");
-    asm_vmrun( &e->env_tf );
+    // Held on entry, from sched_yield().
+    locked = true;
+    while(1) {
+        vmx_irq_deliver( &e->env_vmxinfo );
+        vmx_ept_sync();
+        // The guest runs without the kernel lock, like a user env.
+        if ( locked )
+            unlock_kernel();
+        asm_vmrun( &e->env_tf );
+        tsc = read_tsc();
+        locked = false;
+        if( e->env_tf.tf_es ) {
+            lock_kernel();
+            return -E_VMCS_INIT;
+        }
+        e->env_vmxinfo.vmcs_launched = true;
+        vmx_irq_requeue( &e->env_vmxinfo );
+        vmx_read_exit_info( &e->env_tf, &exit );
+        exit.tsc = tsc;
+        // Guest-local exits are handled and resumed without ever taking the
+        // kernel lock; everything else goes through vmexit() under it.
+        handled = vmexit_local( e, &exit );
+        if( handled )
+            vmx_exit_account( e, &exit );
+        if( !handled || e->env_status != ENV_RUNNING ||
+                read_tsc() - e->env_vmxinfo.slice_start >= e->env_vmxinfo.quantum ) {
+            lock_kernel();
+            locked = true;
+            // Destroyed by another CPU while it ran.
+            if( e->env_status == ENV_DYING ) {
+                vmx_exit_account( e, &exit );
+                env_destroy( e );
+            }
+            if( handled || !vmexit( &exit ) ) {
+                vmx_ring_idle( e, true );
+                sched_yield();
+            }
+        }
+        // Fast path: the exit was handled in place, re-enter the guest
+        // directly.  Without the save control the timer restarts from the
+        // value last written, so write what is left of the slice.
+        e->env_runs++;
+        if ( e->env_vmxinfo.preempt_timer && !e->env_vmxinfo.preempt_save )
+            vmx_arm_preempt_timer( &e->env_vmxinfo );
+    }
     return 0;
 }
+
+static void __attribute__((noreturn, used))
+vmx_run_guest_top( struct Env *e ) {
+    int r = vmx_vmrun( e );
+
+    cprintf( "vmx_vmrun: guest %08x failed: %e\n", e->env_id, r );
+    env_destroy( e );
+    sched_yield();
+}
+
+/*
+ * Runs guest e on the top of this CPU's kernel stack.  Like env_run() it
+ * never returns, so nothing the caller left on the stack is needed, and
+ * starting over keeps the exit -> sched_yield() -> vmx_vmrun() chain from
+ * growing the stack on every guest switch.
+ */
+void
+vmx_run_guest( struct Env *e ) {
+    asm volatile( "mov %0, %%rsp\n\t"
+                  "call vmx_run_guest_top"
+                  : : "r" ( thiscpu->cpu_ts.ts_esp0 ), "D" ( e ) : "memory" );
+    panic( "vmx_run_guest returned" );
+}
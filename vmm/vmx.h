@@ -25,8 +25,59 @@ struct vmx_msr_entry {
     uint64_t msr_value;
 } __attribute__((__packed__));
 
+/*
+ * Decoded once per VM exit and handed to every exit handler, so handlers
+ * never VMREAD the same field twice.  VMCS writes a handler needs (RIP
+ * advance, entry controls) are staged here and flushed once by
+ * vmx_exit_flush() before the guest is re-entered.
+ */
+struct vmx_exit_info {
+    uint32_t reason;            // Basic exit reason (EXIT_REASON_MASK applied).
+    uint64_t qualification;     // Exit qualification, if the exit has one.
+    uint32_t instr_len;         // Length of the exiting instruction, if any.
+    uint64_t gpa;               // Guest-physical address (EPT exits only).
+    uint32_t intr_info;         // Exit interruption info (exception/NMI and
+                                // external interrupt exits only).
+    uint64_t rip;               // Guest RIP at the time of the exit.
+    uint64_t tsc;               // TSC right after the exit.
+    uint64_t vmcall;            // Hypercall number (VMCALL exits only).
+    bool accounted;             // Recorded by vmx_exit_account() already.
+
+    // Staged VMCS writes.
+    uint32_t entry_ctls;
+    bool entry_ctls_dirty;
+};
+
 int vmx_init_vmxon();
+void vmx_exit_stats_sum( struct Env *e, struct vmx_exit_stats *out );
+const char *vmx_exit_reason_name( int reason );
 int vmx_vmrun( struct Env *e );
+void vmx_vmcs_release( struct Env *e );
+uint16_t vmx_alloc_vpid( struct Env *e );
+void vmx_invvpid( struct Env *e );
+void vmx_invept( uint64_t *eptrt );
+
+// Bumped when EPT entries of a running guest are removed; see
+// vmx_ept_sync().
+extern volatile uint64_t vmx_ept_gen;
+uint64_t vmx_ept_bump( void );
+void vmx_ept_sync( void );
+bool vmx_ept_synced( uint64_t gen );
+
+// Tag guest TLB entries with a per-guest VPID (applies to guests created
+// afterwards).  Toggled with the 'vpid' monitor command.
+extern bool vmx_vpid_enable;
+void vmx_exit_flush( struct Trapframe *tf, struct vmx_exit_info *exit );
+void vmx_exit_account( struct Env *e, struct vmx_exit_info *exit );
+// Guests blocked in HLT, so the scheduler knows they will run again.
+// Changed under the kernel lock.
+extern int vmx_halted_guests;
+void vmx_guest_wake( struct Env *e, int reason );
+int vmx_inject_irq( struct Env *e, int vector );
+int vmx_set_quantum( struct Env *e, uint64_t cycles );
+void vmx_halt_poll( void );
+void vmx_guest_tick( void );
+void vmx_run_guest( struct Env *e ) __attribute__((noreturn));
 struct Page * vmx_init_vmcs();
 static inline bool vmx_check_support();
 static inline bool vmx_check_ept();
@@ -48,6 +99,33 @@ static inline bool vmx_check_ept();
 
 #define BIT( val, x ) ( ( val >> x ) & 0x1 )
 
+// INVVPID / INVEPT invalidation types.
+#define VMX_INVVPID_SINGLE_CONTEXT 1
+#define VMX_INVVPID_ALL_CONTEXT 2
+#define VMX_INVEPT_SINGLE_CONTEXT 1
+#define VMX_INVEPT_ALL_CONTEXT 2
+
+// Default guest time slice in TSC cycles.  The slice is enforced by the
+// VMX-preemption timer when the CPU has one; cheap exits (CPUID,
+// RDMSR/WRMSR, I/O) resume the guest in place, without going through
+// sched_yield(), until it is used up.
+#define VMX_GUEST_QUANTUM_DEFAULT 10000000ULL
+
+// A halted guest is woken after this long even if nothing happened, so
+// guests that still poll (timers, net input) make progress.
+#define VMX_HLT_TIMEOUT_MS 10
+
+// Why a halted guest was woken.
+#define VMX_WAKE_TIMER  0x1
+#define VMX_WAKE_IRQ    0x2
+#define VMX_WAKE_IPC    0x4
+#define VMX_WAKE_NET    0x8
+
+static __inline bool vmx_irq_pending( struct VmxGuestInfo *ginfo ) {
+    return ginfo->irq_pending[0] | ginfo->irq_pending[1] |
+        ginfo->irq_pending[2] | ginfo->irq_pending[3];
+}
+
 static __inline uint8_t vmcs_writel( uint32_t field, uint64_t value) {
 	uint8_t error;
 
@@ -330,6 +408,7 @@ static __inline uint64_t vmcs_read64(uint32_t field)
 #define VMCS_PIN_BASED_VMEXEC_CTL_EXINTEXIT	0x1
 #define VMCS_PIN_BASED_VMEXEC_CTL_NMIEXIT	0x8
 #define VMCS_PIN_BASED_VMEXEC_CTL_VIRTNMIS	0x20
+#define VMCS_PIN_BASED_VMEXEC_CTL_PREEMPT_TIMER	0x40
 
 #define VMCS_PROC_BASED_VMEXEC_CTL_INTRWINEXIT  0x4
 #define VMCS_PROC_BASED_VMEXEC_CTL_USETSCOFF	0x8
@@ -354,9 +433,15 @@ static __inline uint64_t vmcs_read64(uint32_t field)
 #define VMCS_PROC_BASED_VMEXEC_CTL_ACTIVESECCTL	0x80000000
 
 #define VMCS_SECONDARY_VMEXEC_CTL_ENABLE_EPT          0x2
+#define VMCS_SECONDARY_VMEXEC_CTL_ENABLE_VPID         0x20
 #define VMCS_SECONDARY_VMEXEC_CTL_UNRESTRICTED_GUEST  0x80
 
 #define VMCS_VMEXIT_HOST_ADDR_SIZE ( 0x1 << 9 )
+#define VMCS_VMEXIT_ACK_INTR ( 0x1 << 15 )
+#define VMCS_VMEXIT_SAVE_PREEMPT_TIMER ( 0x1 << 22 )
+
+// IA32_VMX_MISC[4:0]: the preemption timer ticks every 2^rate TSC cycles.
+#define VMX_MISC_PREEMPT_RATE_MASK 0x1F
 
 #define VMCS_VMENTRY_x64_GUEST ( 0x1 << 9 )
 
@@ -416,6 +501,16 @@ static __inline uint64_t vmcs_read64(uint32_t field)
 #define EXIT_REASON_WBINVD		0x36
 #define EXIT_REASON_XSETBV		0x37
 
+// VM-entry interruption-information and IDT-vectoring information fields.
+#define VMX_INTR_INFO_VECTOR_MASK	0xFF
+#define VMX_INTR_INFO_TYPE_MASK		0x700
+#define VMX_INTR_TYPE_EXT_INTR		0x000
+#define VMX_INTR_INFO_VALID		0x80000000
+
+// Guest interruptibility state: blocking by STI / by MOV SS.
+#define VMX_INTR_BLOCK_STI		0x1
+#define VMX_INTR_BLOCK_MOV_SS		0x2
+
 #define VMEXIT_CR0_READ			0x0
 #define VMEXIT_CR1_READ			0x1
 #define VMEXIT_CR2_READ			0x2
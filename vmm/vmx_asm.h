@@ -9,6 +9,8 @@
 static __inline uint8_t vmxon( physaddr_t vmxon_region ) __attribute((always_inline));
 static __inline uint8_t vmclear( physaddr_t vmcs_region ) __attribute((always_inline));
 static __inline uint8_t vmptrld( physaddr_t vmcs_region ) __attribute((always_inline));
+static __inline uint8_t invvpid( uint64_t type, uint16_t vpid, uint64_t gva ) __attribute((always_inline));
+static __inline uint8_t invept( uint64_t type, uint64_t eptp ) __attribute((always_inline));
 
 
 static __inline uint8_t
@@ -38,6 +40,32 @@ vmptrld( physaddr_t vmcs_region ) {
     return error;
 }
 
+static __inline uint8_t
+invvpid( uint64_t type, uint16_t vpid, uint64_t gva ) {
+	uint8_t error = 0;
+	struct {
+		uint64_t vpid;
+		uint64_t gva;
+	} desc = { vpid, gva };
+
+    __asm __volatile("clc; invvpid %1, %2; setna %0"
+            : "=q"( error ) : "m" ( desc ), "r" ( type ) : "cc", "memory");
+    return error;
+}
+
+static __inline uint8_t
+invept( uint64_t type, uint64_t eptp ) {
+	uint8_t error = 0;
+	struct {
+		uint64_t eptp;
+		uint64_t reserved;
+	} desc = { eptp, 0 };
+
+    __asm __volatile("clc; invept %1, %2; setna %0"
+            : "=q"( error ) : "m" ( desc ), "r" ( type ) : "cc", "memory");
+    return error;
+}
+
 static __inline uint8_t
 vmlaunch() {
 	uint8_t error = 0;
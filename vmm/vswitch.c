@@ -0,0 +1,314 @@
+#include <vmm/vmx.h>
+#include <vmm/vswitch.h>
+#include <vmm/pvnet.h>
+
+#include <inc/error.h>
+#include <inc/string.h>
+#include <kern/env.h>
+#include <kern/e1000.h>
+
+/*
+ * Virtual Ethernet switch between the e1000, the host and the guests.
+ *
+ * Every guest that uses the network gets a port with its own MAC address,
+ * which the e1000 is told to accept as well.  Frames are switched on their
+ * destination MAC: broadcast and multicast go to every port but the one
+ * they came from, frames for a known port go to it alone, and other
+ * unicast leaves through the uplink (or, coming in from the wire, goes to
+ * the host).  So host-to-guest and guest-to-guest traffic never touches
+ * the card, and frames the host does not want are not copied for it.
+ *
+ * Guests with a paravirtual receive ring get frames straight into it;
+ * the host and guests polling VMX_VMCALL_NETRECV get them through a small
+ * queue on their port.  All of this runs under the kernel lock.
+ */
+
+struct vsw_port vsw_ports[VSW_PORTS];
+
+static bool vsw_ready;
+
+static void
+vsw_init(void)
+{
+    if (vsw_ready)
+        return;
+    e1000_get_mac(vsw_ports[VSW_PORT_HOST].mac);
+    vsw_ready = true;
+}
+
+static bool
+vsw_active(int p)
+{
+    return p == VSW_PORT_WIRE || p == VSW_PORT_HOST || vsw_ports[p].env;
+}
+
+static struct Env *
+vsw_owner(struct Env *e)
+{
+    return &envs[ENVX(e->env_vmxinfo.vcpu_bsp)];
+}
+
+/*
+ * Returns the port of e's guest, attaching the guest to a free one, with
+ * the next MAC address after the card's, the first time.  Returns
+ * -E_NO_MEM if all ports are taken.
+ */
+int
+vsw_guest_port(struct Env *e)
+{
+    struct Env *g = vsw_owner(e);
+    struct vsw_port *port;
+    int p;
+
+    vsw_init();
+    if (g->env_vmxinfo.vsw_port)
+        return g->env_vmxinfo.vsw_port;
+    for (p = VSW_PORT_HOST + 1; p < VSW_PORTS; p++) {
+        port = &vsw_ports[p];
+        if (port->env)
+            continue;
+        memset(port, 0, sizeof(*port));
+        port->env = g->env_id;
+        memmove(port->mac, vsw_ports[VSW_PORT_HOST].mac, 6);
+        port->mac[5] += p;
+        e1000_set_mac(p, port->mac);
+        g->env_vmxinfo.vsw_port = p;
+        return p;
+    }
+    return -E_NO_MEM;
+}
+
+/*
+ * Frees the port of guest e when it is freed.
+ */
+void
+vsw_guest_free(struct Env *e)
+{
+    int p = e->env_vmxinfo.vsw_port;
+
+    if (e->env_vmxinfo.vcpu_id || !p)
+        return;
+    e1000_set_mac(p, NULL);
+    vsw_ports[p].env = 0;
+    e->env_vmxinfo.vsw_port = 0;
+}
+
+/*
+ * Is a frame queued on the port of e's guest?
+ */
+bool
+vsw_guest_pending(struct Env *e)
+{
+    int p = vsw_owner(e)->env_vmxinfo.vsw_port;
+
+    return p && vsw_ports[p].q_head != vsw_ports[p].q_tail;
+}
+
+/*
+ * Returns the ports frame [frame, frame + len), coming in on port src,
+ * must go to.
+ */
+uint32_t
+vsw_route(int src, const char *frame, int len)
+{
+    const uint8_t *dst = (const uint8_t *) frame;
+    uint32_t ports = 0;
+    int p;
+
+    vsw_init();
+    if (len < 14)
+        return 0;
+    if (dst[0] & 1) {
+        // Broadcast and multicast go everywhere but back.
+        for (p = 0; p < VSW_PORTS; p++)
+            if (p != src && vsw_active(p))
+                ports |= 1 << p;
+        return ports;
+    }
+    for (p = VSW_PORT_HOST; p < VSW_PORTS; p++)
+        if (vsw_active(p) && !memcmp(dst, vsw_ports[p].mac, 6))
+            return p == src ? 0 : 1 << p;
+    // Whatever the card let in for no port we know was always the host's.
+    return src == VSW_PORT_WIRE ? 1 << VSW_PORT_HOST : 1 << VSW_PORT_WIRE;
+}
+
+// Wakes the vCPUs of guest g that sit in HLT, e.g. waiting for a frame
+// they will poll for with VMX_VMCALL_NETRECV.
+static void
+vsw_wake(struct Env *g)
+{
+    struct Env *v;
+    int i;
+
+    vmx_guest_wake(g, VMX_WAKE_NET);
+    for (i = 1; i < g->env_vmxinfo.nvcpus; i++)
+        if (g->env_vmxinfo.vcpus[i] &&
+                envid2env(g->env_vmxinfo.vcpus[i], &v, 0) == 0)
+            vmx_guest_wake(v, VMX_WAKE_NET);
+}
+
+// Hands a copy of frame [frame, frame + len) to port p (not the uplink).
+static void
+vsw_deliver(int p, const char *frame, int len)
+{
+    struct vsw_port *port = &vsw_ports[p];
+    struct Env *g = NULL;
+
+    if (p != VSW_PORT_HOST && envid2env(port->env, &g, 0) < 0) {
+        port->drops++;
+        return;
+    }
+    if (g && g->env_vmxinfo.pvnet[VMX_PVNET_RX]) {
+        if (!vmx_pvnet_rx(g, frame, len)) {
+            port->drops++;
+            return;
+        }
+    } else {
+        if (port->q_tail - port->q_head == VSW_QLEN || len > E1000_TXPCKTSZ) {
+            port->drops++;
+            return;
+        }
+        memmove(port->q_buf[port->q_tail % VSW_QLEN], frame, len);
+        port->q_len[port->q_tail % VSW_QLEN] = len;
+        port->q_tail++;
+        if (g)
+            vsw_wake(g);
+    }
+    port->rx_frames++;
+    port->rx_bytes += len;
+}
+
+/*
+ * Counts a frame from port src that went straight to the card.
+ */
+void
+vsw_account_wire(int src, int len)
+{
+    vsw_ports[src].tx_frames++;
+    vsw_ports[src].tx_bytes += len;
+    vsw_ports[VSW_PORT_WIRE].rx_frames++;
+    vsw_ports[VSW_PORT_WIRE].rx_bytes += len;
+}
+
+/*
+ * Sends frame [frame, frame + len), from port src, to 'ports' as returned
+ * by vsw_route().  The card gets it first: without copying if zerocopy,
+ * for callers that wait for *stamp before reusing the buffer (see
+ * e1000_transmit_pages()), else copied from 'frame', which must be
+ * mapped in the current address space.  If the card is full the frame goes
+ * nowhere and -E_TX_FULL is returned, so the caller can simply retry.
+ */
+int
+vsw_forward(int src, uint32_t ports, char *frame, int len, bool zerocopy,
+        uint64_t *stamp)
+{
+    int p, r;
+
+    if (ports & (1 << VSW_PORT_WIRE)) {
+        if (len > E1000_TXPCKTSZ)
+            return -E_PKT_TOO_LONG;
+        if (zerocopy)
+            r = e1000_transmit_pages(&frame, &len, 1, stamp) ? 0 : -E_TX_FULL;
+        else
+            r = e1000_transmit(frame, len);
+        if (r < 0)
+            return r;
+        vsw_ports[VSW_PORT_WIRE].rx_frames++;
+        vsw_ports[VSW_PORT_WIRE].rx_bytes += len;
+    }
+    for (p = VSW_PORT_HOST; p < VSW_PORTS; p++)
+        if (ports & (1 << p))
+            vsw_deliver(p, frame, len);
+    vsw_ports[src].tx_frames++;
+    vsw_ports[src].tx_bytes += len;
+    return 0;
+}
+
+/*
+ * Switches a copy of frame [frame, frame + len) from port src; see
+ * vsw_forward().
+ */
+int
+vsw_transmit(int src, char *frame, int len)
+{
+    if (len < 14)
+        return -E_INVAL;
+    return vsw_forward(src, vsw_route(src, frame, len), frame, len,
+            false, NULL);
+}
+
+// Switches the frames the card has received.  If data is not NULL, stops
+// at the first one for the host, copies it there and returns its length;
+// otherwise the host's frames are queued on its port.  Once that queue is
+// full the rest stay on the card, whose ring holds a burst the queue would
+// drop, until the host asks for them.  Returns -E_RCV_EMPTY once the card
+// has no more, or no more it can switch.
+static int
+vsw_pull(char *data)
+{
+    struct vsw_port *wire = &vsw_ports[VSW_PORT_WIRE];
+    struct vsw_port *host = &vsw_ports[VSW_PORT_HOST];
+    uint32_t ports;
+    char *frame;
+    int len, p;
+
+    while ((len = e1000_rx_peek(&frame)) >= 0) {
+        ports = vsw_route(VSW_PORT_WIRE, frame, len);
+        if ((ports & (1 << VSW_PORT_HOST)) && !data &&
+                host->q_tail - host->q_head == VSW_QLEN)
+            break;
+        wire->tx_frames++;
+        wire->tx_bytes += len;
+        for (p = VSW_PORT_HOST + 1; p < VSW_PORTS; p++)
+            if (ports & (1 << p))
+                vsw_deliver(p, frame, len);
+        if ((ports & (1 << VSW_PORT_HOST)) && data) {
+            memmove(data, frame, len);
+            vsw_ports[VSW_PORT_HOST].rx_frames++;
+            vsw_ports[VSW_PORT_HOST].rx_bytes += len;
+            e1000_rx_release();
+            return len;
+        }
+        if (ports & (1 << VSW_PORT_HOST))
+            vsw_deliver(VSW_PORT_HOST, frame, len);
+        e1000_rx_release();
+    }
+    return -E_RCV_EMPTY;
+}
+
+/*
+ * Copies the next frame for port p (the host's, or a guest polling
+ * VMX_VMCALL_NETRECV) to data and returns its length, or returns
+ * -E_RCV_EMPTY.
+ */
+int
+vsw_receive(int p, char *data)
+{
+    struct vsw_port *port = &vsw_ports[p];
+    int len;
+
+    vsw_init();
+    if (port->q_head == port->q_tail) {
+        if (p == VSW_PORT_HOST)
+            return vsw_pull(data);
+        vsw_pull(NULL);
+        if (port->q_head == port->q_tail)
+            return -E_RCV_EMPTY;
+    }
+    len = port->q_len[port->q_head % VSW_QLEN];
+    memmove(data, port->q_buf[port->q_head % VSW_QLEN], len);
+    port->q_head++;
+    return len;
+}
+
+/*
+ * Switches whatever the card has received, so guests get their frames
+ * even while the host is not asking for its own.  Called on every timer
+ * tick.
+ */
+void
+vsw_poll(void)
+{
+    vsw_init();
+    vsw_pull(NULL);
+}
@@ -0,0 +1,47 @@
+#ifndef JOS_VMM_VSWITCH_H
+#define JOS_VMM_VSWITCH_H
+
+#include <inc/types.h>
+#include <kern/e1000.h>
+
+struct Env;
+
+// Ports of the virtual Ethernet switch.  Port 0 is the uplink to the
+// e1000, port 1 the host's own network stack, the rest are given out to
+// guests.  Port sets are bitmasks of (1 << port).
+#define VSW_PORT_WIRE   0
+#define VSW_PORT_HOST   1
+#define VSW_PORTS       8
+// Frames queued on a port without a paravirtual receive ring.
+#define VSW_QLEN        16
+
+struct vsw_port {
+    int32_t env;                // guest BSP on a guest port, 0 if free
+    uint8_t mac[6];
+    // Frames and bytes the switch handed to the port (rx) and took from
+    // it (tx), and frames for the port that found no room.
+    uint64_t rx_frames;
+    uint64_t rx_bytes;
+    uint64_t tx_frames;
+    uint64_t tx_bytes;
+    uint64_t drops;
+    uint32_t q_head;
+    uint32_t q_tail;
+    uint16_t q_len[VSW_QLEN];
+    uint8_t q_buf[VSW_QLEN][E1000_TXPCKTSZ];
+};
+
+extern struct vsw_port vsw_ports[VSW_PORTS];
+
+int vsw_guest_port( struct Env *e );
+void vsw_guest_free( struct Env *e );
+bool vsw_guest_pending( struct Env *e );
+uint32_t vsw_route( int src, const char *frame, int len );
+int vsw_forward( int src, uint32_t ports, char *frame, int len,
+        bool zerocopy, uint64_t *stamp );
+void vsw_account_wire( int src, int len );
+int vsw_transmit( int src, char *frame, int len );
+int vsw_receive( int port, char *data );
+void vsw_poll( void );
+
+#endif